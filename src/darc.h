@@ -0,0 +1,129 @@
+#ifndef DARC_H
+#define DARC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+enum darc_status{
+	DARC_OK,DARC_MEM_ERROR,DARC_STREAM_ERROR,DARC_DATA_ERROR,DARC_NEED_DICT,
+	DARC_BUF_ERROR,DARC_TRUNCATED,DARC_READ_ERROR,DARC_WRITE_ERROR,
+	DARC_FORMAT_ERROR,DARC_DUPLICATE_ERROR
+};
+
+/* Returns the number of bytes read, 0 at the end of the data or (size_t)-1
+on error. */
+typedef size_t (*darc_read_fn)(void*user,void*buf,size_t size);
+/* Returns 0 when all size bytes were written. */
+typedef int (*darc_write_fn)(void*user,const void*buf,size_t size);
+
+typedef struct darc_ctx darc_ctx;
+
+/* A context compresses(decompress=0) or decompresses zlib streams one after
+another, reusing its z_stream and buffers. level is as for deflateInit. */
+darc_ctx *darc_ctx_new(int decompress,int level);
+void darc_ctx_free(darc_ctx*ctx);
+/* Drops the current stream; the next call starts a new one. */
+int darc_ctx_reset(darc_ctx*ctx);
+/* windowBits, memLevel and strategy as for deflateInit2(only windowBits, as
+for inflateInit2, when decompressing). The current stream is dropped. A raw
+stream(negative windowBits) is started with the dictionary, if any. */
+int darc_ctx_set_params(darc_ctx*ctx,int window_bits,int mem_level,int strategy);
+/* The dictionary is not copied and must outlive its use. NULL removes it. */
+int darc_ctx_set_dictionary(darc_ctx*ctx,const void*dict,size_t size);
+/* The adler32 of the dictionary the last stream asked for. */
+unsigned long darc_ctx_dictionary_id(const darc_ctx*ctx);
+/* Sizes of the buffers used by push(output) and stream(input and output). */
+int darc_ctx_set_buffers(darc_ctx*ctx,size_t ibs,size_t obs);
+/* zlib's message for the last error, or "". */
+const char *darc_ctx_message(const darc_ctx*ctx);
+
+/* Push: feeds the next piece of the stream, finish marks the last one. The
+output is passed to write in pieces of up to obs bytes; when compressing, what
+does not fill one waits for the next call, a flush or the end of the stream. */
+int darc_ctx_push(darc_ctx*ctx,const void*in,size_t size,int finish,darc_write_fn write,void*wuser);
+/* Decompression up to the end of the current stream: *size is left with the
+bytes after it, which are not consumed. darc_ctx_at_end tells whether the end
+was reached; darc_ctx_reset starts the next stream. */
+int darc_ctx_push_member(darc_ctx*ctx,const void*in,size_t*size,darc_write_fn write,void*wuser);
+int darc_ctx_at_end(const darc_ctx*ctx);
+/* Compression: Z_SYNC_FLUSH(full=0) or Z_FULL_FLUSH of what was pushed, all
+of the output passed to write. */
+int darc_ctx_flush(darc_ctx*ctx,int full,darc_write_fn write,void*wuser);
+/* Compression: level and strategy(as for deflateParams) from the next push on.
+What the stream holds is compressed with the old ones first. */
+int darc_ctx_set_level(darc_ctx*ctx,int level,int strategy,darc_write_fn write,void*wuser);
+/* The level and strategy in effect: a switch deflate could not make yet is
+tried again by the next darc_ctx_set_level. */
+void darc_ctx_get_level(const darc_ctx*ctx,int*level,int*strategy);
+/* Pull: the whole stream from read to write; when decompressing, the zlib
+streams that follow it too. */
+int darc_ctx_stream(darc_ctx*ctx,darc_read_fn read,void*ruser,darc_write_fn write,void*wuser);
+
+/* One-shot: *dstsz is the capacity of dst on input and the size of the
+result on output. DARC_BUF_ERROR if dst is too small. */
+int darc_ctx_buffer(darc_ctx*ctx,const void*src,size_t srcsz,void*dst,size_t*dstsz);
+size_t darc_compress_bound(size_t size);
+int darc_compress_buffer(const void*src,size_t srcsz,void*dst,size_t*dstsz,int level);
+int darc_decompress_buffer(const void*src,size_t srcsz,void*dst,size_t*dstsz);
+/* The two above reuse up to 8 idle contexts between calls; this frees them. */
+void darc_ctx_pool_clear(void);
+
+const char *darc_status_string(int status);
+
+/* Archives hold members one after another, then a directory(a hash table of
+the names) and a fixed-size trailer that locates it at the end of the file. */
+struct darc_member{
+	const char *name;
+	size_t namesz;
+	unsigned long long offset,csize,esize;
+	unsigned long check;
+	int stored;
+};
+
+typedef struct darc_archive darc_archive;
+
+/* Reads the directory; *status tells why NULL was returned. */
+darc_archive *darc_archive_open(const char*path,int*status);
+void darc_archive_close(darc_archive*a);
+size_t darc_archive_count(const darc_archive*a);
+/* Members are numbered in the order they were added. */
+const struct darc_member *darc_archive_member(const darc_archive*a,size_t i);
+const struct darc_member *darc_archive_find(const darc_archive*a,const char*name,size_t namesz);
+/* dst holds m->esize bytes. The check is verified. An archive serves one
+thread at a time. */
+int darc_archive_read(darc_archive*a,const struct darc_member*m,void*dst);
+int darc_archive_extract(darc_archive*a,const struct darc_member*m,darc_write_fn write,void*wuser);
+/* The m->esize bytes of the member without a copy where possible: stored
+members point into the mapped archive, compressed ones are inflated once and
+kept in a cache of the most recently used. The data stays valid until the
+matching darc_archive_release. */
+const void *darc_archive_acquire(darc_archive*a,const struct darc_member*m,int*status);
+void darc_archive_release(darc_archive*a,const struct darc_member*m);
+/* 64 MiB by default. Members being held are never dropped. */
+void darc_archive_set_cache_limit(darc_archive*a,size_t bytes);
+
+typedef struct darc_archive_writer darc_archive_writer;
+
+darc_archive_writer *darc_archive_writer_new(int level,darc_write_fn write,void*wuser);
+/* A member that does not compress at least 1.5 times is stored. */
+int darc_archive_add(darc_archive_writer*w,const char*name,size_t namesz,const void*data,size_t size);
+/* The parts of darc_archive_add, so that members can be compressed on several
+threads and added in order: pack fills m(all but name and offset) and
+compresses into dst, which holds darc_compress_bound(size) bytes; *dstsz is 0
+when the member is stored and data itself is what is added. */
+int darc_archive_pack(darc_ctx*ctx,const void*data,size_t size,void*dst,size_t*dstsz,struct darc_member*m);
+/* data is the m->csize bytes of the member as they are in an archive. */
+int darc_archive_add_packed(darc_archive_writer*w,const char*name,size_t namesz,const struct darc_member*m,const void*data);
+/* Adds member m of archive a as it is, without recompressing it. */
+int darc_archive_copy(darc_archive_writer*w,darc_archive*a,const struct darc_member*m,const char*name,size_t namesz);
+/* Writes the directory and the trailer. w is freed either way. */
+int darc_archive_finish(darc_archive_writer*w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1040 @@
+#include "config.h"
+#include <zlib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "darc.h"
+
+#define DARC_BUFFER_SIZE 0x40000
+#define DARC_WINDOW_SIZE 0x8000
+/* What deflateInit and inflate allocate with the default windowBits and
+memLevel: the window, prev and head, pending_buf and the state; the window and
+the state for inflate. */
+#define DARC_DEFLATE_ARENA_SIZE ((1<<(MAX_WBITS+2))+(1<<(8+9))+0x8000)
+#define DARC_INFLATE_ARENA_SIZE ((1<<MAX_WBITS)+0x2000)
+#define DARC_CTX_POOL_SIZE 8
+
+enum darc_ctx_state{
+	darc_ctx_fresh,darc_ctx_running,darc_ctx_ended,darc_ctx_done
+};
+
+struct darc_ctx{
+	z_stream s;
+	int decompress,level,state;
+	int wbits,curlevel,strategy;
+	Bytef *arena;
+	size_t arenasz,arenaused;
+	const Bytef *dict;
+	uInt dictsz;
+	uLong dictid,needid;
+	Bytef *ibuf,*obuf;
+	size_t ibs,obs,opos;
+};
+
+/* zlib's allocations for a stream are carved out of one block, which lives
+as long as the context; only what does not fit in it goes to malloc. */
+static voidpf darc_ctx_zalloc(voidpf opaque,uInt items,uInt size){
+	darc_ctx *ctx=opaque;
+	size_t sz=(size_t)items*size,asz=(sz+15)&~(size_t)15;
+	if(asz<=ctx->arenasz-ctx->arenaused){
+		void *p=ctx->arena+ctx->arenaused;
+		ctx->arenaused+=asz;
+		return p;
+	}
+	return malloc(sz);
+}
+
+static void darc_ctx_zfree(voidpf opaque,voidpf p){
+	darc_ctx *ctx=opaque;
+	if((uintptr_t)p<(uintptr_t)ctx->arena || (uintptr_t)p>=(uintptr_t)ctx->arena+ctx->arenasz)
+		free(p);
+}
+
+darc_ctx *darc_ctx_new(int decompress,int level){
+	darc_ctx *ctx=calloc(1,sizeof(*ctx));
+	if(!ctx)
+		return NULL;
+	ctx->decompress=decompress;
+	ctx->level=ctx->curlevel=level;
+	ctx->wbits=MAX_WBITS;
+	ctx->strategy=Z_DEFAULT_STRATEGY;
+	ctx->ibs=ctx->obs=DARC_BUFFER_SIZE;
+	size_t asz=decompress?DARC_INFLATE_ARENA_SIZE:DARC_DEFLATE_ARENA_SIZE;
+	if((ctx->arena=malloc(asz)))
+		ctx->arenasz=asz;
+	ctx->s.zalloc=darc_ctx_zalloc;
+	ctx->s.zfree=darc_ctx_zfree;
+	ctx->s.opaque=ctx;
+	if((decompress?inflateInit(&ctx->s):deflateInit(&ctx->s,level))!=Z_OK){
+		free(ctx->arena);
+		free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+void darc_ctx_free(darc_ctx*ctx){
+	if(!ctx)
+		return;
+	if(ctx->decompress)
+		inflateEnd(&ctx->s);
+	else
+		deflateEnd(&ctx->s);
+	free(ctx->ibuf);
+	free(ctx->obuf);
+	free(ctx->arena);
+	free(ctx);
+}
+
+int darc_ctx_reset(darc_ctx*ctx){
+	if(ctx->state==darc_ctx_fresh)
+		return DARC_OK;
+	if((ctx->decompress?inflateReset(&ctx->s):deflateReset(&ctx->s))!=Z_OK)
+		return DARC_STREAM_ERROR;
+	ctx->state=darc_ctx_fresh;
+	ctx->opos=0;
+	return DARC_OK;
+}
+
+/* The stream is made anew; on failure the context can only be freed. */
+int darc_ctx_set_params(darc_ctx*ctx,int window_bits,int mem_level,int strategy){
+	if(ctx->decompress)
+		inflateEnd(&ctx->s);
+	else
+		deflateEnd(&ctx->s);
+	ctx->arenaused=0;
+	ctx->state=darc_ctx_fresh;
+	ctx->opos=0;
+	ctx->wbits=window_bits;
+	ctx->curlevel=ctx->level;
+	ctx->strategy=strategy;
+	int e=ctx->decompress?inflateInit2(&ctx->s,window_bits):
+		deflateInit2(&ctx->s,ctx->level,Z_DEFLATED,window_bits,mem_level,strategy);
+	return e==Z_OK?DARC_OK:e==Z_MEM_ERROR?DARC_MEM_ERROR:DARC_STREAM_ERROR;
+}
+
+/* Only the last window of a dictionary can be referenced, so only it is kept
+and identified. */
+int darc_ctx_set_dictionary(darc_ctx*ctx,const void*dict,size_t size){
+	if(!dict || !size){
+		ctx->dict=NULL;
+		ctx->dictsz=0;
+		ctx->dictid=0;
+		return DARC_OK;
+	}
+	ctx->dictsz=size<DARC_WINDOW_SIZE?size:DARC_WINDOW_SIZE;
+	ctx->dict=(const Bytef*)dict+size-ctx->dictsz;
+	ctx->dictid=adler32(adler32(0L,Z_NULL,0),ctx->dict,ctx->dictsz);
+	return DARC_OK;
+}
+
+unsigned long darc_ctx_dictionary_id(const darc_ctx*ctx){
+	return ctx->needid;
+}
+
+const char *darc_ctx_message(const darc_ctx*ctx){
+	return ctx->s.msg?ctx->s.msg:"";
+}
+
+int darc_ctx_set_buffers(darc_ctx*ctx,size_t ibs,size_t obs){
+	if(!ibs || !obs)
+		return DARC_BUF_ERROR;
+	if(ibs!=ctx->ibs){
+		free(ctx->ibuf);
+		ctx->ibuf=NULL;
+		ctx->ibs=ibs;
+	}
+	if(obs!=ctx->obs){
+		if(ctx->opos)
+			return DARC_BUF_ERROR;
+		free(ctx->obuf);
+		ctx->obuf=NULL;
+		ctx->obs=obs;
+	}
+	return DARC_OK;
+}
+
+static int darc_ctx_begin(darc_ctx*ctx){
+	int r;
+	if(ctx->state==darc_ctx_done && (r=darc_ctx_reset(ctx))!=DARC_OK)
+		return r;
+	if(ctx->state==darc_ctx_fresh){
+		/* A raw stream can't ask for its dictionary, so it is set up front. */
+		if(ctx->dict && (ctx->decompress?ctx->wbits<0 && inflateSetDictionary(&ctx->s,ctx->dict,ctx->dictsz)!=Z_OK:
+		deflateSetDictionary(&ctx->s,ctx->dict,ctx->dictsz)!=Z_OK))
+			return DARC_STREAM_ERROR;
+		ctx->state=darc_ctx_running;
+	}
+	return DARC_OK;
+}
+
+static int darc_ctx_fail(darc_ctx*ctx,int r){
+	ctx->state=darc_ctx_done;
+	return r;
+}
+
+/* Maps an inflate or deflate result to a status; a requested dictionary is
+set here when it is the one the stream was made with. */
+static int darc_ctx_check(darc_ctx*ctx,int*e){
+	switch(*e){
+		case Z_NEED_DICT:{
+			ctx->needid=ctx->s.adler;
+			if(!ctx->dict || ctx->dictid!=ctx->s.adler)
+				return DARC_NEED_DICT;
+			if(inflateSetDictionary(&ctx->s,ctx->dict,ctx->dictsz)!=Z_OK)
+				return DARC_STREAM_ERROR;
+			*e=Z_OK;
+			return DARC_OK;
+		}
+		case Z_DATA_ERROR:return DARC_DATA_ERROR;
+		case Z_MEM_ERROR:return DARC_MEM_ERROR;
+		case Z_STREAM_ERROR:return DARC_STREAM_ERROR;
+		case Z_STREAM_END:{
+			if(ctx->decompress)
+				ctx->state=darc_ctx_ended;
+			return DARC_OK;
+		}
+		default:return DARC_OK;
+	}
+}
+
+static int darc_ctx_drain(darc_ctx*ctx,darc_write_fn write,void*wuser){
+	if(ctx->opos && write(wuser,ctx->obuf,ctx->opos))
+		return DARC_WRITE_ERROR;
+	ctx->opos=0;
+	return DARC_OK;
+}
+
+/* Runs the codec over the *size bytes at *in, which are advanced past what
+was consumed. The output collects in obuf and goes to write whenever obuf is
+full; all of it goes when decompressing, even up to a fault, and after a flush
+or at the end of the stream. Decompression stops at the end of the stream,
+leaving the rest of the input. */
+static int darc_ctx_run(darc_ctx*ctx,const Bytef**in,size_t*size,int flush,darc_write_fn write,void*wuser){
+	int r=darc_ctx_begin(ctx),e;
+	if(r!=DARC_OK)
+		return darc_ctx_fail(ctx,r);
+	if(!ctx->obuf && !(ctx->obuf=malloc(ctx->obs)))
+		return darc_ctx_fail(ctx,DARC_MEM_ERROR);
+	do{
+		uInt piece=*size<UINT_MAX?*size:UINT_MAX;
+		size_t o=ctx->obs-ctx->opos;
+		ctx->s.next_in=(Bytef*)*in;
+		ctx->s.avail_in=piece;
+		ctx->s.next_out=ctx->obuf+ctx->opos;
+		ctx->s.avail_out=o<UINT_MAX?o:UINT_MAX;
+		o=ctx->s.avail_out;
+		e=ctx->decompress?inflate(&ctx->s,Z_NO_FLUSH):deflate(&ctx->s,*size>piece?Z_NO_FLUSH:flush);
+		*in+=piece-ctx->s.avail_in;
+		*size-=piece-ctx->s.avail_in;
+		ctx->opos+=o-ctx->s.avail_out;
+		if((r=darc_ctx_check(ctx,&e))!=DARC_OK){
+			if(ctx->decompress)
+				darc_ctx_drain(ctx,write,wuser);
+			return darc_ctx_fail(ctx,r);
+		}
+		if(ctx->opos==ctx->obs && (r=darc_ctx_drain(ctx,write,wuser))!=DARC_OK)
+			return darc_ctx_fail(ctx,r);
+	}while(e!=Z_STREAM_END && (!ctx->s.avail_out || *size));
+	if((ctx->decompress || flush!=Z_NO_FLUSH || e==Z_STREAM_END) && (r=darc_ctx_drain(ctx,write,wuser))!=DARC_OK)
+		return darc_ctx_fail(ctx,r);
+	return DARC_OK;
+}
+
+int darc_ctx_push(darc_ctx*ctx,const void*in,size_t size,int finish,darc_write_fn write,void*wuser){
+	const Bytef *p=in;
+	int r=darc_ctx_run(ctx,&p,&size,finish?Z_FINISH:Z_NO_FLUSH,write,wuser);
+	if(r!=DARC_OK)
+		return r;
+	if(size)
+		return darc_ctx_fail(ctx,DARC_DATA_ERROR);
+	if(finish){
+		r=ctx->decompress && ctx->state!=darc_ctx_ended?DARC_TRUNCATED:DARC_OK;
+		ctx->state=darc_ctx_done;
+	}
+	return r;
+}
+
+int darc_ctx_push_member(darc_ctx*ctx,const void*in,size_t*size,darc_write_fn write,void*wuser){
+	if(!ctx->decompress)
+		return darc_ctx_fail(ctx,DARC_STREAM_ERROR);
+	const Bytef *p=in;
+	return darc_ctx_run(ctx,&p,size,Z_NO_FLUSH,write,wuser);
+}
+
+int darc_ctx_at_end(const darc_ctx*ctx){
+	return ctx->state==darc_ctx_ended;
+}
+
+int darc_ctx_flush(darc_ctx*ctx,int full,darc_write_fn write,void*wuser){
+	if(ctx->decompress)
+		return darc_ctx_fail(ctx,DARC_STREAM_ERROR);
+	const Bytef *p=NULL;
+	size_t size=0;
+	return darc_ctx_run(ctx,&p,&size,full?Z_FULL_FLUSH:Z_SYNC_FLUSH,write,wuser);
+}
+
+/* deflateParams compresses what the stream holds with the old parameters and
+Z_BUF_ERROR with no room left asks for more; with room left the parameters
+could not be switched yet and are tried again with the next block. */
+int darc_ctx_set_level(darc_ctx*ctx,int level,int strategy,darc_write_fn write,void*wuser){
+	if(ctx->decompress)
+		return darc_ctx_fail(ctx,DARC_STREAM_ERROR);
+	if(level==ctx->curlevel && strategy==ctx->strategy)
+		return DARC_OK;
+	int r=darc_ctx_begin(ctx),e;
+	if(r!=DARC_OK)
+		return darc_ctx_fail(ctx,r);
+	if(!ctx->obuf && !(ctx->obuf=malloc(ctx->obs)))
+		return darc_ctx_fail(ctx,DARC_MEM_ERROR);
+	do{
+		if(ctx->opos==ctx->obs && (r=darc_ctx_drain(ctx,write,wuser))!=DARC_OK)
+			return darc_ctx_fail(ctx,r);
+		size_t o=ctx->obs-ctx->opos;
+		ctx->s.avail_in=0;
+		ctx->s.next_out=ctx->obuf+ctx->opos;
+		ctx->s.avail_out=o<UINT_MAX?o:UINT_MAX;
+		o=ctx->s.avail_out;
+		e=deflateParams(&ctx->s,level,strategy);
+		ctx->opos+=o-ctx->s.avail_out;
+	}while(e==Z_BUF_ERROR && !ctx->s.avail_out);
+	if(e==Z_OK){
+		ctx->curlevel=level;
+		ctx->strategy=strategy;
+	}else if(e!=Z_BUF_ERROR){
+		return darc_ctx_fail(ctx,DARC_STREAM_ERROR);
+	}
+	return DARC_OK;
+}
+
+void darc_ctx_get_level(const darc_ctx*ctx,int*level,int*strategy){
+	*level=ctx->curlevel;
+	*strategy=ctx->strategy;
+}
+
+/* Decompression goes on through zlib streams that follow one another. */
+int darc_ctx_stream(darc_ctx*ctx,darc_read_fn read,void*ruser,darc_write_fn write,void*wuser){
+	if(!ctx->ibuf && !(ctx->ibuf=malloc(ctx->ibs)))
+		return darc_ctx_fail(ctx,DARC_MEM_ERROR);
+	size_t members=0;
+	while(1){
+		size_t l=read(ruser,ctx->ibuf,ctx->ibs);
+		if(l==(size_t)-1)
+			return darc_ctx_fail(ctx,DARC_READ_ERROR);
+		if(!ctx->decompress){
+			int r=darc_ctx_push(ctx,ctx->ibuf,l,!l,write,wuser);
+			if(r!=DARC_OK || !l)
+				return r;
+			continue;
+		}
+		if(!l)
+			break;
+		const Bytef *p=ctx->ibuf;
+		while(l){
+			int r;
+			if(ctx->state==darc_ctx_ended){
+				++members;
+				if((r=darc_ctx_reset(ctx))!=DARC_OK)
+					return darc_ctx_fail(ctx,r);
+			}
+			if((r=darc_ctx_run(ctx,&p,&l,Z_NO_FLUSH,write,wuser))!=DARC_OK)
+				return r;
+		}
+	}
+	int r=ctx->state==darc_ctx_ended || (members && ctx->state==darc_ctx_fresh)?DARC_OK:DARC_TRUNCATED;
+	ctx->state=darc_ctx_done;
+	return r;
+}
+
+int darc_ctx_buffer(darc_ctx*ctx,const void*src,size_t srcsz,void*dst,size_t*dstsz){
+	int r=darc_ctx_begin(ctx),e;
+	if(r!=DARC_OK)
+		return darc_ctx_fail(ctx,r);
+	size_t in=srcsz,out=*dstsz;
+	ctx->s.next_in=(Bytef*)src;
+	ctx->s.next_out=dst;
+	ctx->s.avail_in=ctx->s.avail_out=0;
+	do{
+		if(!ctx->s.avail_in){
+			ctx->s.avail_in=in<UINT_MAX?in:UINT_MAX;
+			in-=ctx->s.avail_in;
+		}
+		if(!ctx->s.avail_out){
+			ctx->s.avail_out=out<UINT_MAX?out:UINT_MAX;
+			out-=ctx->s.avail_out;
+		}
+		e=ctx->decompress?inflate(&ctx->s,Z_NO_FLUSH):deflate(&ctx->s,in?Z_NO_FLUSH:Z_FINISH);
+		if((r=darc_ctx_check(ctx,&e))!=DARC_OK)
+			return darc_ctx_fail(ctx,r);
+	}while(e==Z_OK);
+	*dstsz-=out+ctx->s.avail_out;
+	if(e!=Z_STREAM_END)
+		r=ctx->decompress && !ctx->s.avail_in && !in?DARC_TRUNCATED:DARC_BUF_ERROR;
+	else if(ctx->s.avail_in || in)
+		r=DARC_DATA_ERROR;
+	return darc_ctx_fail(ctx,r);
+}
+
+size_t darc_compress_bound(size_t size){
+	return compressBound(size);
+}
+
+/* Idle contexts of the one-shot calls, so that a stream of small buffers
+resets a warm context instead of setting up a new one each time. */
+static pthread_mutex_t darc_ctx_pool_mutex=PTHREAD_MUTEX_INITIALIZER;
+static darc_ctx *darc_ctx_pool[DARC_CTX_POOL_SIZE];
+static size_t darc_ctx_pool_count;
+
+static darc_ctx *darc_ctx_take(int decompress,int level){
+	darc_ctx *ctx=NULL;
+	pthread_mutex_lock(&darc_ctx_pool_mutex);
+	for(size_t n=darc_ctx_pool_count;n--;){
+		darc_ctx *c=darc_ctx_pool[n];
+		if(c->decompress==decompress && (decompress || c->level==level)){
+			ctx=c;
+			darc_ctx_pool[n]=darc_ctx_pool[--darc_ctx_pool_count];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&darc_ctx_pool_mutex);
+	return ctx?ctx:darc_ctx_new(decompress,level);
+}
+
+/* A context whose stream may be broken is not kept. */
+static void darc_ctx_give(darc_ctx*ctx,int r){
+	pthread_mutex_lock(&darc_ctx_pool_mutex);
+	if(r!=DARC_STREAM_ERROR && r!=DARC_MEM_ERROR && darc_ctx_pool_count<DARC_CTX_POOL_SIZE){
+		darc_ctx_pool[darc_ctx_pool_count++]=ctx;
+		ctx=NULL;
+	}
+	pthread_mutex_unlock(&darc_ctx_pool_mutex);
+	darc_ctx_free(ctx);
+}
+
+void darc_ctx_pool_clear(void){
+	pthread_mutex_lock(&darc_ctx_pool_mutex);
+	while(darc_ctx_pool_count)
+		darc_ctx_free(darc_ctx_pool[--darc_ctx_pool_count]);
+	pthread_mutex_unlock(&darc_ctx_pool_mutex);
+}
+
+int darc_compress_buffer(const void*src,size_t srcsz,void*dst,size_t*dstsz,int level){
+	darc_ctx *ctx=darc_ctx_take(0,level);
+	if(!ctx)
+		return DARC_MEM_ERROR;
+	int r=darc_ctx_buffer(ctx,src,srcsz,dst,dstsz);
+	darc_ctx_give(ctx,r);
+	return r;
+}
+
+int darc_decompress_buffer(const void*src,size_t srcsz,void*dst,size_t*dstsz){
+	darc_ctx *ctx=darc_ctx_take(1,0);
+	if(!ctx)
+		return DARC_MEM_ERROR;
+	int r=darc_ctx_buffer(ctx,src,srcsz,dst,dstsz);
+	darc_ctx_give(ctx,r);
+	return r;
+}
+
+const char *darc_status_string(int status){
+	static const char*const s[]={
+		"Success","Not enough memory","The stream state was inconsistent",
+		"The input data was corrupted","A preset dictionary required",
+		"The output buffer is too small","Unexpected end of the input data",
+		"Input error","Output error","Not a darc archive","Duplicate member name"
+	};
+	return status>=0 && status<(int)(sizeof(s)/sizeof(*s))?s[status]:"Unknown error";
+}
+
+#define DARC_ARCHIVE_MAGIC "DARCARC\1"
+#define DARC_ARCHIVE_MAGIC_SIZE 8
+#define DARC_ARCHIVE_SLOT_SIZE 48
+#define DARC_ARCHIVE_TRAILER_SIZE 32
+#define DARC_ARCHIVE_STORED 1
+#define DARC_ARCHIVE_CACHE_SIZE 0x4000000
+#define DARC_ARCHIVE_NONE UINT32_MAX
+
+static void darc_put32le(Bytef*p,uint32_t v){
+	for(int n=0;n<4;++n)
+		p[n]=v>>n*8;
+}
+
+static uint32_t darc_get32le(const Bytef*p){
+	uint32_t v=0;
+	for(int n=0;n<4;++n)
+		v|=(uint32_t)p[n]<<n*8;
+	return v;
+}
+
+static void darc_put64le(Bytef*p,uint64_t v){
+	for(int n=0;n<8;++n)
+		p[n]=v>>n*8;
+}
+
+static uint64_t darc_get64le(const Bytef*p){
+	uint64_t v=0;
+	for(int n=0;n<8;++n)
+		v|=(uint64_t)p[n]<<n*8;
+	return v;
+}
+
+/* FNV-1a; 0 marks an empty slot. */
+static uint64_t darc_archive_hash(const char*name,size_t namesz){
+	uint64_t h=0xcbf29ce484222325ull;
+	for(size_t n=0;n<namesz;++n)
+		h=(h^(Bytef)name[n])*0x100000001b3ull;
+	return h?h:1;
+}
+
+static uLong darc_adler32(uLong a,const Bytef*p,size_t sz){
+	while(sz){
+		uInt l=sz<UINT_MAX?sz:UINT_MAX;
+		a=adler32(a,p,l);
+		p+=l;
+		sz-=l;
+	}
+	return a;
+}
+
+/* m comes first: the members handed out are the entries. */
+struct darc_archive_entry{
+	struct darc_member m;
+	uint64_t hash;
+	uint32_t slot;
+	Bytef *data;
+	uint32_t pins,prev,next;
+	int checked;
+};
+
+/* Names are appended as members are added, so they give the order. */
+static int darc_archive_entry_cmp(const void*a,const void*b){
+	const char *x=((const struct darc_archive_entry*)a)->m.name,*y=((const struct darc_archive_entry*)b)->m.name;
+	return x<y?-1:x>y;
+}
+
+struct darc_archive{
+	int fd;
+	const Bytef *map;
+	size_t mapsz;
+	size_t count;
+	uint32_t nslots;
+	uint32_t *slots;
+	struct darc_archive_entry *e;
+	char *names;
+	darc_ctx *ctx;
+	uint32_t head,tail;
+	size_t cached,limit;
+};
+
+static int darc_pread(int fd,void*buf,size_t sz,uint64_t off){
+	Bytef *p=buf;
+	while(sz){
+		ssize_t l=pread(fd,p,sz,off);
+		if(l<=0){
+			if(l<0 && errno==EINTR)
+				continue;
+			return 0;
+		}
+		p+=l;
+		sz-=l;
+		off+=l;
+	}
+	return 1;
+}
+
+/* The mapping when there is one, buf filled from the file otherwise. */
+static const Bytef *darc_archive_bytes(darc_archive*a,uint64_t off,size_t sz,Bytef*buf){
+	if(a->map)
+		return a->map+off;
+	return darc_pread(a->fd,buf,sz,off)?buf:NULL;
+}
+
+static void darc_archive_fail(darc_archive*a,int*status,int r){
+	darc_archive_close(a);
+	if(status)
+		*status=r;
+}
+
+darc_archive *darc_archive_open(const char*path,int*status){
+	darc_archive *a=calloc(1,sizeof(*a));
+	if(!a){
+		if(status)
+			*status=DARC_MEM_ERROR;
+		return NULL;
+	}
+	Bytef tbuf[DARC_ARCHIVE_TRAILER_SIZE];
+	const Bytef *t;
+	struct stat st;
+	a->head=a->tail=DARC_ARCHIVE_NONE;
+	a->limit=DARC_ARCHIVE_CACHE_SIZE;
+	if((a->fd=open(path,O_RDONLY))<0 || fstat(a->fd,&st)){
+		darc_archive_fail(a,status,DARC_READ_ERROR);
+		return NULL;
+	}
+	if((uint64_t)st.st_size<DARC_ARCHIVE_MAGIC_SIZE+DARC_ARCHIVE_TRAILER_SIZE){
+		darc_archive_fail(a,status,DARC_FORMAT_ERROR);
+		return NULL;
+	}
+	/* Without a mapping everything is read with pread instead. */
+	if((uint64_t)st.st_size<=SIZE_MAX){
+		void *m=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,a->fd,0);
+		if(m!=MAP_FAILED){
+			a->map=m;
+			a->mapsz=st.st_size;
+		}
+	}
+	uint64_t end=st.st_size-DARC_ARCHIVE_TRAILER_SIZE;
+	if(!(t=darc_archive_bytes(a,end,DARC_ARCHIVE_TRAILER_SIZE,tbuf))){
+		darc_archive_fail(a,status,DARC_READ_ERROR);
+		return NULL;
+	}
+	uint64_t dir=darc_get64le(t),namesz=darc_get64le(t+16);
+	a->nslots=darc_get32le(t+8);
+	a->count=darc_get32le(t+12);
+	if(memcmp(t+24,DARC_ARCHIVE_MAGIC,DARC_ARCHIVE_MAGIC_SIZE) || !a->nslots || a->nslots&(a->nslots-1) ||
+		a->count>a->nslots || dir>end || (end-dir-namesz)/DARC_ARCHIVE_SLOT_SIZE!=a->nslots ||
+		end-dir<namesz || (end-dir-namesz)%DARC_ARCHIVE_SLOT_SIZE){
+		darc_archive_fail(a,status,DARC_FORMAT_ERROR);
+		return NULL;
+	}
+	size_t dirsz=end-dir;
+	Bytef *dbuf=a->map?NULL:malloc(dirsz);
+	const Bytef *d;
+	a->slots=malloc(a->nslots*sizeof(*a->slots));
+	a->e=calloc(a->count?a->count:1,sizeof(*a->e));
+	a->names=malloc(namesz+1);
+	if((!a->map && !dbuf) || !a->slots || !a->e || !a->names){
+		free(dbuf);
+		darc_archive_fail(a,status,DARC_MEM_ERROR);
+		return NULL;
+	}
+	if(!(d=darc_archive_bytes(a,dir,dirsz,dbuf))){
+		free(dbuf);
+		darc_archive_fail(a,status,DARC_READ_ERROR);
+		return NULL;
+	}
+	const Bytef *names=d+(size_t)a->nslots*DARC_ARCHIVE_SLOT_SIZE;
+	memcpy(a->names,names,namesz);
+	a->names[namesz]='\0';
+	size_t n=0;
+	int r=DARC_OK;
+	for(uint32_t s=0;s<a->nslots && r==DARC_OK;++s){
+		const Bytef *p=d+(size_t)s*DARC_ARCHIVE_SLOT_SIZE;
+		uint64_t h=darc_get64le(p);
+		a->slots[s]=UINT32_MAX;
+		if(!h)
+			continue;
+		struct darc_archive_entry *e=a->e+n;
+		uint32_t off=darc_get32le(p+36),len=darc_get32le(p+40);
+		e->hash=h;
+		e->m.offset=darc_get64le(p+8);
+		e->m.csize=darc_get64le(p+16);
+		e->m.esize=darc_get64le(p+24);
+		e->m.check=darc_get32le(p+32);
+		e->m.stored=darc_get32le(p+44)&DARC_ARCHIVE_STORED;
+		if(n==a->count || off>namesz || len>namesz-off || e->m.offset>dir || e->m.csize>dir-e->m.offset ||
+			(e->m.stored && e->m.csize!=e->m.esize) || darc_archive_hash(a->names+off,len)!=h){
+			r=DARC_FORMAT_ERROR;
+			break;
+		}
+		e->m.name=a->names+off;
+		e->m.namesz=len;
+		e->slot=s;
+		e->prev=e->next=DARC_ARCHIVE_NONE;
+		++n;
+	}
+	free(dbuf);
+	if(r==DARC_OK && n!=a->count)
+		r=DARC_FORMAT_ERROR;
+	qsort(a->e,n,sizeof(*a->e),darc_archive_entry_cmp);
+	for(size_t k=0;k<n;++k)
+		a->slots[a->e[k].slot]=k;
+	if(r!=DARC_OK){
+		darc_archive_fail(a,status,r);
+		return NULL;
+	}
+	if(status)
+		*status=DARC_OK;
+	return a;
+}
+
+void darc_archive_close(darc_archive*a){
+	if(!a)
+		return;
+	if(a->fd>=0)
+		close(a->fd);
+	if(a->map)
+		munmap((void*)a->map,a->mapsz);
+	for(size_t n=0;a->e && n<a->count;++n)
+		free(a->e[n].data);
+	darc_ctx_free(a->ctx);
+	free(a->slots);
+	free(a->e);
+	free(a->names);
+	free(a);
+}
+
+size_t darc_archive_count(const darc_archive*a){
+	return a->count;
+}
+
+const struct darc_member *darc_archive_member(const darc_archive*a,size_t i){
+	return i<a->count?&a->e[i].m:NULL;
+}
+
+const struct darc_member *darc_archive_find(const darc_archive*a,const char*name,size_t namesz){
+	uint64_t h=darc_archive_hash(name,namesz);
+	for(uint32_t s=h&(a->nslots-1),n=0;n<a->nslots;s=(s+1)&(a->nslots-1),++n){
+		if(a->slots[s]==UINT32_MAX)
+			return NULL;
+		const struct darc_archive_entry *e=a->e+a->slots[s];
+		if(e->hash==h && e->m.namesz==namesz && !memcmp(e->m.name,name,namesz))
+			return &e->m;
+	}
+	return NULL;
+}
+
+static int darc_archive_ctx(darc_archive*a){
+	if(!a->ctx && !(a->ctx=darc_ctx_new(1,0)))
+		return DARC_MEM_ERROR;
+	return DARC_OK;
+}
+
+int darc_archive_read(darc_archive*a,const struct darc_member*m,void*dst){
+	if(m->stored){
+		if(a->map)
+			memcpy(dst,a->map+m->offset,m->esize);
+		else if(!darc_pread(a->fd,dst,m->esize,m->offset))
+			return DARC_READ_ERROR;
+	}else{
+		int r=darc_archive_ctx(a);
+		if(r!=DARC_OK)
+			return r;
+		Bytef *buf=a->map?NULL:malloc(m->csize?m->csize:1);
+		const Bytef *src;
+		if(!a->map && !buf)
+			return DARC_MEM_ERROR;
+		if(!(src=darc_archive_bytes(a,m->offset,m->csize,buf))){
+			free(buf);
+			return DARC_READ_ERROR;
+		}
+		size_t sz=m->esize;
+		r=darc_ctx_buffer(a->ctx,src,m->csize,dst,&sz);
+		free(buf);
+		if(r==DARC_OK && sz!=m->esize)
+			r=DARC_DATA_ERROR;
+		if(r!=DARC_OK)
+			return r;
+	}
+	return darc_adler32(adler32(0L,Z_NULL,0),dst,m->esize)==m->check?DARC_OK:DARC_DATA_ERROR;
+}
+
+struct darc_archive_sink{
+	darc_write_fn write;
+	void *wuser;
+	uLong check;
+	uint64_t size;
+};
+
+static int darc_archive_sink_write(void*user,const void*buf,size_t size){
+	struct darc_archive_sink *s=user;
+	s->check=darc_adler32(s->check,buf,size);
+	s->size+=size;
+	return s->write(s->wuser,buf,size);
+}
+
+int darc_archive_extract(darc_archive*a,const struct darc_member*m,darc_write_fn write,void*wuser){
+	int r=m->stored?DARC_OK:darc_archive_ctx(a);
+	if(r!=DARC_OK)
+		return r;
+	struct darc_archive_sink s={write,wuser,adler32(0L,Z_NULL,0),0};
+	if(!m->stored)
+		darc_ctx_reset(a->ctx);
+	Bytef *buf=NULL;
+	if(a->map){
+		if(m->stored)
+			r=!m->csize || !darc_archive_sink_write(&s,a->map+m->offset,m->csize)?DARC_OK:DARC_WRITE_ERROR;
+		else
+			r=darc_ctx_push(a->ctx,a->map+m->offset,m->csize,1,darc_archive_sink_write,&s);
+	}else if(!(buf=malloc(DARC_BUFFER_SIZE))){
+		return DARC_MEM_ERROR;
+	}
+	for(uint64_t p=0;!a->map && p<m->csize && r==DARC_OK;){
+		size_t l=m->csize-p<DARC_BUFFER_SIZE?m->csize-p:DARC_BUFFER_SIZE;
+		if(!darc_pread(a->fd,buf,l,m->offset+p)){
+			r=DARC_READ_ERROR;
+			break;
+		}
+		p+=l;
+		if(m->stored)
+			r=darc_archive_sink_write(&s,buf,l)?DARC_WRITE_ERROR:DARC_OK;
+		else
+			r=darc_ctx_push(a->ctx,buf,l,p==m->csize,darc_archive_sink_write,&s);
+	}
+	if(r==DARC_OK && !m->stored && !m->csize)
+		r=DARC_TRUNCATED;
+	free(buf);
+	if(r==DARC_OK && (s.size!=m->esize || s.check!=m->check))
+		r=DARC_DATA_ERROR;
+	return r;
+}
+
+static void darc_archive_unlink(darc_archive*a,struct darc_archive_entry*e){
+	if(e->prev!=DARC_ARCHIVE_NONE)
+		a->e[e->prev].next=e->next;
+	else
+		a->head=e->next;
+	if(e->next!=DARC_ARCHIVE_NONE)
+		a->e[e->next].prev=e->prev;
+	else
+		a->tail=e->prev;
+	e->prev=e->next=DARC_ARCHIVE_NONE;
+}
+
+static void darc_archive_push_front(darc_archive*a,struct darc_archive_entry*e){
+	uint32_t i=e-a->e;
+	e->prev=DARC_ARCHIVE_NONE;
+	e->next=a->head;
+	if(a->head!=DARC_ARCHIVE_NONE)
+		a->e[a->head].prev=i;
+	else
+		a->tail=i;
+	a->head=i;
+}
+
+/* Drops the least recently used members nobody holds until the cache fits. */
+static void darc_archive_evict(darc_archive*a){
+	for(uint32_t i=a->tail;i!=DARC_ARCHIVE_NONE && a->cached>a->limit;){
+		struct darc_archive_entry *e=a->e+i;
+		i=e->prev;
+		if(e->pins)
+			continue;
+		darc_archive_unlink(a,e);
+		a->cached-=e->m.esize;
+		free(e->data);
+		e->data=NULL;
+	}
+}
+
+const void *darc_archive_acquire(darc_archive*a,const struct darc_member*m,int*status){
+	struct darc_archive_entry *e=(struct darc_archive_entry*)m;
+	int r=DARC_OK;
+	if(m->stored && a->map){
+		if(!e->checked && darc_adler32(adler32(0L,Z_NULL,0),a->map+m->offset,m->esize)!=m->check)
+			r=DARC_DATA_ERROR;
+		else
+			e->checked=1;
+	}else if(e->data){
+		darc_archive_unlink(a,e);
+		darc_archive_push_front(a,e);
+		++e->pins;
+	}else if(m->esize>SIZE_MAX || !(e->data=malloc(m->esize?m->esize:1))){
+		r=DARC_MEM_ERROR;
+	}else if((r=darc_archive_read(a,m,e->data))!=DARC_OK){
+		free(e->data);
+		e->data=NULL;
+	}else{
+		e->pins=1;
+		darc_archive_push_front(a,e);
+		a->cached+=m->esize;
+		darc_archive_evict(a);
+	}
+	if(status)
+		*status=r;
+	if(r!=DARC_OK)
+		return NULL;
+	return e->data?(const void*)e->data:a->map+m->offset;
+}
+
+void darc_archive_release(darc_archive*a,const struct darc_member*m){
+	struct darc_archive_entry *e=(struct darc_archive_entry*)m;
+	if(e->data && e->pins && !--e->pins)
+		darc_archive_evict(a);
+}
+
+void darc_archive_set_cache_limit(darc_archive*a,size_t bytes){
+	a->limit=bytes;
+	darc_archive_evict(a);
+}
+
+struct darc_archive_record{
+	uint64_t hash,offset,csize,esize;
+	uint32_t check,nameoff,namesz,flags;
+};
+
+struct darc_archive_writer{
+	darc_write_fn write;
+	void *wuser;
+	darc_ctx *ctx;
+	uint64_t offset;
+	struct darc_archive_record *r;
+	size_t count,cap;
+	char *names;
+	size_t namesz,namescap;
+	Bytef *buf;
+	size_t bufsz;
+	int status;
+};
+
+darc_archive_writer *darc_archive_writer_new(int level,darc_write_fn write,void*wuser){
+	darc_archive_writer *w=calloc(1,sizeof(*w));
+	if(!w)
+		return NULL;
+	if(!(w->ctx=darc_ctx_new(0,level))){
+		free(w);
+		return NULL;
+	}
+	w->write=write;
+	w->wuser=wuser;
+	if(write(wuser,DARC_ARCHIVE_MAGIC,DARC_ARCHIVE_MAGIC_SIZE))
+		w->status=DARC_WRITE_ERROR;
+	w->offset=DARC_ARCHIVE_MAGIC_SIZE;
+	return w;
+}
+
+int darc_archive_pack(darc_ctx*ctx,const void*data,size_t size,void*dst,size_t*dstsz,struct darc_member*m){
+	size_t csz=*dstsz;
+	int e=darc_ctx_buffer(ctx,data,size,dst,&csz);
+	if(e!=DARC_OK)
+		return e;
+	m->stored=!size || csz*3>size*2;
+	m->csize=m->stored?size:csz;
+	m->esize=size;
+	m->check=darc_adler32(adler32(0L,Z_NULL,0),data,size);
+	*dstsz=m->stored?0:csz;
+	return DARC_OK;
+}
+
+int darc_archive_add_packed(darc_archive_writer*w,const char*name,size_t namesz,const struct darc_member*m,const void*data){
+	if(w->status!=DARC_OK)
+		return w->status;
+	if(namesz>=UINT32_MAX-w->namesz || w->count==(size_t)1<<30)
+		return w->status=DARC_BUF_ERROR;
+	if(w->count==w->cap){
+		size_t ncap=w->cap?w->cap*2:64;
+		struct darc_archive_record *r=realloc(w->r,ncap*sizeof(*r));
+		if(!r)
+			return w->status=DARC_MEM_ERROR;
+		w->r=r;
+		w->cap=ncap;
+	}
+	if(w->namesz+namesz+1>w->namescap){
+		size_t ncap=w->namescap*2>w->namesz+namesz+1?w->namescap*2:w->namesz+namesz+1;
+		char *n=realloc(w->names,ncap);
+		if(!n)
+			return w->status=DARC_MEM_ERROR;
+		w->names=n;
+		w->namescap=ncap;
+	}
+	struct darc_archive_record *r=w->r+w->count;
+	r->flags=m->stored?DARC_ARCHIVE_STORED:0;
+	r->csize=m->csize;
+	r->esize=m->esize;
+	r->offset=w->offset;
+	r->check=m->check;
+	r->hash=darc_archive_hash(name,namesz);
+	r->nameoff=w->namesz;
+	r->namesz=namesz;
+	if(r->csize && w->write(w->wuser,data,r->csize))
+		return w->status=DARC_WRITE_ERROR;
+	memcpy(w->names+w->namesz,name,namesz);
+	w->names[w->namesz+namesz]='\0';
+	w->namesz+=namesz+1;
+	w->offset+=r->csize;
+	++w->count;
+	return DARC_OK;
+}
+
+int darc_archive_add(darc_archive_writer*w,const char*name,size_t namesz,const void*data,size_t size){
+	if(w->status!=DARC_OK)
+		return w->status;
+	size_t bound=darc_compress_bound(size);
+	if(bound>w->bufsz){
+		Bytef *b=realloc(w->buf,bound);
+		if(!b)
+			return w->status=DARC_MEM_ERROR;
+		w->buf=b;
+		w->bufsz=bound;
+	}
+	struct darc_member m;
+	int e=darc_archive_pack(w->ctx,data,size,w->buf,&bound,&m);
+	if(e!=DARC_OK)
+		return w->status=e;
+	return darc_archive_add_packed(w,name,namesz,&m,m.stored?data:w->buf);
+}
+
+int darc_archive_copy(darc_archive_writer*w,darc_archive*a,const struct darc_member*m,const char*name,size_t namesz){
+	if(w->status!=DARC_OK)
+		return w->status;
+	if(a->map)
+		return darc_archive_add_packed(w,name,namesz,m,a->map+m->offset);
+	if(m->csize>SIZE_MAX)
+		return w->status=DARC_MEM_ERROR;
+	Bytef *buf=malloc(m->csize?m->csize:1);
+	if(!buf)
+		return w->status=DARC_MEM_ERROR;
+	int e=darc_pread(a->fd,buf,m->csize,m->offset)?darc_archive_add_packed(w,name,namesz,m,buf):DARC_READ_ERROR;
+	free(buf);
+	return e;
+}
+
+int darc_archive_finish(darc_archive_writer*w){
+	int e=w->status;
+	uint32_t nslots=1;
+	while(nslots<w->count*2)
+		nslots*=2;
+	size_t dirsz=(size_t)nslots*DARC_ARCHIVE_SLOT_SIZE;
+	Bytef *d=NULL;
+	uint32_t *slots=NULL;
+	if(e==DARC_OK && (!(d=calloc(dirsz+DARC_ARCHIVE_TRAILER_SIZE,1)) || !(slots=malloc(nslots*sizeof(*slots)))))
+		e=DARC_MEM_ERROR;
+	if(e==DARC_OK)
+		memset(slots,0xff,nslots*sizeof(*slots));
+	for(uint32_t n=0;n<w->count && e==DARC_OK;++n){
+		const struct darc_archive_record *r=w->r+n;
+		uint32_t s=r->hash&(nslots-1);
+		for(;slots[s]!=UINT32_MAX;s=(s+1)&(nslots-1)){
+			const struct darc_archive_record *o=w->r+slots[s];
+			if(o->hash==r->hash && o->namesz==r->namesz && !memcmp(w->names+o->nameoff,w->names+r->nameoff,r->namesz)){
+				e=DARC_DUPLICATE_ERROR;
+				break;
+			}
+		}
+		slots[s]=n;
+		Bytef *p=d+(size_t)s*DARC_ARCHIVE_SLOT_SIZE;
+		darc_put64le(p,r->hash);
+		darc_put64le(p+8,r->offset);
+		darc_put64le(p+16,r->csize);
+		darc_put64le(p+24,r->esize);
+		darc_put32le(p+32,r->check);
+		darc_put32le(p+36,r->nameoff);
+		darc_put32le(p+40,r->namesz);
+		darc_put32le(p+44,r->flags);
+	}
+	if(e==DARC_OK){
+		Bytef *t=d+dirsz;
+		darc_put64le(t,w->offset);
+		darc_put32le(t+8,nslots);
+		darc_put32le(t+12,w->count);
+		darc_put64le(t+16,w->namesz);
+		memcpy(t+24,DARC_ARCHIVE_MAGIC,DARC_ARCHIVE_MAGIC_SIZE);
+		if(w->write(w->wuser,d,dirsz) || (w->namesz && w->write(w->wuser,w->names,w->namesz)) ||
+			w->write(w->wuser,t,DARC_ARCHIVE_TRAILER_SIZE))
+			e=DARC_WRITE_ERROR;
+	}
+	free(slots);
+	free(d);
+	darc_ctx_free(w->ctx);
+	free(w->r);
+	free(w->names);
+	free(w->buf);
+	free(w);
+	return e;
+}
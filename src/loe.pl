@@ -1,6 +1,8 @@
 #!/usr/bin/perl -w
 
 use POSIX ":sys_wait_h";
+use File::Temp qw(tempdir);
+use Digest::SHA qw(sha256_hex);
 
 my $current_script_path=$0;
 my $current_script_dir=$current_script_path=~s/[^\/]*$//r;
@@ -794,13 +796,19 @@ sub setarchive($){
 	sub _setarchive($$$){
 		my ($prefix,$arcfile,$body)=(@_);
 		$arcfile=$arcfile=~s/\\"/"/rg;
-		open my $arcfh,'>',$arcfile or die;
-		my $arcinidata='';
-		my $arcoffs=0;
-		my $arciniinfo="set::ini_info($prefix){\n";
-		my $firstgroup;
+		my $dir=tempdir(CLEANUP=>1);
+		my $list='';
+		my $sumfile="$arcfile.sums";
+		my ($oldsums,$sums,%oldsum)=('','');
+		if(-e $arcfile && -e $sumfile){
+			$oldsums=slurpfile($sumfile);
+			for(split(/\n/,$oldsums)){
+				my ($sum,$subprefix)=split(/\t/);
+				$oldsum{$subprefix}=$sum;
+			}
+		}
 		my $enums="enum $prefix\_records{";
-		my $n_records=0;
+		my $names="static const char *const $prefix\_record_names[$prefix\_length]={";
 		while($body=~/($REGEXP_C_ID)\s*\(\s*((?:"(?:\\"|[^"])*"\s*))\)\s*;/g){
 			my ($subprefix,$files)=($1,$2);
 			my $totdata='';
@@ -809,80 +817,30 @@ sub setarchive($){
 				die if not length($td);
 				$totdata.=$td;
 			}
-			my $comptot=exomod("darc",$totdata);
-			if(length($totdata)/length($comptot)<1.5){
-				print "set::archive::$prefix\::$subprefix 100%\n";
-				print $arcfh $totdata;
-				$arcinidata.="[$subprefix]\noffset=$arcoffs\nsize=".length($totdata)."\n";
-				$arcoffs+=length($totdata);
-			}else{
-				print "set::archive::$prefix\::$subprefix ".(length($comptot)/(length($totdata)/100))."%\n";
-				print $arcfh $comptot;
-				$arcinidata.="[$subprefix]\noffset=$arcoffs\nsize=".length($comptot)."\nesize=".length($totdata)."\n";
-				$arcoffs+=length($comptot);
-			}
-			if(defined $firstgroup){
-				$arciniinfo.=qq#$subprefix\{
-	names "$subprefix"
-	declfrom "$firstgroup"
-	atts ".$firstgroup={$prefix\_$subprefix\_record}"
-	keysfrom "$firstgroup"
-}
-#;
+			my $sum=sha256_hex($totdata);
+			$sums.="$sum\t$subprefix\n";
+			if(($oldsum{$subprefix}//'') eq $sum){
+				$list.="\t$subprefix\n";
 			}else{
-				$firstgroup=$subprefix;
-				$arciniinfo.=qq#$subprefix\{
-	names "$subprefix"
-	decl "enum $prefix\_records id;"
-	atts ".$firstgroup={$prefix\_$subprefix\_record}"
-	keys{
-		koffset{
-			names "offset"
-			onload{
-				if(t==SET_INI_TYPE_SINT64){
-					((struct SET_ARCHIVE_RECORD*)udata)[g->$firstgroup.id].offset=i;
-					return SET_INI_TRUE;
-				}
-				SET_ARCHIVE_LOG_ERROR("set::archive::$prefix %s:%.*s",g->name,(int)kz,kn);
-				return SET_INI_FALSE;
-			}
-		}
-		ksize{
-			names "size"
-			onload{
-				if(t==SET_INI_TYPE_SINT64){
-					((struct SET_ARCHIVE_RECORD*)udata)[g->$firstgroup.id].size=i;
-					return SET_INI_TRUE;
-				}
-				SET_ARCHIVE_LOG_ERROR("set::archive::$prefix %s:%.*s",g->name,(int)kz,kn);
-				return SET_INI_FALSE;
-			}
-		}
-		kesize{
-			names "esize"
-			onload{
-				if(t==SET_INI_TYPE_SINT64){
-					((struct SET_ARCHIVE_RECORD*)udata)[g->$firstgroup.id].esize=i;
-					return SET_INI_TRUE;
-				}
-				SET_ARCHIVE_LOG_ERROR("set::archive::$prefix %s:%.*s",g->name,(int)kz,kn);
-				return SET_INI_FALSE;
-			}
-		}
-	}
-}
-#;
+				overfile("$dir/$subprefix",$totdata);
+				$list.="$dir/$subprefix\t$subprefix\n";
 			}
 			$enums.="\n\t$prefix\_$subprefix\_record,";
-			$n_records++;
+			$names.="\n\t\"$subprefix\",";
 		}
 		$enums.="\n\t$prefix\_length\n};";
-		#~ $enums=substr($enums,0,-1)."\n};";
-		$arciniinfo.="}";
-		#~ print "$enums\n$arciniinfo\n";
-		overfile("$prefix\.ini",$arcinidata);
-		close($arcfh) or die;
-		return "$enums\n".iniinfo($arciniinfo);
+		$names.="\n};";
+		if($sums ne $oldsums){
+			overfile("$dir/list",$list);
+			system("darc","a","t=auto",(%oldsum?("base=$arcfile"):()),"i=$dir/list","o=$arcfile.new")==0 or die;
+			rename("$arcfile.new",$arcfile) or die;
+			overfile($sumfile,$sums);
+		}
+		for(split(/\n/,exomod("darc ls 'i=$arcfile'",''))){
+			my ($esize,$csize,$subprefix)=split(/\t/);
+			print "set::archive::$prefix\::$subprefix ".($csize==$esize?100:$csize/($esize/100))."%\n";
+		}
+		return "$enums\n$names";
 	}
 	return shift=~s/(^|\W)set::archive\s*\(\s*($REGEXP_C_ID)\s*,\s*"((?:\\"|[^"])*)"\s*\)\s*$REGEXP_NESTED_BRACKETS/$1._setarchive($2,$3,$4)/erg;
 }
@@ -1163,62 +1121,129 @@ static SET_INI_BOOLEAN set_archive_check_records(struct SET_ARCHIVE_RECORD*r,int
 	}
 	return SET_INI_TRUE;
 }
-static SET_INI_BOOLEAN set_archive_init_records_from_file_sdl(const char *inifile,
-SET_INI_GROUP_IN_WORD_SET get_group,SET_INI_REPORT_GROUP report_group,
-SET_INI_REPORT_KEY report_key,struct SET_ARCHIVE_RECORD*udata){
-	SDL_assert(inifile && *inifile && get_group && udata);
-	SDL_RWops *r=SDL_RWFromFile(inifile,"rb");
+static Uint64 set_archive_get64le(const Uint8*p){
+	Uint64 v=0;
+	for(int i=0;i<8;++i)
+		v|=(Uint64)p[i]<<i*8;
+	return v;
+}
+static Uint32 set_archive_get32le(const Uint8*p){
+	return p[0]|(Uint32)p[1]<<8|(Uint32)p[2]<<16|(Uint32)p[3]<<24;
+}
+static Uint64 set_archive_hash(const char*name,size_t sz){
+	Uint64 h=0xcbf29ce484222325ull;
+	for(size_t i=0;i<sz;++i)
+		h=(h^(Uint8)name[i])*0x100000001b3ull;
+	return h?h:1;
+}
+/* Fills the records from the directory of an archive made by `darc a`: the
+trailer is read, then the whole directory at once, and every name is looked
+up in its hash table. */
+static SET_INI_BOOLEAN set_archive_init_records_from_archive_sdl(const char *arcfile,
+const char *const*names,struct SET_ARCHIVE_RECORD*udata,int n){
+	SDL_assert(arcfile && *arcfile && names && udata);
+	SDL_RWops *r=SDL_RWFromFile(arcfile,"rb");
 	if(!r){
 		SET_ARCHIVE_LOG_ERROR("%s.",SDL_GetError());
 		return SET_INI_FALSE;
 	}
+	Uint8 t[32];
 	Sint64 len=SDL_RWsize(r);
-	if(len<0){
-		SET_ARCHIVE_LOG_ERROR("Не удалось определить размер файла '%s' (%s).",inifile,SDL_GetError());
+	if(len<40 || SDL_RWseek(r,len-32,RW_SEEK_SET)<0 || SDL_RWread(r,t,1,32)!=32 ||
+		SDL_memcmp(t+24,"DARCARC\\1",8)){
+		SET_ARCHIVE_LOG_ERROR("Файл '%s' не является архивом darc.",arcfile);
 		SDL_RWclose(r);
 		return SET_INI_FALSE;
 	}
-	typeof(len) nl;
-	if(__builtin_add_overflow(len,1,&nl)||
-		nl>(((size_t)1<<(sizeof(size_t)*8-1))|~((size_t)1<<(sizeof(size_t)*8-1)))/((size_t)-1<0?2:1)){
-		SET_ARCHIVE_LOG_ERROR("Не получится выделить память под файл '%s'.",inifile);
+	Uint64 dir=set_archive_get64le(t),namesz=set_archive_get64le(t+16);
+	Uint32 nslots=set_archive_get32le(t+8);
+	if(!nslots || nslots&(nslots-1) || dir>(Uint64)len-32 || (Uint64)len-32-dir!=(Uint64)nslots*48+namesz ||
+		SDL_RWseek(r,dir,RW_SEEK_SET)<0){
+		SET_ARCHIVE_LOG_ERROR("Повреждённый каталог архива '%s'.",arcfile);
 		SDL_RWclose(r);
 		return SET_INI_FALSE;
 	}
-	char *m=SET_ARCHIVE_MALLOC(len+1);
-	if(!m){
-		SET_ARCHIVE_LOG_CRITICAL("Не удалось выделить память под файл '%s'.",inifile);
+	size_t dirsz=len-32-dir;
+	Uint8 *d=SET_ARCHIVE_MALLOC(dirsz);
+	if(!d){
+		SET_ARCHIVE_LOG_CRITICAL("Не удалось выделить память под каталог архива '%s'.",arcfile);
 		SDL_RWclose(r);
 		return SET_INI_FALSE;
 	}
-	if(SDL_RWread(r,m,1,len)!=len){
-		SET_ARCHIVE_LOG_ERROR("Не удалось прочитать файл '%s' (%s).",inifile,SDL_GetError());
-		SET_ARCHIVE_FREE(m);
+	if(SDL_RWread(r,d,1,dirsz)!=dirsz){
+		SET_ARCHIVE_LOG_ERROR("Не удалось прочитать файл '%s' (%s).",arcfile,SDL_GetError());
+		SET_ARCHIVE_FREE(d);
 		SDL_RWclose(r);
 		return SET_INI_FALSE;
 	}
-	char *s=m;
-	m[len]='\\0';
-	if(len>=3){
-		if((Uint8)m[0]==0xef && (Uint8)m[1]==0xbb && (Uint8)m[2]==0xbf)
-			s+=3;
-	}
 	SDL_RWclose(r);
-	switch(set_ini_parse_string(get_group,s,report_group,report_key,udata)){
-		case SET_INI_PARSER_OK:break;
-		case SET_INI_PARSER_CANCELLED:{
-			SET_ARCHIVE_FREE(m);
-			return SET_INI_FALSE;
+	const Uint8 *dnames=d+(size_t)nslots*48;
+	for(int i=0;i<n;++i){
+		size_t sz=SDL_strlen(names[i]);
+		Uint64 h=set_archive_hash(names[i],sz);
+		Uint32 s=h&(nslots-1),k;
+		for(k=0;k<nslots;++k,s=(s+1)&(nslots-1)){
+			const Uint8 *p=d+(size_t)s*48;
+			Uint64 ph=set_archive_get64le(p);
+			if(!ph){
+				k=nslots;
+				break;
+			}
+			Uint32 off=set_archive_get32le(p+36),nl=set_archive_get32le(p+40);
+			if(ph==h && nl==sz && off<=namesz && sz<=namesz-off && !SDL_memcmp(dnames+off,names[i],sz)){
+				udata[i].offset=set_archive_get64le(p+8);
+				udata[i].size=set_archive_get64le(p+16);
+				udata[i].esize=set_archive_get32le(p+44)&1?0:set_archive_get64le(p+24);
+				break;
+			}
 		}
-		case SET_INI_PARSER_UTF8_ERROR:{
-			SET_ARCHIVE_LOG_ERROR("Ошибка кодировки UTF-8 файла '%s'.",inifile);
-			SET_ARCHIVE_FREE(m);
+		if(k==nslots){
+			SET_ARCHIVE_LOG_ERROR("Запись '%s' не найдена в архиве '%s'.",names[i],arcfile);
+			SET_ARCHIVE_FREE(d);
 			return SET_INI_FALSE;
 		}
 	}
-	SET_ARCHIVE_FREE(m);
+	SET_ARCHIVE_FREE(d);
 	return SET_INI_TRUE;
 }
+#ifdef SET_ARCHIVE_DARC
+/* Через libdarc: архив отображается в память один раз, несжатые записи
+отдаются указателями прямо в отображение, сжатые распаковываются при первом
+обращении и держатся в кэше размером не больше cache байт. */
+static darc_archive *set_archive_open_darc(const char *arcfile,const char *const*names,
+const struct darc_member**members,int n,size_t cache){
+	SDL_assert(arcfile && *arcfile && names && members);
+	int s;
+	darc_archive *a=darc_archive_open(arcfile,&s);
+	if(!a){
+		SET_ARCHIVE_LOG_ERROR("Не удалось открыть архив '%s' (%s).",arcfile,darc_status_string(s));
+		return NULL;
+	}
+	darc_archive_set_cache_limit(a,cache);
+	for(int i=0;i<n;++i)
+		if(!(members[i]=darc_archive_find(a,names[i],SDL_strlen(names[i])))){
+			SET_ARCHIVE_LOG_ERROR("Запись '%s' не найдена в архиве '%s'.",names[i],arcfile);
+			darc_archive_close(a);
+			return NULL;
+		}
+	return a;
+}
+/* Данные действительны до set_archive_release_darc. */
+static const Uint8 *set_archive_acquire_darc(darc_archive *a,const struct darc_member *m,size_t *size){
+	int s;
+	const Uint8 *p=darc_archive_acquire(a,m,&s);
+	if(!p){
+		SET_ARCHIVE_LOG_ERROR("Не удалось загрузить запись '%s' (%s).",m->name,darc_status_string(s));
+		return NULL;
+	}
+	if(size)
+		*size=m->esize;
+	return p;
+}
+static void set_archive_release_darc(darc_archive *a,const struct darc_member *m){
+	darc_archive_release(a,m);
+}
+#endif
 static Uint8 *set_archive_load_record_sdl(SDL_RWops *rw,struct SET_ARCHIVE_RECORD *r){
 	SDL_assert(rw && r);
 	SDL_assert_always("Повреждённая запись." && r->size>0);
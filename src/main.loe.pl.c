@@ -1,12 +1,34 @@
 #include "config.h"
 #include <zlib.h>
+#include "darc.h"
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#ifndef __USE_LARGEFILE64
 #define __USE_LARGEFILE64
+#endif
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #define TOSTR2(x) #x
 #define TOSTR(x) TOSTR2(x)
@@ -31,10 +53,28 @@ set::ini_works;
 
 static SET_INI_BOOLEAN
 	opt_show_help=SET_INI_FALSE,opt_show_version=SET_INI_FALSE,
-	opt_decompress=SET_INI_FALSE,opt_syntax_error=SET_INI_FALSE;
+	opt_decompress=SET_INI_FALSE,opt_syntax_error=SET_INI_FALSE,
+	opt_blocked=SET_INI_FALSE,opt_build_index=SET_INI_FALSE,
+	opt_async_io=SET_INI_FALSE,opt_train_dictionary=SET_INI_FALSE,
+	opt_archive=SET_INI_FALSE,opt_list=SET_INI_FALSE,
+	opt_adaptive=SET_INI_FALSE,opt_dedup=SET_INI_FALSE,opt_test=SET_INI_FALSE,
+	opt_append=SET_INI_FALSE,opt_io_uring=SET_INI_FALSE,opt_follow=SET_INI_FALSE,
+	opt_resume=SET_INI_FALSE;
 
 static int opt_compression_level=Z_BEST_COMPRESSION;
 
+#define STRATEGY_AUTO -1
+#define DEFAULT_MEM_LEVEL 8
+#define DEFAULT_OBJECTIVE 2
+#define OBJECTIVE_SPEED INT_MAX
+
+static int opt_strategy=Z_DEFAULT_STRATEGY,opt_window_bits=MAX_WBITS,
+	opt_mem_level=DEFAULT_MEM_LEVEL,opt_objective=DEFAULT_OBJECTIVE;
+
+#define MAX_THREADS 1024
+
+static size_t opt_threads=1;
+
 set::gperfing{
 	%compare-lengths
 	%define hash-function-name cmplevel_hash
@@ -49,6 +89,23 @@ set::gperfing{
 	speed,Z_BEST_SPEED
 }
 
+set::gperfing{
+	%compare-lengths
+	%define hash-function-name strategy_hash
+	%define lookup-function-name strategy_in_word_set
+	%enum
+	%struct-type
+	%readonly-tables
+	struct strategy_flag{const char*name;int strategy;}
+	%%
+	default,Z_DEFAULT_STRATEGY
+	filtered,Z_FILTERED
+	huffman,Z_HUFFMAN_ONLY
+	rle,Z_RLE
+	fixed,Z_FIXED
+	auto,STRATEGY_AUTO
+}
+
 enum slurpfile_textpath_result{
 	slurpfile_textpath_ok,slurpfile_textpath_pathsz_overflow_error,
 	slurpfile_textpath_critical_malloc_error,slurpfile_textpath_open_file_error,
@@ -152,25 +209,68 @@ loe::stack(tcstr){
 }
 
 static struct tcstr
-	*opt_in_file=NULL,*opt_out_file=NULL;
+	*opt_in_file=NULL,*opt_out_file=NULL,*opt_index_file=NULL,
+	*opt_dict_file=NULL,*opt_batch_file=NULL,*opt_extract_name=NULL,
+	*opt_base_file=NULL,*opt_serve_path=NULL,*opt_client_path=NULL,
+	*opt_checkpoint_file=NULL;
 
 #define DEFAULT_INPUT_BUFFER_SIZE 0x100000
 #define DEFAULT_OUTPUT_BUFFER_SIZE DEFAULT_INPUT_BUFFER_SIZE*2
+#define DEFAULT_INDEX_SPAN 1
+#define DEFAULT_CHECKPOINT_SPAN 1024
+#define AUTO_BUFFER_SIZE 0
 
 static size_t
 	opt_in_buf_size=DEFAULT_INPUT_BUFFER_SIZE,
 	opt_out_buf_size=DEFAULT_OUTPUT_BUFFER_SIZE;
 
+static SET_INI_BOOLEAN opt_range=SET_INI_FALSE;
+
+static uint64_t opt_offset=0,opt_length=UINT64_MAX,opt_index_span=DEFAULT_INDEX_SPAN,
+	opt_checkpoint_span=DEFAULT_CHECKPOINT_SPAN;
+
+/* Bounds of the output latency in ms and bytes of input; 0 is no bound. */
+static uint64_t opt_flush_interval=0,opt_flush_bytes=0;
+
+enum darc_bench_format{
+	darc_bench_none,darc_bench_table,darc_bench_json
+};
+
+static enum darc_bench_format opt_bench=darc_bench_none;
+
+enum darc_stats_format{
+	darc_stats_none,darc_stats_text,darc_stats_json
+};
+
+static enum darc_stats_format opt_stats=darc_stats_none;
+
 set::ini_info(opt){
 	empty{
 		names ""
 		keys{
 			setbool{
 				names "--help" "h" "--version" "v" "--decompress" "d"
+					"--blocked" "b" "--build-index" "bi" "--async-io" "aio"
+					"--train-dictionary" "td" "--archive" "a" "--list" "ls"
+					"--adaptive" "ad" "--dedup" "dd" "--test" "test" "--append" "ap"
+					"--io-uring" "uring" "--follow" "follow" "--resume" "resume"
 				decl "SET_INI_BOOLEAN *pb;"
 				atts ".setbool={&opt_show_help}" ".setbool={&opt_show_help}"
 					".setbool={&opt_show_version}" ".setbool={&opt_show_version}"
 					".setbool={&opt_decompress}" ".setbool={&opt_decompress}"
+					".setbool={&opt_blocked}" ".setbool={&opt_blocked}"
+					".setbool={&opt_build_index}" ".setbool={&opt_build_index}"
+					".setbool={&opt_async_io}" ".setbool={&opt_async_io}"
+					".setbool={&opt_train_dictionary}" ".setbool={&opt_train_dictionary}"
+					".setbool={&opt_archive}" ".setbool={&opt_archive}"
+					".setbool={&opt_list}" ".setbool={&opt_list}"
+					".setbool={&opt_adaptive}" ".setbool={&opt_adaptive}"
+					".setbool={&opt_dedup}" ".setbool={&opt_dedup}"
+					".setbool={&opt_test}" ".setbool={&opt_test}"
+					".setbool={&opt_append}" ".setbool={&opt_append}"
+					".setbool={&opt_io_uring}" ".setbool={&opt_io_uring}"
+					".setbool={&opt_follow}" ".setbool={&opt_follow}"
+					".setbool={&opt_resume}" ".setbool={&opt_resume}"
 				onload{
 					if(t==SET_INI_TYPE_BOOLEAN){
 						k->setbool.pb[0]=SET_INI_TRUE;
@@ -210,6 +310,51 @@ set::ini_info(opt){
 					return SET_INI_TRUE;
 				}
 			}
+			strategy{
+				names "--strategy" "st"
+				onload{
+					const struct strategy_flag*f;
+					if(t==SET_INI_TYPE_STRING && (f=strategy_in_word_set(v,vz))){
+						opt_strategy=f->strategy;
+					}else{
+						elog("'%.*s=%.*s' - unknown value. Accepted string values: default,filtered,huffman,rle,fixed,auto.",(int)kz,kn,(int)vz,v);
+						opt_syntax_error=SET_INI_TRUE;
+					}
+					return SET_INI_TRUE;
+				}
+			}
+			setzparam{
+				names "--window-bits" "wb" "--mem-level" "ml"
+				decl "int *pv;int min,max;"
+				atts ".setzparam={&opt_window_bits,9,MAX_WBITS}" ".setzparam={&opt_window_bits,9,MAX_WBITS}"
+					".setzparam={&opt_mem_level,1,MAX_MEM_LEVEL}" ".setzparam={&opt_mem_level,1,MAX_MEM_LEVEL}"
+				onload{
+					if(t==SET_INI_TYPE_SINT64 && i>=k->setzparam.min && i<=k->setzparam.max){
+						k->setzparam.pv[0]=i;
+					}else{
+						elog("'%.*s' - type mismatch. Expected an integer([%i..%i]).",(int)kz,kn,
+							k->setzparam.min,k->setzparam.max);
+						opt_syntax_error=SET_INI_TRUE;
+					}
+					return SET_INI_TRUE;
+				}
+			}
+			objective{
+				names "--objective" "obj"
+				onload{
+					if(t==SET_INI_TYPE_SINT64 && i>=0 && i<=1000){
+						opt_objective=i;
+					}else if(t==SET_INI_TYPE_STRING && vz==5 && !memcmp(v,"ratio",5)){
+						opt_objective=0;
+					}else if(t==SET_INI_TYPE_STRING && vz==5 && !memcmp(v,"speed",5)){
+						opt_objective=OBJECTIVE_SPEED;
+					}else{
+						elog("'%.*s' - type mismatch. Expected a percentage([0..1000]) or ratio,speed.",(int)kz,kn);
+						opt_syntax_error=SET_INI_TRUE;
+					}
+					return SET_INI_TRUE;
+				}
+			}
 			iniconf{
 				names "--in-conf" "c"
 				onload{
@@ -253,10 +398,20 @@ set::ini_info(opt){
 				}
 			}
 			setstring{
-				names "--in-file" "i" "--out-file" "o"
+				names "--in-file" "i" "--out-file" "o" "--index" "idx" "--dictionary" "dict"
+					"--batch" "batch" "--extract" "x" "--base-archive" "base" "--serve" "serve" "--client" "client"
+					"--checkpoint" "ck"
 				decl "struct tcstr**pstr;const char*msg;"
 				atts ".setstring={&opt_in_file,\"the path to the input file\"}" ".setstring={&opt_in_file,\"the path to the input file\"}"
 				".setstring={&opt_out_file,\"the path to the output file\"}" ".setstring={&opt_out_file,\"the path to the output file\"}"
+				".setstring={&opt_index_file,\"the path to the index file\"}" ".setstring={&opt_index_file,\"the path to the index file\"}"
+				".setstring={&opt_dict_file,\"the path to the dictionary file\"}" ".setstring={&opt_dict_file,\"the path to the dictionary file\"}"
+				".setstring={&opt_batch_file,\"the path to the batch list\"}" ".setstring={&opt_batch_file,\"the path to the batch list\"}"
+				".setstring={&opt_extract_name,\"the name of the member to extract\"}" ".setstring={&opt_extract_name,\"the name of the member to extract\"}"
+				".setstring={&opt_base_file,\"the path to the base archive\"}" ".setstring={&opt_base_file,\"the path to the base archive\"}"
+				".setstring={&opt_serve_path,\"the path to the server socket\"}" ".setstring={&opt_serve_path,\"the path to the server socket\"}"
+				".setstring={&opt_client_path,\"the path to the server socket\"}" ".setstring={&opt_client_path,\"the path to the server socket\"}"
+				".setstring={&opt_checkpoint_file,\"the path to the checkpoint file\"}" ".setstring={&opt_checkpoint_file,\"the path to the checkpoint file\"}"
 				onload{
 					SET_INI_BOOLEAN e=SET_INI_TRUE;
 					if(t!=SET_INI_TYPE_BOOLEAN){
@@ -270,7 +425,7 @@ set::ini_info(opt){
 								e=SET_INI_FALSE;
 							}
 						}else{
-							wlog("Attempt to redefine %s '%s'.",k->setstring.msg,opt_in_file->data);
+							wlog("Attempt to redefine %s '%s'.",k->setstring.msg,k->setstring.pstr[0]->data);
 							k->setstring.pstr[0]->size=0;
 							switch(tcstr_occupy(&k->setstring.pstr[0],vz+1)){
 								case tcstr_occupy_ok:
@@ -299,6 +454,117 @@ set::ini_info(opt){
 					return e;
 				}
 			}
+			threads{
+				names "--threads" "t"
+				onload{
+					if(t==SET_INI_TYPE_SINT64){
+						if(i>0 && i<=MAX_THREADS){
+							opt_threads=i;
+						}else{
+							elog("'%.*s=%.*s' - value is out of the range([1..%i]).",
+								(int)kz,kn,(int)vz,v,MAX_THREADS);
+							opt_syntax_error=SET_INI_TRUE;
+						}
+					}else if(t==SET_INI_TYPE_STRING){
+						if(vz==4 && !memcmp(v,"auto",4)){
+							long n=sysconf(_SC_NPROCESSORS_ONLN);
+							opt_threads=n<1?1:n>MAX_THREADS?MAX_THREADS:n;
+						}else{
+							elog("'%.*s=%.*s' - unknown string value. Accepted string values: auto.",(int)kz,kn,(int)vz,v);
+							opt_syntax_error=SET_INI_TRUE;
+						}
+					}else{
+						elog("'%.*s' - missing value([1..%i]|auto).",(int)kz,kn,MAX_THREADS);
+						opt_syntax_error=SET_INI_TRUE;
+					}
+					return SET_INI_TRUE;
+				}
+			}
+			setrange{
+				names "--offset" "off" "--length" "len"
+				decl "uint64_t *pv;"
+				atts ".setrange={&opt_offset}" ".setrange={&opt_offset}"
+					".setrange={&opt_length}" ".setrange={&opt_length}"
+				onload{
+					if(t==SET_INI_TYPE_SINT64 && i>=0){
+						k->setrange.pv[0]=i;
+						opt_range=SET_INI_TRUE;
+					}else{
+						elog("'%.*s' - type mismatch. Expected a non-negative integer.",(int)kz,kn);
+						opt_syntax_error=SET_INI_TRUE;
+					}
+					return SET_INI_TRUE;
+				}
+			}
+			setflush{
+				names "--flush-interval" "fi" "--flush-bytes" "fb"
+				decl "uint64_t *pv;"
+				atts ".setflush={&opt_flush_interval}" ".setflush={&opt_flush_interval}"
+					".setflush={&opt_flush_bytes}" ".setflush={&opt_flush_bytes}"
+				onload{
+					if(t==SET_INI_TYPE_SINT64 && i>0){
+						k->setflush.pv[0]=i;
+					}else{
+						elog("'%.*s' - type mismatch. Expected a positive integer.",(int)kz,kn);
+						opt_syntax_error=SET_INI_TRUE;
+					}
+					return SET_INI_TRUE;
+				}
+			}
+			span{
+				names "--index-span" "span"
+				onload{
+					if(t==SET_INI_TYPE_SINT64 && i>0 && i<=UINT64_MAX>>20){
+						opt_index_span=i;
+					}else{
+						elog("'%.*s' - type mismatch. Expected a number of MiB([1..%llu]).",(int)kz,kn,
+							(unsigned long long)(UINT64_MAX>>20));
+						opt_syntax_error=SET_INI_TRUE;
+					}
+					return SET_INI_TRUE;
+				}
+			}
+			ckspan{
+				names "--checkpoint-span" "cks"
+				onload{
+					if(t==SET_INI_TYPE_SINT64 && i>0 && i<=UINT64_MAX>>20){
+						opt_checkpoint_span=i;
+					}else{
+						elog("'%.*s' - type mismatch. Expected a number of MiB([1..%llu]).",(int)kz,kn,
+							(unsigned long long)(UINT64_MAX>>20));
+						opt_syntax_error=SET_INI_TRUE;
+					}
+					return SET_INI_TRUE;
+				}
+			}
+			bench{
+				names "--bench" "bench"
+				onload{
+					if(t==SET_INI_TYPE_BOOLEAN || (vz==5 && !memcmp(v,"table",5))){
+						opt_bench=darc_bench_table;
+					}else if(vz==4 && !memcmp(v,"json",4)){
+						opt_bench=darc_bench_json;
+					}else{
+						elog("'%.*s=%.*s' - unknown value. Accepted string values: table,json.",(int)kz,kn,(int)vz,v);
+						opt_syntax_error=SET_INI_TRUE;
+					}
+					return SET_INI_TRUE;
+				}
+			}
+			stats{
+				names "--stats" "stats"
+				onload{
+					if(t==SET_INI_TYPE_BOOLEAN || (vz==4 && !memcmp(v,"text",4))){
+						opt_stats=darc_stats_text;
+					}else if(vz==4 && !memcmp(v,"json",4)){
+						opt_stats=darc_stats_json;
+					}else{
+						elog("'%.*s=%.*s' - unknown value. Accepted string values: text,json.",(int)kz,kn,(int)vz,v);
+						opt_syntax_error=SET_INI_TRUE;
+					}
+					return SET_INI_TRUE;
+				}
+			}
 			setbufsize{
 				names "--in-buffer-size" "ibs" "--out-buffer-size" "obs"
 				decl "size_t *psz;"
@@ -313,6 +579,8 @@ set::ini_info(opt){
 								(int)kz,kn,(int)vz,v,typemax(size_t));
 							opt_syntax_error=SET_INI_TRUE;
 						}
+					}else if(t==SET_INI_TYPE_STRING && vz==4 && !memcmp(v,"auto",4)){
+						k->setbufsize.psz[0]=AUTO_BUFFER_SIZE;
 					}else{
 						elog("'%.*s' - type mismatch.",(int)kz,kn);
 						opt_syntax_error=SET_INI_TRUE;
@@ -324,6 +592,13 @@ set::ini_info(opt){
 	}
 }
 
+/* A preset dictionary; id is its adler32 as stored in the zlib header. */
+struct darc_dict{
+	const Bytef *data;
+	size_t size;
+	uLong id;
+};
+
 enum darc_compress_result{
 	darc_compress_ok,darc_compress_critical_malloc_error,
 	darc_compress_deflateinit_version_error,darc_compress_deflateinit_level_error,
@@ -333,393 +608,4732 @@ enum darc_compress_result{
 	darc_compress_deflate_critical_undefined_behavior_error,
 	darc_compress_deflateend_stream_error,
 	darc_compress_deflateend_data_error,
-	darc_compress_deflateend_critical_undefined_behavior_error
+	darc_compress_deflateend_critical_undefined_behavior_error,
+	darc_compress_thread_error,darc_compress_checkpoint_error
 };
 
-static int darc_compress(FILE*inf,FILE*outf,int level,size_t ibs,size_t obs){
-	assert(ibs>0 && obs>0);
-	size_t totalsize=0;
-	Bytef *ibuf,*obuf;
-	int overflow;
-	if(overflow=__builtin_add_overflow(ibs,obs,&totalsize)){
-		ibuf=malloc(ibs);
-		if(!ibuf){
-			critmalloc(ibs,"");
-			return darc_compress_critical_malloc_error;
-		}
-		obuf=malloc(obs);
-		if(!obuf){
-			critmalloc(obs,"");
-			free(ibuf);
-			return darc_compress_critical_malloc_error;
-		}
+static double darc_now(void){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec+t.tv_nsec/1e9;
+}
+
+static double darc_cpu_now(void){
+	struct timespec t;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID,&t);
+	return t.tv_sec+t.tv_nsec/1e9;
+}
+
+#define STATS_PROGRESS_INTERVAL 5.0
+
+enum darc_stats_phase{
+	darc_stats_read,darc_stats_codec,darc_stats_write,darc_stats_phases
+};
+
+/* --stats: wall and CPU time of every phase of the single-stream loops, the
+bytes through them and the writes(buffer flushes). */
+struct darc_stats{
+	double start,progress;
+	double wall[darc_stats_phases],cpu[darc_stats_phases];
+	uint64_t in,out,flushes;
+};
+
+static struct darc_stats darc_stats;
+
+struct darc_stats_mark{
+	double wall,cpu;
+};
+
+static void darc_stats_start(struct darc_stats_mark*m){
+	if(opt_stats){
+		m->wall=darc_now();
+		m->cpu=darc_cpu_now();
+	}
+}
+
+static void darc_stats_stop(enum darc_stats_phase p,const struct darc_stats_mark*m,size_t bytes){
+	if(!opt_stats)
+		return;
+	double now=darc_now();
+	darc_stats.wall[p]+=now-m->wall;
+	darc_stats.cpu[p]+=darc_cpu_now()-m->cpu;
+	if(p==darc_stats_read){
+		darc_stats.in+=bytes;
+	}else if(p==darc_stats_write){
+		darc_stats.out+=bytes;
+		++darc_stats.flushes;
+	}
+	if(now-darc_stats.progress>=STATS_PROGRESS_INTERVAL){
+		darc_stats.progress=now;
+		ilog("%.1f MiB in, %.1f MiB out, %.2f MB/s.",darc_stats.in/1048576.,darc_stats.out/1048576.,
+			darc_stats.in/(now-darc_stats.start)/1e6);
+	}
+}
+
+static size_t darc_stats_fread(void*buf,size_t sz,FILE*f){
+	struct darc_stats_mark m;
+	darc_stats_start(&m);
+	size_t r=fread(buf,1,sz,f);
+	darc_stats_stop(darc_stats_read,&m,r);
+	return r;
+}
+
+static size_t darc_stats_fwrite(const void*buf,size_t sz,FILE*f){
+	struct darc_stats_mark m;
+	darc_stats_start(&m);
+	size_t r=fwrite(buf,1,sz,f);
+	darc_stats_stop(darc_stats_write,&m,r);
+	return r;
+}
+
+static int darc_stats_deflate(z_stream*s,int flush){
+	struct darc_stats_mark m;
+	darc_stats_start(&m);
+	int e=deflate(s,flush);
+	darc_stats_stop(darc_stats_codec,&m,0);
+	return e;
+}
+
+static int darc_stats_inflate(z_stream*s,int flush){
+	struct darc_stats_mark m;
+	darc_stats_start(&m);
+	int e=inflate(s,flush);
+	darc_stats_stop(darc_stats_codec,&m,0);
+	return e;
+}
+
+/* libdarc writes from within its calls, so their codec time is the call's
+less the time of the writes made meanwhile. */
+static void darc_stats_codec_start(struct darc_stats_mark*m){
+	*m=(struct darc_stats_mark){-darc_stats.wall[darc_stats_write],-darc_stats.cpu[darc_stats_write]};
+	if(opt_stats){
+		m->wall+=darc_now();
+		m->cpu+=darc_cpu_now();
+	}
+}
+
+static void darc_stats_codec_stop(const struct darc_stats_mark*m){
+	if(!opt_stats)
+		return;
+	struct darc_stats_mark n={m->wall+darc_stats.wall[darc_stats_write],m->cpu+darc_stats.cpu[darc_stats_write]};
+	darc_stats_stop(darc_stats_codec,&n,0);
+}
+
+static int darc_stats_push(darc_ctx*ctx,const void*in,size_t size,int finish,darc_write_fn write,void*wuser){
+	struct darc_stats_mark m;
+	darc_stats_codec_start(&m);
+	int e=darc_ctx_push(ctx,in,size,finish,write,wuser);
+	darc_stats_codec_stop(&m);
+	return e;
+}
+
+static int darc_stats_push_member(darc_ctx*ctx,const void*in,size_t*size,darc_write_fn write,void*wuser){
+	struct darc_stats_mark m;
+	darc_stats_codec_start(&m);
+	int e=darc_ctx_push_member(ctx,in,size,write,wuser);
+	darc_stats_codec_stop(&m);
+	return e;
+}
+
+static int darc_stats_flush(darc_ctx*ctx,int full,darc_write_fn write,void*wuser){
+	struct darc_stats_mark m;
+	darc_stats_codec_start(&m);
+	int e=darc_ctx_flush(ctx,full,write,wuser);
+	darc_stats_codec_stop(&m);
+	return e;
+}
+
+static int darc_stats_set_level(darc_ctx*ctx,int level,int strategy,darc_write_fn write,void*wuser){
+	struct darc_stats_mark m;
+	darc_stats_codec_start(&m);
+	int e=darc_ctx_set_level(ctx,level,strategy,write,wuser);
+	darc_stats_codec_stop(&m);
+	return e;
+}
+
+/* The write function of the contexts of the single-stream loops. */
+static int darc_stats_output(void*user,const void*buf,size_t size){
+	return darc_stats_fwrite(buf,size,user)!=size;
+}
+
+static void darc_stats_begin(void){
+	darc_stats.start=darc_stats.progress=darc_now();
+}
+
+/* Printed to stderr at exit. With worker threads the codec phase is the sum
+of their times and can exceed the total. */
+static void darc_stats_report(SET_INI_BOOLEAN decompress){
+	static const char *const names[darc_stats_phases]={"read","codec","write"};
+	struct rusage ru;
+	getrusage(RUSAGE_SELF,&ru);
+	double wall=darc_now()-darc_stats.start;
+	double cpu=ru.ru_utime.tv_sec+ru.ru_utime.tv_usec/1e6+ru.ru_stime.tv_sec+ru.ru_stime.tv_usec/1e6;
+	double ratio=darc_stats.in?(double)darc_stats.out/darc_stats.in:0;
+	double mbps=wall>0?(decompress?darc_stats.out:darc_stats.in)/wall/1e6:0;
+	if(opt_stats==darc_stats_json){
+		fprintf(stderr,"{\"wall_s\":%.6f,\"cpu_s\":%.6f,\"phases\":{",wall,cpu);
+		for(int p=0;p<darc_stats_phases;++p)
+			fprintf(stderr,"%s\"%s\":{\"wall_s\":%.6f,\"cpu_s\":%.6f}",p?",":"",names[p],
+				darc_stats.wall[p],darc_stats.cpu[p]);
+		fprintf(stderr,"},\"bytes_in\":%llu,\"bytes_out\":%llu,\"ratio\":%.4f,\"mbps\":%.2f,"
+			"\"flushes\":%llu,\"peak_rss_kib\":%ld}\n",(unsigned long long)darc_stats.in,
+			(unsigned long long)darc_stats.out,ratio,mbps,(unsigned long long)darc_stats.flushes,ru.ru_maxrss);
 	}else{
-		ibuf=malloc(totalsize);
-		if(!ibuf){
-			critmalloc(totalsize,"");
-			return darc_compress_critical_malloc_error;
-		}
-		obuf=ibuf+ibs;
+		fprintf(stderr,"phase   wall(s)    cpu(s)\n");
+		for(int p=0;p<darc_stats_phases;++p)
+			fprintf(stderr,"%-7s %-10.6f %-10.6f\n",names[p],darc_stats.wall[p],darc_stats.cpu[p]);
+		fprintf(stderr,"total   %-10.6f %-10.6f\n"
+			"bytes in %llu, bytes out %llu, ratio %.4f, %.2f MB/s, %llu flushes, peak RSS %ld KiB\n",
+			wall,cpu,(unsigned long long)darc_stats.in,(unsigned long long)darc_stats.out,ratio,mbps,
+			(unsigned long long)darc_stats.flushes,ru.ru_maxrss);
 	}
-	z_stream cmp={.zalloc=Z_NULL,.zfree=Z_NULL,.opaque=Z_NULL};
-	switch(deflateInit(&cmp,level)){
-		case Z_OK:{
-			break;
-		}
-		case Z_STREAM_ERROR:{
-			elog("defaultInit: Invalid compression level(%i).",level);
-			if(overflow)
-				free(obuf);
-			free(ibuf);
-			return darc_compress_deflateinit_level_error;
-		}
-		case Z_VERSION_ERROR:{
-			elog("defaultInit: The zlib vesion is incompatible with the version assumed(%s). msg='%s'.",
-				ZLIB_VERSION,cmp.msg==Z_NULL?"":cmp.msg);
-			if(overflow)
-				free(obuf);
-			free(ibuf);
-			return darc_compress_deflateinit_version_error;
-		}
-		case Z_MEM_ERROR:{
-			clog("defaultInit: Not enough memory. msg='%s'.",cmp.msg==Z_NULL?"":cmp.msg);
-			if(overflow)
-				free(obuf);
-			free(ibuf);
-			return darc_compress_critical_malloc_error;
-		}
-		default:{
-			clog("defaultInit: Undefined behavior.");
-			if(overflow)
-				free(obuf);
-			free(ibuf);
-			return darc_compress_deflateinit_critical_undefined_behavior_error;
-		}
+}
+
+/* Hints the kernel to read ahead the next len bytes of the mapping. */
+static void darc_map_advise(const Bytef*map,size_t mapsz,size_t pos,size_t len){
+	if(pos>=mapsz)
+		return;
+	size_t pg=sysconf(_SC_PAGESIZE);
+	size_t from=pos/pg*pg;
+	madvise((void*)(map+from),(len<mapsz-pos?pos+len:mapsz)-from,MADV_WILLNEED);
+}
+
+/* Maps a regular non-empty file for sequential reading. */
+static SET_INI_BOOLEAN darc_map_file(FILE*f,const Bytef**map,size_t*mapsz){
+	struct stat st;
+	int fd=fileno(f);
+	if(fd==-1 || fstat(fd,&st)==-1 || !S_ISREG(st.st_mode) || st.st_size<=0 ||
+	(uint64_t)st.st_size>typemax(size_t))
+		return SET_INI_FALSE;
+	void *m=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	if(m==MAP_FAILED){
+		errnolog("mmap: Falling back to reading");
+		return SET_INI_FALSE;
 	}
-	cmp.next_out=obuf;
-	cmp.avail_out=obs;
-	while(1){
-		cmp.avail_in=fread(ibuf,1,ibs,inf);
-		if(ferror(inf)){
-			elog("Input error.");
-			deflateEnd(&cmp);
-			if(overflow)
-				free(obuf);
-			free(ibuf);
-			return darc_compress_fread_error;
-		}
-		if(!cmp.avail_in)
-			break;
-		cmp.next_in=ibuf;
-		do{
-l_ok:		switch(deflate(&cmp,Z_NO_FLUSH)){
-				case Z_OK:{
-					goto l_ok;
-				}
-				case Z_BUF_ERROR:{
-					if(!cmp.avail_out){
-						if(fwrite(obuf,1,obs,outf)!=obs){
-							elog("Output error.");
-							deflateEnd(&cmp);
-							if(overflow)
-								free(obuf);
-							free(ibuf);
-							return darc_compress_fwrite_error;
-						}
-						cmp.next_out=obuf;
-						cmp.avail_out=obs;
-						continue;
-					}
-					break;
-				}
-				case Z_STREAM_ERROR:{
-					elog("The stream state was inconsistent. msg='%s'.",cmp.msg==Z_NULL?"":cmp.msg);
-					deflateEnd(&cmp);
-					if(overflow)
-						free(obuf);
-					free(ibuf);
-					return darc_compress_deflate_stream_error;
-				}
-				default:{
-					clog("default(Z_NO_FLUSH): Undefined behavior.");
-					deflateEnd(&cmp);
-					if(overflow)
-						free(obuf);
-					free(ibuf);
-					return darc_compress_deflate_critical_undefined_behavior_error;
-				}
-			}
-		}while(cmp.avail_in);
+	madvise(m,st.st_size,MADV_SEQUENTIAL);
+	posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+	*map=m;
+	*mapsz=st.st_size;
+	return SET_INI_TRUE;
+}
+
+#define AUTO_MAX_BUFFER_SIZE 0x400000
+#define AUTO_PIPE_SIZE 0x100000
+
+static size_t darc_round_up(size_t v,size_t m){
+	return v%m && v/m<typemax(size_t)/m?(v/m+1)*m:v;
+}
+
+/* The preferred I/O size of an endpoint; pipes are grown to AUTO_PIPE_SIZE
+(or as close to it as /proc/sys/fs/pipe-max-size lets) and give their capacity. */
+static size_t darc_endpoint_size(FILE*f,size_t*blksize,off_t*filesize){
+	struct stat st;
+	int fd=fileno(f);
+	*blksize=0x1000;
+	*filesize=-1;
+	if(fd==-1 || fstat(fd,&st)==-1)
+		return 0;
+	if(st.st_blksize>0)
+		*blksize=st.st_blksize;
+	if(S_ISREG(st.st_mode)){
+		*filesize=st.st_size;
+		return 0;
 	}
-	int e;
-	while((e=deflate(&cmp,Z_FINISH))!=Z_STREAM_END){
-		switch(e){
-			case Z_OK:
-			case Z_BUF_ERROR:{
-				if(fwrite(obuf,1,obs,outf)!=obs){
-					elog("Output error.");
-					deflateEnd(&cmp);
-					if(overflow)
-						free(obuf);
-					free(ibuf);
-					return darc_compress_fwrite_error;
-				}
-				cmp.avail_out=obs;
-				cmp.next_out=obuf;
-				continue;
-			}
-			case Z_STREAM_ERROR:{
-				elog("The stream state was inconsistent. msg='%s'.",cmp.msg==Z_NULL?"":cmp.msg);
-				deflateEnd(&cmp);
-				if(overflow)
-					free(obuf);
-				free(ibuf);
-				return darc_compress_deflate_stream_error;
-			}
-			default:{
-				clog("Undefined behavior.");
-				deflateEnd(&cmp);
-				if(overflow)
-					free(obuf);
-				free(ibuf);
-				return darc_compress_deflate_critical_undefined_behavior_error;
+#ifdef F_SETPIPE_SZ
+	if(S_ISFIFO(st.st_mode)){
+		int cap=fcntl(fd,F_GETPIPE_SZ);
+		for(int want=AUTO_PIPE_SIZE;cap>0 && want>cap;want>>=1){
+			int got=fcntl(fd,F_SETPIPE_SZ,want);
+			if(got>0){
+				cap=got;
+				break;
 			}
 		}
+		if(cap>0)
+			return cap;
 	}
-	if(obs-cmp.avail_out){
-		if(fwrite(obuf,1,obs-cmp.avail_out,outf)!=obs-cmp.avail_out){
-			elog("Output error.");
-			deflateEnd(&cmp);
-			if(overflow)
-				free(obuf);
-			free(ibuf);
-			return darc_compress_fwrite_error;
-		}
+#endif
+	return *blksize>0x10000?*blksize:0x10000;
+}
+
+/* Resolves ibs=auto and obs=auto from the endpoints: the input file size or
+the pipe capacity rounded to st_blksize, and for compression no more output
+buffer than deflateBound of one input buffer. An endpoint whose buffer size
+was given is left alone, its pipe not grown. */
+static void darc_auto_buffers(FILE*inf,FILE*outf,SET_INI_BOOLEAN decompress,int level,size_t*ibs,size_t*obs){
+	if(*ibs==AUTO_BUFFER_SIZE){
+		size_t iblk;
+		off_t isz;
+		size_t ipref=darc_endpoint_size(inf,&iblk,&isz);
+		if(isz>=0)
+			*ibs=darc_round_up((uint64_t)isz<AUTO_MAX_BUFFER_SIZE?isz:AUTO_MAX_BUFFER_SIZE,iblk);
+		else
+			*ibs=ipref;
+		if(!*ibs)
+			*ibs=iblk;
 	}
-	switch(deflateEnd(&cmp)){
-		case Z_OK:{
-			if(overflow)
-				free(obuf);
-			free(ibuf);
-			return darc_compress_ok;
-		}
-		case Z_STREAM_ERROR:{
-			elog("The stream state was inconsistent. msg='%s'.",cmp.msg==Z_NULL?"":cmp.msg);
-			if(overflow)
-				free(obuf);
-			free(ibuf);
-			return darc_compress_deflateend_stream_error;
-		}
-		case Z_DATA_ERROR:{
-			elog("The stream was freed prematurely. msg='%s'.",cmp.msg==Z_NULL?"":cmp.msg);
-			if(overflow)
-				free(obuf);
-			free(ibuf);
-			return darc_compress_deflateend_data_error;
+	if(*obs==AUTO_BUFFER_SIZE){
+		size_t oblk;
+		off_t osz;
+		size_t opref=darc_endpoint_size(outf,&oblk,&osz);
+		if(opref){
+			*obs=opref;
+		}else{
+			*obs=darc_round_up(decompress?*ibs*4<AUTO_MAX_BUFFER_SIZE*2?*ibs*4:AUTO_MAX_BUFFER_SIZE*2:
+				*ibs<AUTO_MAX_BUFFER_SIZE?*ibs:AUTO_MAX_BUFFER_SIZE,oblk);
 		}
-		default:{
-			clog("Undefined behavior.");
-			if(overflow)
-				free(obuf);
-			free(ibuf);
-			return darc_compress_deflateend_critical_undefined_behavior_error;
+		if(!decompress){
+			z_stream s={.zalloc=Z_NULL,.zfree=Z_NULL,.opaque=Z_NULL};
+			if(deflateInit(&s,level)==Z_OK){
+				size_t bound=darc_round_up(deflateBound(&s,*ibs),oblk);
+				if(bound<*obs)
+					*obs=bound;
+				deflateEnd(&s);
+			}
 		}
+		if(!*obs)
+			*obs=oblk;
 	}
 }
 
-enum darc_decompress_result{
-	darc_decompress_ok,
-	darc_decompress_critical_malloc_error,
-	darc_decompress_fread_error,
-	darc_decompress_inflateinit_version_error,
-	darc_decompress_inflateinit_stream_error,
-	darc_decompress_inflateinit_critical_memory_error,
-	darc_decompress_inflateinit_ciritcal_undefined_behavior_error,
-	darc_decompress_fwrite_error,
-	darc_decompress_inflateend_stream_error,
-	darc_decompress_inflateend_critical_undefined_behavior_error,
-	darc_decompress_inflate_need_dict_error,
-	darc_decompress_inflate_data_error,
-	darc_decompress_inflate_stream_error,
-	darc_decompress_inflate_critical_memory_error,
-	darc_decompress_no_data_error
-};
+#define ADAPTIVE_SAMPLE 0x1000
+#define ADAPTIVE_SAMPLES 16
+/* 2^(8-7.8): a sample whose collision entropy is above 7.8 bits per byte. */
+#define ADAPTIVE_UNIFORMITY 1.1487
 
-static int darc_decompress(FILE*inf,FILE*outf,size_t ibs,size_t obs){
-	Bytef *ibuf,*obuf;
-	size_t totalsize;
-	int overflow;
-	if(overflow=__builtin_add_overflow(ibs,obs,&totalsize)){
-		ibuf=malloc(ibs);
-		if(!ibuf){
-			critmalloc(ibs,"");
-			return darc_decompress_critical_malloc_error;
-		}
-		obuf=malloc(obs);
-		if(!obuf){
-			critmalloc(obs,"");
-			free(ibuf);
-			return darc_decompress_critical_malloc_error;
-		}
+/* --adaptive: a byte histogram of up to ADAPTIVE_SAMPLES slices spread over
+the block. Data this close to uniform(compressed media, encrypted or random
+data) gains nothing from the match search. */
+static SET_INI_BOOLEAN darc_incompressible(const Bytef*p,size_t sz){
+	uint32_t h[256]={0};
+	size_t n;
+	if(sz<ADAPTIVE_SAMPLE)
+		return SET_INI_FALSE;
+	if(sz<=ADAPTIVE_SAMPLE*ADAPTIVE_SAMPLES){
+		for(size_t i=0;i<sz;++i)
+			++h[p[i]];
+		n=sz;
 	}else{
-		ibuf=malloc(totalsize);
-		if(!ibuf){
-			critmalloc(totalsize,"");
-			return darc_decompress_critical_malloc_error;
-		}
-		obuf=ibuf+ibs;
+		size_t step=sz/ADAPTIVE_SAMPLES;
+		for(size_t s=0;s<ADAPTIVE_SAMPLES;++s)
+			for(size_t i=0;i<ADAPTIVE_SAMPLE;++i)
+				++h[p[s*step+i]];
+		n=ADAPTIVE_SAMPLE*ADAPTIVE_SAMPLES;
 	}
-	z_stream cmp={.zalloc=Z_NULL,.zfree=Z_NULL,.next_in=ibuf,.opaque=Z_NULL};
-	cmp.avail_in=fread(ibuf,1,ibs,inf);
-	if(ferror(inf)){
-		elog("Input error.");
-		inflateEnd(&cmp);
-		if(overflow)
-			free(obuf);
-		free(ibuf);
-		return darc_decompress_fread_error;
-	}
-	if(cmp.avail_in){
-		cmp.avail_out=obs;
-		cmp.next_out=obuf;
-		switch(inflateInit(&cmp)){
-			case Z_OK:{
-				break;
-			}
-			case Z_VERSION_ERROR:{
-				elog("inflateInit: The zlib vesion is incompatible with the version assumed(%s). msg='%s'.",
-					ZLIB_VERSION,cmp.msg==Z_NULL?"":cmp.msg);
-				if(overflow)
-					free(obuf);
-				free(ibuf);
-				return darc_decompress_inflateinit_version_error;
-			}
-			case Z_STREAM_ERROR:{
-				elog("inflateInit: The stream state was inconsistent. msg='%s'.",cmp.msg==Z_NULL?"":cmp.msg);
-				if(overflow)
-					free(obuf);
-				free(ibuf);
-				return darc_decompress_inflateinit_stream_error;
-			}
-			case Z_MEM_ERROR:{
-				clog("inflateInit: Not enough memory. msg='%s'.",cmp.msg==Z_NULL?"":cmp.msg);
-				if(overflow)
-					free(obuf);
-				free(ibuf);
-				return darc_decompress_inflateinit_critical_memory_error;
-			}
-			default:{
-				clog("inflateInit: Undefined behavior.");
-				if(overflow)
-					free(obuf);
-				free(ibuf);
-				return darc_decompress_inflateinit_ciritcal_undefined_behavior_error;
-			}
-		}
-		do{
-			do{
-l_ok:			switch(inflate(&cmp,Z_NO_FLUSH)){
-					case Z_OK:{
-						goto l_ok;
-					}
-					case Z_STREAM_END:{
-						if(obs-cmp.avail_out){
-							if(fwrite(obuf,1,obs-cmp.avail_out,outf)!=obs-cmp.avail_out){
-								elog("Output error.");
-								inflateEnd(&cmp);
-								if(overflow)
-									free(obuf);
-								free(ibuf);
-								return darc_decompress_fwrite_error;
-							}
-						}
-						switch(inflateEnd(&cmp)){
-							case Z_OK:{
-								if(overflow)
-									free(obuf);
-								free(ibuf);
-								return darc_decompress_ok;
-							}
-							case Z_STREAM_ERROR:{
-								elog("inflateEnd: The stream state was inconsistent. msg='%s'.",cmp.msg==Z_NULL?"":cmp.msg);
-								if(overflow)
-									free(obuf);
-								free(ibuf);
-								return darc_decompress_inflateend_stream_error;
-							}
-							default:{
-								clog("inflateEnd: Undefined behavior.");
-								if(overflow)
-									free(obuf);
-								free(ibuf);
-								return darc_decompress_inflateend_critical_undefined_behavior_error;
-							}
-						}
-					}
-					case Z_BUF_ERROR:{
-						if(!cmp.avail_out){
-							if(fwrite(obuf,1,obs,outf)!=obs){
-								elog("Output error.");
-								inflateEnd(&cmp);
-								if(overflow)
-									free(obuf);
-								free(ibuf);
-								return darc_decompress_fwrite_error;
-							}
-							cmp.avail_out=obs;
-							cmp.next_out=obuf;
-						}
-						break;
-					}
-					case Z_NEED_DICT:{
-						elog("inflate: A preset dictionary required at this point. msg='%s'.",cmp.msg==Z_NULL?"":cmp.msg);
-						inflateEnd(&cmp);
-						if(overflow)
-							free(obuf);
-						free(ibuf);
-						return darc_decompress_inflate_need_dict_error;
-					}
-					case Z_DATA_ERROR:{
-						elog("inflate: The input data was corrupted. msg='%s'.",cmp.msg==Z_NULL?"":cmp.msg);
-						inflateEnd(&cmp);
-						if(overflow)
-							free(obuf);
-						free(ibuf);
-						return darc_decompress_inflate_data_error;
-					}
-					case Z_STREAM_ERROR:{
-						elog("inflate: The stream state was inconsistent. msg='%s'.",cmp.msg==Z_NULL?"":cmp.msg);
-						inflateEnd(&cmp);
-						if(overflow)
-							free(obuf);
-						free(ibuf);
-						return darc_decompress_inflate_stream_error;
-					}
-					case Z_MEM_ERROR:{
-						clog("inflate: Not enough memory. msg='%s'.",cmp.msg==Z_NULL?"":cmp.msg);
-						inflateEnd(&cmp);
-						if(overflow)
-							free(obuf);
-						free(ibuf);
-						return darc_decompress_inflate_critical_memory_error;
-					}
+	uint64_t sq=0;
+	for(int b=0;b<256;++b)
+		sq+=(uint64_t)h[b]*h[b];
+	return sq*256.<(double)n*n*ADAPTIVE_UNIFORMITY;
+}
+
+static void darc_put32le(Bytef*b,uint32_t v){
+	b[0]=v;
+	b[1]=v>>8;
+	b[2]=v>>16;
+	b[3]=v>>24;
+}
+
+static uint32_t darc_get32le(const Bytef*b){
+	return b[0]|(uint32_t)b[1]<<8|(uint32_t)b[2]<<16|(uint32_t)b[3]<<24;
+}
+
+static void darc_put64le(Bytef*b,uint64_t v){
+	darc_put32le(b,v);
+	darc_put32le(b+4,v>>32);
+}
+
+static uint64_t darc_get64le(const Bytef*b){
+	return darc_get32le(b)|(uint64_t)darc_get32le(b+4)<<32;
+}
+
+/* --strategy, --window-bits and --mem-level; raw streams have no zlib header. */
+static int darc_deflate_init(z_stream*s,int level,SET_INI_BOOLEAN raw){
+	return deflateInit2(s,level,Z_DEFLATED,raw?-opt_window_bits:opt_window_bits,opt_mem_level,
+		opt_strategy==STRATEGY_AUTO?Z_DEFAULT_STRATEGY:opt_strategy);
+}
+
+/* The same on a libdarc context, with obs-sized output pieces; the dictionary
+is left out of a raw stream. NULL, logged, on failure. */
+static darc_ctx *darc_deflate_ctx(int level,SET_INI_BOOLEAN raw,size_t obs,const struct darc_dict*dict){
+	darc_ctx *ctx=darc_ctx_new(0,level);
+	if(!ctx){
+		clog("darc_ctx_new: Not enough memory or an invalid compression level(%i).",level);
+		return NULL;
+	}
+	int e=darc_ctx_set_params(ctx,raw?-opt_window_bits:opt_window_bits,opt_mem_level,
+		opt_strategy==STRATEGY_AUTO?Z_DEFAULT_STRATEGY:opt_strategy);
+	if(e==DARC_OK)
+		e=darc_ctx_set_buffers(ctx,obs,obs);
+	if(e==DARC_OK && dict && !raw)
+		e=darc_ctx_set_dictionary(ctx,dict->data,dict->size);
+	if(e!=DARC_OK){
+		elog("deflateInit2: %s. msg='%s'.",darc_status_string(e),darc_ctx_message(ctx));
+		darc_ctx_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+#define STRATEGY_PROBE 0x8000
+
+/* --strategy=auto: a STRATEGY_PROBE slice from the middle of the block is
+deflated with every candidate on p, a raw stream reset each time, into scratch.
+The fastest candidate whose output is at most opt_objective percent larger
+than the smallest one wins. */
+static int darc_probe_strategy(z_stream*p,const Bytef*in,size_t insz,int level,Bytef*scratch,size_t scratchsz){
+	static const int cand[]={Z_DEFAULT_STRATEGY,Z_FILTERED,Z_RLE,Z_HUFFMAN_ONLY};
+	enum{ncand=sizeof(cand)/sizeof(*cand)};
+	uLong size[ncand],min=ULONG_MAX;
+	double time[ncand];
+	size_t sz=insz<STRATEGY_PROBE?insz:STRATEGY_PROBE;
+	in+=(insz-sz)/2;
+	for(int n=0;n<ncand;++n){
+		size[n]=ULONG_MAX;
+		p->next_out=scratch;
+		p->avail_out=scratchsz>UINT_MAX?UINT_MAX:scratchsz;
+		if(deflateReset(p)!=Z_OK || deflateParams(p,level,cand[n])!=Z_OK)
+			continue;
+		p->next_in=(Bytef*)in;
+		p->avail_in=sz;
+		double start=darc_now();
+		if(deflate(p,Z_FINISH)!=Z_STREAM_END)
+			continue;
+		time[n]=darc_now()-start;
+		size[n]=p->total_out;
+		if(size[n]<min)
+			min=size[n];
+	}
+	int best=-1;
+	for(int n=0;n<ncand;++n)
+		if(size[n]!=ULONG_MAX && size[n]<=min+min*(opt_objective/100.) && (best<0 || time[n]<time[best]))
+			best=n;
+	return best<0?Z_DEFAULT_STRATEGY:cand[best];
+}
+
+/* How every block of a stream is deflated: --adaptive and --strategy=auto. */
+struct darc_tune{
+	SET_INI_BOOLEAN adaptive,automatic;
+	z_stream probe;
+	Bytef *scratch;
+	size_t scratchsz;
+};
+
+static struct darc_tune *darc_tune_start(struct darc_tune*t,int level,SET_INI_BOOLEAN adaptive){
+	memset(t,0,sizeof(*t));
+	t->adaptive=adaptive;
+	if(!(t->automatic=opt_strategy==STRATEGY_AUTO))
+		return t;
+	if(darc_deflate_init(&t->probe,level,SET_INI_TRUE)!=Z_OK){
+		elog("deflateInit2: Initialization failed.");
+		return NULL;
+	}
+	t->scratchsz=deflateBound(&t->probe,STRATEGY_PROBE);
+	if(!(t->scratch=malloc(t->scratchsz))){
+		critmalloc(t->scratchsz,"");
+		deflateEnd(&t->probe);
+		return NULL;
+	}
+	return t;
+}
+
+static void darc_tune_stop(struct darc_tune*t){
+	if(t && t->automatic){
+		deflateEnd(&t->probe);
+		free(t->scratch);
+	}
+}
+
+/* The level and the strategy for the next block. */
+static void darc_tune_block(struct darc_tune*t,const Bytef*in,size_t insz,int level,int*lvl,int*strategy){
+	*lvl=t->adaptive && darc_incompressible(in,insz)?Z_NO_COMPRESSION:level;
+	if(!t->automatic)
+		*strategy=opt_strategy;
+	else if(*lvl==Z_NO_COMPRESSION)
+		*strategy=Z_DEFAULT_STRATEGY;
+	else
+		*strategy=darc_probe_strategy(&t->probe,in,insz,level,t->scratch,t->scratchsz);
+}
+
+#define CHECKPOINT_MAGIC "DARCCKP\1"
+#define CHECKPOINT_MAGIC_SIZE 8
+#define CHECKPOINT_SIZE 52
+
+/* --checkpoint: every span bytes of input the stream is full-flushed, so what
+follows depends on nothing before it, the output synced and in, out and the
+adler32 of the input so far recorded. --resume cuts the output back to the
+last record and goes on from there with a raw stream, writing the trailer
+itself; the result is the stream of a run that was never stopped. level and
+strategy are the parameters in effect at the record. */
+struct darc_checkpoint{
+	const char *path;
+	int fd,level,strategy;
+	uint64_t span,in,out,next;
+	uLong check;
+	SET_INI_BOOLEAN resume,resumed;
+};
+
+/* The record: the magic, in, out, the adler32, the parameters in effect, then
+the options that shape the stream, which a resumed run must repeat, and the
+adler32 of all that. */
+static void darc_checkpoint_record(const struct darc_checkpoint*ck,Bytef*b,int level,int curlevel,int curstrategy,
+size_t ibs,const struct darc_tune*tune,const struct darc_dict*dict){
+	memcpy(b,CHECKPOINT_MAGIC,CHECKPOINT_MAGIC_SIZE);
+	darc_put64le(b+8,ck->in);
+	darc_put64le(b+16,ck->out);
+	darc_put32le(b+24,ck->check);
+	b[28]=curlevel+1;
+	b[29]=curstrategy;
+	b[30]=level+1;
+	b[31]=opt_strategy+1;
+	b[32]=opt_window_bits;
+	b[33]=opt_mem_level;
+	b[34]=tune!=NULL;
+	b[35]=0;
+	/* The blocks of the tuner are cut at ibs. */
+	darc_put64le(b+36,tune?ibs:0);
+	darc_put32le(b+44,dict?dict->id:0);
+	darc_put32le(b+48,adler32(0,b,48));
+}
+
+/* Opens ck->path and, with --resume, takes up its record: the output is cut
+back and both files are positioned(*mappos for a mapped input). */
+static SET_INI_BOOLEAN darc_checkpoint_start(struct darc_checkpoint*ck,FILE*inf,const Bytef*map,size_t mapsz,
+size_t*mappos,FILE*outf,int level,size_t ibs,const struct darc_tune*tune,const struct darc_dict*dict){
+	struct stat st;
+	if(fflush(outf) || fstat(fileno(outf),&st) || !S_ISREG(st.st_mode)){
+		elog("The output of --checkpoint must be a regular file.");
+		return SET_INI_FALSE;
+	}
+	if((ck->fd=open(ck->path,O_RDWR|O_CREAT|O_CLOEXEC,0644))==-1){
+		errnolog("Can't open file '%s'",ck->path);
+		return SET_INI_FALSE;
+	}
+	ck->check=adler32(0,Z_NULL,0);
+	Bytef b[CHECKPOINT_SIZE],cur[CHECKPOINT_SIZE];
+	ssize_t n=ck->resume?pread(ck->fd,b,CHECKPOINT_SIZE,0):0;
+	if(n<0){
+		errnolog("Can't read file '%s'",ck->path);
+		return SET_INI_FALSE;
+	}
+	if(!n){
+		if(ck->resume)
+			wlog("There is no checkpoint in '%s'. Starting from the beginning.",ck->path);
+		else if(ftruncate(ck->fd,0)){
+			errnolog("Can't truncate file '%s'",ck->path);
+			return SET_INI_FALSE;
+		}
+	}else{
+		if(n!=CHECKPOINT_SIZE || memcmp(b,CHECKPOINT_MAGIC,CHECKPOINT_MAGIC_SIZE) ||
+		darc_get32le(b+48)!=adler32(0,b,48)){
+			elog("'%s' is not a checkpoint.",ck->path);
+			return SET_INI_FALSE;
+		}
+		darc_checkpoint_record(ck,cur,level,0,0,ibs,tune,dict);
+		if(memcmp(b+30,cur+30,18)){
+			elog("The checkpoint was made with other options.");
+			return SET_INI_FALSE;
+		}
+		ck->in=darc_get64le(b+8);
+		ck->out=darc_get64le(b+16);
+		ck->check=darc_get32le(b+24);
+		ck->level=b[28]-1;
+		ck->strategy=b[29];
+		if(ck->out>(uint64_t)st.st_size){
+			elog("The output is shorter than the checkpoint(%llu bytes).",(unsigned long long)ck->out);
+			return SET_INI_FALSE;
+		}
+		if(map){
+			if(ck->in>mapsz){
+				elog("The input is shorter than the checkpoint(%llu bytes).",(unsigned long long)ck->in);
+				return SET_INI_FALSE;
+			}
+			*mappos=ck->in;
+		}else if(fseeko64(inf,ck->in,SEEK_SET)==-1){
+			errnolog("Can't position the input at byte %llu",(unsigned long long)ck->in);
+			return SET_INI_FALSE;
+		}
+		ck->resumed=SET_INI_TRUE;
+	}
+	if(ftruncate(fileno(outf),ck->out) || fseeko64(outf,ck->out,SEEK_SET)==-1){
+		errnolog("Can't position the output at byte %llu",(unsigned long long)ck->out);
+		return SET_INI_FALSE;
+	}
+	ck->next=(ck->in/ck->span+1)*ck->span;
+	return SET_INI_TRUE;
+}
+
+/* Called with the stream just full-flushed into outf. */
+static SET_INI_BOOLEAN darc_checkpoint_save(struct darc_checkpoint*ck,FILE*outf,int level,int curlevel,int curstrategy,
+size_t ibs,const struct darc_tune*tune,const struct darc_dict*dict){
+	__off64_t out;
+	if(fflush(outf) || fsync(fileno(outf)) || (out=ftello64(outf))==-1){
+		errnolog("Can't sync the output");
+		return SET_INI_FALSE;
+	}
+	ck->out=out;
+	Bytef b[CHECKPOINT_SIZE];
+	darc_checkpoint_record(ck,b,level,curlevel,curstrategy,ibs,tune,dict);
+	if(pwrite(ck->fd,b,CHECKPOINT_SIZE,0)!=CHECKPOINT_SIZE || fdatasync(ck->fd)){
+		errnolog("Can't write the checkpoint to '%s'",ck->path);
+		return SET_INI_FALSE;
+	}
+	return SET_INI_TRUE;
+}
+
+/* A finished stream needs no checkpoint. */
+static void darc_checkpoint_end(struct darc_checkpoint*ck,SET_INI_BOOLEAN done){
+	if(ck->fd==-1)
+		return;
+	close(ck->fd);
+	if(done && unlink(ck->path))
+		errnolog("Can't remove file '%s'",ck->path);
+}
+
+/* Logs a failure of a deflate context; the result for darc_compress. */
+static int darc_compress_status(const darc_ctx*ctx,int e){
+	switch(e){
+		case DARC_WRITE_ERROR:{
+			elog("Output error.");
+			return darc_compress_fwrite_error;
+		}
+		case DARC_MEM_ERROR:{
+			clog("deflate: Not enough memory. msg='%s'.",darc_ctx_message(ctx));
+			return darc_compress_critical_malloc_error;
+		}
+		default:{
+			elog("deflate: The stream state was inconsistent. msg='%s'.",darc_ctx_message(ctx));
+			return darc_compress_deflate_stream_error;
+		}
+	}
+}
+
+/* If map is not NULL the input is taken from it in ibs-sized slices instead of
+inf. ck is NULL unless --checkpoint. */
+static int darc_compress(FILE*inf,const Bytef*map,size_t mapsz,FILE*outf,int level,size_t ibs,size_t obs,
+struct darc_tune*tune,const struct darc_dict*dict,struct darc_checkpoint*ck){
+	assert(ibs>0 && obs>0);
+	size_t mappos=0;
+	Bytef *ibuf=NULL;
+	if(ck && !darc_checkpoint_start(ck,inf,map,mapsz,&mappos,outf,level,ibs,tune,dict))
+		return darc_compress_checkpoint_error;
+	SET_INI_BOOLEAN raw=ck && ck->resumed;
+	if(!map && !(ibuf=malloc(ibs))){
+		critmalloc(ibs,"");
+		return darc_compress_critical_malloc_error;
+	}
+	darc_ctx *ctx=darc_deflate_ctx(level,raw,obs,dict);
+	if(!ctx){
+		free(ibuf);
+		return darc_compress_deflateinit_level_error;
+	}
+	int r=darc_compress_ok,e=DARC_OK;
+	if(raw)
+		e=darc_ctx_set_level(ctx,ck->level,ck->strategy,darc_stats_output,outf);
+	while(e==DARC_OK){
+		/* A checkpoint falls on a multiple of the span whatever ibs is. */
+		size_t lim=ck && ck->next-ck->in<ibs?ck->next-ck->in:ibs,len;
+		const Bytef *p;
+		if(map){
+			struct darc_stats_mark m;
+			darc_stats_start(&m);
+			p=map+mappos;
+			len=mapsz-mappos<lim?mapsz-mappos:lim;
+			mappos+=len;
+			darc_map_advise(map,mapsz,mappos,ibs);
+			darc_stats_stop(darc_stats_read,&m,len);
+		}else{
+			p=ibuf;
+			len=darc_stats_fread(ibuf,lim,inf);
+			if(ferror(inf)){
+				elog("Input error.");
+				r=darc_compress_fread_error;
+				goto l_end;
+			}
+		}
+		if(!len)
+			break;
+		if(ck){
+			ck->check=adler32_z(ck->check,p,len);
+			ck->in+=len;
+		}
+		if(tune){
+			int lvl,strategy;
+			darc_tune_block(tune,p,len,level,&lvl,&strategy);
+			if((e=darc_stats_set_level(ctx,lvl,strategy,darc_stats_output,outf))!=DARC_OK)
+				break;
+		}
+		if((e=darc_stats_push(ctx,p,len,0,darc_stats_output,outf))!=DARC_OK)
+			break;
+		if(ck && ck->in==ck->next){
+			int curlevel,curstrategy;
+			if((e=darc_stats_flush(ctx,1,darc_stats_output,outf))!=DARC_OK)
+				break;
+			ck->next+=ck->span;
+			darc_ctx_get_level(ctx,&curlevel,&curstrategy);
+			if(!darc_checkpoint_save(ck,outf,level,curlevel,curstrategy,ibs,tune,dict)){
+				r=darc_compress_checkpoint_error;
+				goto l_end;
+			}
+		}
+	}
+	if(e==DARC_OK)
+		e=darc_stats_push(ctx,NULL,0,1,darc_stats_output,outf);
+	if(e!=DARC_OK){
+		r=darc_compress_status(ctx,e);
+	}else if(raw){
+		/* The zlib trailer, the adler32 of the whole input in big-endian. */
+		Bytef t[4]={ck->check>>24,ck->check>>16,ck->check>>8,ck->check};
+		if(darc_stats_fwrite(t,4,outf)!=4){
+			elog("Output error.");
+			r=darc_compress_fwrite_error;
+		}
+	}
+l_end:
+	darc_ctx_free(ctx);
+	free(ibuf);
+	return r;
+}
+
+#define ADLER_BASE 65521
+#define ADLER_NMAX 5552
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+
+/* adler32 32 bytes a step: s1 by summing absolute differences against zero, s2
+by multiplying the bytes with their weights(32..1), for up to ADLER_NMAX bytes
+between the reductions. */
+__attribute__((target("ssse3")))
+static uLong darc_adler32_ssse3(uLong adler,const Bytef*p,size_t len){
+	uint32_t s1=adler&0xffff,s2=adler>>16;
+	size_t blocks=len/32;
+	len-=blocks*32;
+	const __m128i tap1=_mm_setr_epi8(32,31,30,29,28,27,26,25,24,23,22,21,20,19,18,17);
+	const __m128i tap2=_mm_setr_epi8(16,15,14,13,12,11,10,9,8,7,6,5,4,3,2,1);
+	const __m128i zero=_mm_setzero_si128(),ones=_mm_set1_epi16(1);
+	while(blocks){
+		size_t n=ADLER_NMAX/32<blocks?ADLER_NMAX/32:blocks;
+		blocks-=n;
+		__m128i ps=_mm_set_epi32(0,0,0,s1*n),v1=zero,v2=_mm_set_epi32(0,0,0,s2);
+		do{
+			__m128i b1=_mm_loadu_si128((const __m128i*)p),b2=_mm_loadu_si128((const __m128i*)(p+16));
+			ps=_mm_add_epi32(ps,v1);
+			v1=_mm_add_epi32(v1,_mm_add_epi32(_mm_sad_epu8(b1,zero),_mm_sad_epu8(b2,zero)));
+			v2=_mm_add_epi32(v2,_mm_madd_epi16(_mm_maddubs_epi16(b1,tap1),ones));
+			v2=_mm_add_epi32(v2,_mm_madd_epi16(_mm_maddubs_epi16(b2,tap2),ones));
+			p+=32;
+		}while(--n);
+		v2=_mm_add_epi32(v2,_mm_slli_epi32(ps,5));
+		v1=_mm_add_epi32(v1,_mm_shuffle_epi32(v1,_MM_SHUFFLE(2,3,0,1)));
+		v1=_mm_add_epi32(v1,_mm_shuffle_epi32(v1,_MM_SHUFFLE(1,0,3,2)));
+		v2=_mm_add_epi32(v2,_mm_shuffle_epi32(v2,_MM_SHUFFLE(2,3,0,1)));
+		v2=_mm_add_epi32(v2,_mm_shuffle_epi32(v2,_MM_SHUFFLE(1,0,3,2)));
+		s1=(s1+(uint32_t)_mm_cvtsi128_si32(v1))%ADLER_BASE;
+		s2=(uint32_t)_mm_cvtsi128_si32(v2)%ADLER_BASE;
+	}
+	return adler32_z(s2<<16|s1,p,len);
+}
+#endif
+
+/* zlib's adler32 or, where the CPU has it, the SSSE3 one. */
+static uLong darc_adler32(uLong adler,const Bytef*p,size_t len){
+#if defined(__x86_64__) || defined(__i386__)
+	if(__builtin_cpu_supports("ssse3"))
+		return darc_adler32_ssse3(adler,p,len);
+#endif
+	return adler32_z(adler,p,len);
+}
+
+#define STORED_BLOCK_SIZE 0xffff
+#define STORED_IOV 1024
+
+/* Writes the iovecs out, resuming after short writes. */
+static SET_INI_BOOLEAN darc_writev_all(int fd,struct iovec*iov,int n){
+	while(n){
+		struct darc_stats_mark m;
+		darc_stats_start(&m);
+		ssize_t w=writev(fd,iov,n);
+		darc_stats_stop(darc_stats_write,&m,w>0?w:0);
+		if(w<0){
+			if(errno==EINTR)
+				continue;
+			return SET_INI_FALSE;
+		}
+		while(n && (size_t)w>=iov->iov_len){
+			w-=iov->iov_len;
+			++iov;
+			--n;
+		}
+		if(n){
+			iov->iov_base=(char*)iov->iov_base+w;
+			iov->iov_len-=w;
+		}
+	}
+	return SET_INI_TRUE;
+}
+
+/* Moves len bytes at off of the input file to fd inside the kernel. FALSE with
+errno EINVAL or ENOSYS when the pair of files does not support it. */
+static SET_INI_BOOLEAN darc_sendfile_all(int fd,int ifd,off64_t off,size_t len){
+	while(len){
+		struct darc_stats_mark m;
+		darc_stats_start(&m);
+		ssize_t w=sendfile64(fd,ifd,&off,len);
+		darc_stats_stop(darc_stats_write,&m,w>0?w:0);
+		if(w<=0){
+			if(w<0 && errno==EINTR)
+				continue;
+			if(!w)
+				errno=EIO;
+			return SET_INI_FALSE;
+		}
+		len-=w;
+	}
+	return SET_INI_TRUE;
+}
+
+/* l=none: the zlib stream is put together here instead of by deflate, stored
+blocks of STORED_BLOCK_SIZE bytes behind their 5-byte headers, so the data is
+only read for the adler32. A mapped input goes to outf with sendfile(into a
+pipe without a copy); otherwise slices of ibs are read and written with one
+writev each. */
+static int darc_compress_stored(FILE*inf,const Bytef*map,size_t mapsz,FILE*outf,size_t ibs){
+	if(fflush(outf)){
+		elog("Output error.");
+		return darc_compress_fwrite_error;
+	}
+	int fd=fileno(outf);
+	ibs=ibs<STORED_BLOCK_SIZE?STORED_BLOCK_SIZE:ibs/STORED_BLOCK_SIZE*STORED_BLOCK_SIZE;
+	if(ibs>(size_t)STORED_BLOCK_SIZE*(STORED_IOV/2))
+		ibs=(size_t)STORED_BLOCK_SIZE*(STORED_IOV/2);
+	Bytef *ibuf=NULL,(*hdrs)[5]=malloc(STORED_IOV/2*5);
+	struct iovec *iov=malloc(STORED_IOV*sizeof(*iov));
+	if(!hdrs || !iov || (!map && !(ibuf=malloc(ibs)))){
+		critmalloc(!hdrs?STORED_IOV/2*5:!iov?STORED_IOV*sizeof(*iov):ibs,"");
+		free(iov);
+		free(hdrs);
+		return darc_compress_critical_malloc_error;
+	}
+	int r=darc_compress_ok;
+	SET_INI_BOOLEAN sendable=map!=NULL;
+	uLong check=adler32(0,Z_NULL,0);
+	size_t mappos=0;
+	/* CINFO from wb=, the lowest FLEVEL, FCHECK to make it a multiple of 31. */
+	Bytef zhdr[2]={(opt_window_bits-8)<<4|Z_DEFLATED,0};
+	zhdr[1]=(31-(zhdr[0]<<8)%31)%31;
+	iov[0]=(struct iovec){zhdr,2};
+	if(!darc_writev_all(fd,iov,1)){
+		errnolog("Output error");
+		r=darc_compress_fwrite_error;
+		goto l_end;
+	}
+	while(1){
+		const Bytef *p;
+		size_t len;
+		struct darc_stats_mark m;
+		if(map){
+			darc_stats_start(&m);
+			p=map+mappos;
+			len=mapsz-mappos<ibs?mapsz-mappos:ibs;
+			mappos+=len;
+			darc_map_advise(map,mapsz,mappos,ibs);
+			darc_stats_stop(darc_stats_read,&m,len);
+		}else{
+			p=ibuf;
+			len=darc_stats_fread(ibuf,ibs,inf);
+			if(ferror(inf)){
+				elog("Input error.");
+				r=darc_compress_fread_error;
+				goto l_end;
+			}
+		}
+		darc_stats_start(&m);
+		check=darc_adler32(check,p,len);
+		darc_stats_stop(darc_stats_codec,&m,0);
+		/* The last block of a mapping is known to be final; the end of a
+		stream is marked with an empty block. */
+		SET_INI_BOOLEAN last=map?mappos==mapsz:!len;
+		int n=0;
+		for(size_t off=0,b=0;off<len || (!len && !b);off+=STORED_BLOCK_SIZE,++b){
+			size_t bsz=len-off<STORED_BLOCK_SIZE?len-off:STORED_BLOCK_SIZE;
+			hdrs[b][0]=last && off+bsz==len;
+			hdrs[b][1]=bsz;
+			hdrs[b][2]=bsz>>8;
+			hdrs[b][3]=~bsz;
+			hdrs[b][4]=~bsz>>8;
+			iov[n++]=(struct iovec){hdrs[b],5};
+			if(!bsz)
+				break;
+			if(sendable){
+				if(!darc_writev_all(fd,iov,n)){
+					errnolog("Output error");
+					r=darc_compress_fwrite_error;
+					goto l_end;
+				}
+				n=0;
+				if(darc_sendfile_all(fd,fileno(inf),p+off-map,bsz))
+					continue;
+				if(errno!=EINVAL && errno!=ENOSYS){
+					errnolog("Output error");
+					r=darc_compress_fwrite_error;
+					goto l_end;
+				}
+				sendable=SET_INI_FALSE;
+			}
+			iov[n++]=(struct iovec){(void*)(p+off),bsz};
+		}
+		if(!darc_writev_all(fd,iov,n)){
+			errnolog("Output error");
+			r=darc_compress_fwrite_error;
+			goto l_end;
+		}
+		if(last)
+			break;
+	}
+	Bytef trailer[4]={check>>24,check>>16,check>>8,check};
+	iov[0]=(struct iovec){trailer,4};
+	if(!darc_writev_all(fd,iov,1)){
+		errnolog("Output error");
+		r=darc_compress_fwrite_error;
+	}
+l_end:
+	free(ibuf);
+	free(iov);
+	free(hdrs);
+	return r;
+}
+
+#define FOLLOW_FLUSH_INTERVAL 1000
+#define FOLLOW_POLL_INTERVAL 250
+
+static volatile sig_atomic_t darc_live_stopped;
+
+static void darc_live_stop(int sig){
+	darc_live_stopped=1;
+}
+
+/* A sync flush or the finish reach the consumer at once. */
+static SET_INI_BOOLEAN darc_live_flush(darc_ctx*ctx,FILE*outf,SET_INI_BOOLEAN finish){
+	int e=finish?darc_stats_push(ctx,NULL,0,1,darc_stats_output,outf):darc_stats_flush(ctx,0,darc_stats_output,outf);
+	if(e!=DARC_OK){
+		darc_compress_status(ctx,e);
+		return SET_INI_FALSE;
+	}
+	if(fflush(outf)){
+		elog("Output error.");
+		return SET_INI_FALSE;
+	}
+	return SET_INI_TRUE;
+}
+
+/* --flush-interval/--flush-bytes/--follow: the input is taken as it comes
+instead of in whole buffers, and a Z_SYNC_FLUSH puts what was fed out once
+interval ms passed since its first byte or bytes of it gathered(0 turns a
+bound off). follow keeps reading a regular file at its end like tail -f and
+starts over if it is truncated; SIGINT or SIGTERM finish the stream. */
+static int darc_compress_live(FILE*inf,FILE*outf,int level,size_t ibs,size_t obs,const struct darc_dict*dict,
+uint64_t interval,uint64_t bytes,SET_INI_BOOLEAN follow){
+	assert(ibs>0 && obs>0);
+	if(ibs>UINT_MAX)
+		ibs=UINT_MAX;
+	Bytef *ibuf=malloc(ibs);
+	if(!ibuf){
+		critmalloc(ibs,"");
+		return darc_compress_critical_malloc_error;
+	}
+	darc_ctx *ctx=darc_deflate_ctx(level,SET_INI_FALSE,obs,dict);
+	if(!ctx){
+		free(ibuf);
+		return darc_compress_deflateinit_level_error;
+	}
+	struct sigaction sa={.sa_handler=darc_live_stop},oldint,oldterm;
+	if(follow){
+		/* No SA_RESTART: the wait for more input is cut short. */
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGINT,&sa,&oldint);
+		sigaction(SIGTERM,&sa,&oldterm);
+	}
+	int fd=fileno(inf),r=darc_compress_ok;
+	struct stat st;
+	SET_INI_BOOLEAN regular=!fstat(fd,&st) && S_ISREG(st.st_mode);
+	__off64_t pos=regular?lseek64(fd,0,SEEK_CUR):0;
+	uint64_t pending=0;
+	double deadline=0;
+	while(1){
+		if(pending && ((bytes && pending>=bytes) || (interval && darc_now()>=deadline))){
+			if(!darc_live_flush(ctx,outf,SET_INI_FALSE)){
+				r=darc_compress_fwrite_error;
+				break;
+			}
+			pending=0;
+		}
+		if(darc_live_stopped)
+			break;
+		int timeout=-1;
+		if(pending && interval){
+			double left=deadline-darc_now();
+			timeout=left>0?left*1000+1:0;
+		}
+		if(!regular){
+			struct pollfd pfd={.fd=fd,.events=POLLIN};
+			int e=poll(&pfd,1,timeout);
+			if(e<0 && errno!=EINTR){
+				errnolog("Input error");
+				r=darc_compress_fread_error;
+				break;
+			}
+			if(e<=0)
+				continue;
+		}
+		struct darc_stats_mark m;
+		darc_stats_start(&m);
+		ssize_t n=read(fd,ibuf,ibs);
+		darc_stats_stop(darc_stats_read,&m,n>0?n:0);
+		if(n<0){
+			if(errno==EINTR)
+				continue;
+			errnolog("Input error");
+			r=darc_compress_fread_error;
+			break;
+		}
+		if(!n){
+			if(!follow || !regular)
+				break;
+			if(!fstat(fd,&st) && st.st_size<pos){
+				wlog("The input was truncated, reading it from the start.");
+				pos=lseek64(fd,0,SEEK_SET);
+			}
+			/* Input arriving while idle waits no longer than the interval either. */
+			int nap=interval && interval<FOLLOW_POLL_INTERVAL?interval:FOLLOW_POLL_INTERVAL;
+			poll(NULL,0,timeout>=0 && timeout<nap?timeout:nap);
+			continue;
+		}
+		pos+=n;
+		if(!pending)
+			deadline=darc_now()+interval/1000.;
+		pending+=n;
+		int e=darc_stats_push(ctx,ibuf,n,0,darc_stats_output,outf);
+		if(e!=DARC_OK){
+			r=darc_compress_status(ctx,e);
+			break;
+		}
+	}
+	if(follow){
+		sigaction(SIGINT,&oldint,NULL);
+		sigaction(SIGTERM,&oldterm,NULL);
+	}
+	if(r==darc_compress_ok && !darc_live_flush(ctx,outf,SET_INI_TRUE))
+		r=darc_compress_fwrite_error;
+	darc_ctx_free(ctx);
+	free(ibuf);
+	return r;
+}
+
+enum darc_decompress_result{
+	darc_decompress_ok,
+	darc_decompress_critical_malloc_error,
+	darc_decompress_fread_error,
+	darc_decompress_inflateinit_version_error,
+	darc_decompress_inflateinit_stream_error,
+	darc_decompress_inflateinit_critical_memory_error,
+	darc_decompress_inflateinit_ciritcal_undefined_behavior_error,
+	darc_decompress_fwrite_error,
+	darc_decompress_inflateend_stream_error,
+	darc_decompress_inflateend_critical_undefined_behavior_error,
+	darc_decompress_inflate_need_dict_error,
+	darc_decompress_inflate_data_error,
+	darc_decompress_inflate_stream_error,
+	darc_decompress_inflate_critical_memory_error,
+	darc_decompress_no_data_error,
+	darc_decompress_blocked_error,
+	darc_decompress_thread_error,
+	darc_decompress_dedup_error
+};
+
+#define BLOCKED_MAGIC "DARC"
+#define BLOCKED_MAGIC_SIZE 4
+#define BLOCKED_VERSION 1
+#define BLOCKED_VERSION_DICT 2
+#define ARCHIVE_MAGIC "DARCARC\1"
+#define ARCHIVE_MAGIC_SIZE 8
+#define DEDUP_MAGIC "DARD"
+#define DEDUP_MAGIC_SIZE 4
+#define DEDUP_VERSION 1
+
+/* The largest compressed block of a bs-sized blocked file. The writer sizes its
+output slots by deflateBound under its own wb/ml/st, which the file does not
+record; without a stream deflateBound is the bound for any of them. 0 if it
+overflows. */
+static size_t darc_blocked_bound(size_t bs){
+	size_t cbs=deflateBound(Z_NULL,bs);
+	return cbs<bs || __builtin_add_overflow(cbs,16,&cbs)?0:cbs;
+}
+
+static int darc_decompress_blocked(FILE*inf,FILE*outf,Bytef*buf,size_t*bufsz,size_t nthreads,
+const struct darc_dict*dict);
+static int darc_decompress_dedup(FILE*inf,FILE*outf,Bytef*buf,size_t*bufsz,size_t ibs,size_t obs,
+const struct darc_dict*dict);
+
+/* An inflate context with obs-sized output pieces and the dictionary. NULL,
+logged, on failure. */
+static darc_ctx *darc_inflate_ctx(size_t obs,const struct darc_dict*dict){
+	darc_ctx *ctx=darc_ctx_new(1,0);
+	if(!ctx){
+		clog("darc_ctx_new: Not enough memory.");
+		return NULL;
+	}
+	if(darc_ctx_set_buffers(ctx,obs,obs)!=DARC_OK || (dict && darc_ctx_set_dictionary(ctx,dict->data,dict->size)!=DARC_OK)){
+		elog("inflateInit: The stream state was inconsistent.");
+		darc_ctx_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+/* Logs a failure of an inflate context; the result for darc_decompress. */
+static int darc_decompress_status(const darc_ctx*ctx,int e){
+	switch(e){
+		case DARC_NEED_DICT:{
+			elog("inflate: A preset dictionary(id %08lx) required at this point. msg='%s'.",
+				darc_ctx_dictionary_id(ctx),darc_ctx_message(ctx));
+			return darc_decompress_inflate_need_dict_error;
+		}
+		case DARC_DATA_ERROR:{
+			elog("inflate: The input data was corrupted. msg='%s'.",darc_ctx_message(ctx));
+			return darc_decompress_inflate_data_error;
+		}
+		case DARC_MEM_ERROR:{
+			clog("inflate: Not enough memory. msg='%s'.",darc_ctx_message(ctx));
+			return darc_decompress_inflate_critical_memory_error;
+		}
+		case DARC_WRITE_ERROR:{
+			elog("Output error.");
+			return darc_decompress_fwrite_error;
+		}
+		default:{
+			elog("inflate: The stream state was inconsistent. msg='%s'.",darc_ctx_message(ctx));
+			return darc_decompress_inflate_stream_error;
+		}
+	}
+}
+
+/* Decompresses the members of the input one after another(--append writes a
+file of several); each is a zlib stream or of the blocked or dedup format. The
+presz bytes at pre were already read from inf. */
+static int darc_decompress(FILE*inf,FILE*outf,const Bytef*pre,size_t presz,size_t ibs,size_t obs,size_t nthreads,
+const struct darc_dict*dict){
+	if(ibs<presz)
+		ibs=presz;
+	Bytef *ibuf=malloc(ibs);
+	if(!ibuf){
+		critmalloc(ibs,"");
+		return darc_decompress_critical_malloc_error;
+	}
+	darc_ctx *ctx=darc_inflate_ctx(obs,dict);
+	if(!ctx){
+		free(ibuf);
+		return darc_decompress_critical_malloc_error;
+	}
+	if(presz)
+		memcpy(ibuf,pre,presz);
+	/* The unused input is at the start of ibuf. */
+	size_t avail=presz;
+	int r=darc_decompress_no_data_error;
+	while(1){
+		/* Enough of it to tell the format. */
+		if(avail<ARCHIVE_MAGIC_SIZE){
+			avail+=darc_stats_fread(ibuf+avail,ibs-avail,inf);
+			if(ferror(inf)){
+				elog("Input error.");
+				r=darc_decompress_fread_error;
+				break;
+			}
+		}
+		if(!avail)
+			break;
+		if(avail>=BLOCKED_MAGIC_SIZE && !memcmp(ibuf,BLOCKED_MAGIC,BLOCKED_MAGIC_SIZE)){
+			if(darc_decompress_blocked(inf,outf,ibuf,&avail,nthreads,dict)){
+				r=darc_decompress_blocked_error;
+				break;
+			}
+			r=darc_decompress_ok;
+			continue;
+		}
+		if(avail>=DEDUP_MAGIC_SIZE && !memcmp(ibuf,DEDUP_MAGIC,DEDUP_MAGIC_SIZE)){
+			if(darc_decompress_dedup(inf,outf,ibuf,&avail,ibs,obs,dict)){
+				r=darc_decompress_dedup_error;
+				break;
+			}
+			r=darc_decompress_ok;
+			continue;
+		}
+		const Bytef *p=ibuf;
+		int e=darc_ctx_reset(ctx);
+		while(e==DARC_OK){
+			size_t n=avail;
+			e=darc_stats_push_member(ctx,p,&n,darc_stats_output,outf);
+			p+=avail-n;
+			avail=n;
+			if(e!=DARC_OK || darc_ctx_at_end(ctx))
+				break;
+			p=ibuf;
+			avail=darc_stats_fread(ibuf,ibs,inf);
+			if(ferror(inf)){
+				elog("Input error.");
+				r=darc_decompress_fread_error;
+				goto l_end;
+			}
+			if(!avail){
+				elog("Unexpected end of the input data.");
+				r=darc_decompress_inflate_data_error;
+				goto l_end;
+			}
+		}
+		if(e!=DARC_OK){
+			r=darc_decompress_status(ctx,e);
+			break;
+		}
+		memmove(ibuf,p,avail);
+		r=darc_decompress_ok;
+	}
+l_end:
+	darc_ctx_free(ctx);
+	free(ibuf);
+	return r;
+}
+
+#define WINDOW_SIZE 0x8000
+
+struct darc_pool_job{
+	const Bytef *in,*dict;
+	size_t insz,dictsz;
+	Bytef *ibuf,*obuf;
+	size_t obufsz,outsz;
+	uLong check;
+	int flush,level,strategy;
+	/* The time of the work, for --stats. */
+	double wall,cpu;
+	SET_INI_BOOLEAN done;
+};
+
+typedef SET_INI_BOOLEAN (*darc_pool_work)(z_stream*,struct darc_pool_job*);
+
+struct darc_pool{
+	pthread_mutex_t mtx;
+	pthread_cond_t work_cond,done_cond;
+	struct darc_pool_job *jobs;
+	size_t njobs,nfilled,nstarted;
+	pthread_t *threads;
+	size_t nthreads;
+	darc_pool_work work;
+	int level;
+	SET_INI_BOOLEAN inflating,stop,failed;
+};
+
+static void *darc_pool_worker(void*p){
+	struct darc_pool *pool=p;
+	z_stream s={.zalloc=Z_NULL,.zfree=Z_NULL,.opaque=Z_NULL};
+	int e=pool->inflating?inflateInit2(&s,-MAX_WBITS):
+		darc_deflate_init(&s,pool->level,SET_INI_TRUE);
+	pthread_mutex_lock(&pool->mtx);
+	if(e!=Z_OK){
+		elog("%s: error %i. msg='%s'.",pool->inflating?"inflateInit2":"deflateInit2",e,s.msg==Z_NULL?"":s.msg);
+		pool->failed=SET_INI_TRUE;
+		pthread_cond_broadcast(&pool->done_cond);
+		pthread_mutex_unlock(&pool->mtx);
+		return NULL;
+	}
+	while(1){
+		while(!pool->stop && pool->nstarted==pool->nfilled)
+			pthread_cond_wait(&pool->work_cond,&pool->mtx);
+		if(pool->stop)
+			break;
+		struct darc_pool_job *j=pool->jobs+pool->nstarted++%pool->njobs;
+		pthread_mutex_unlock(&pool->mtx);
+		struct darc_stats_mark m={0};
+		darc_stats_start(&m);
+		SET_INI_BOOLEAN ok=pool->work(&s,j);
+		if(opt_stats){
+			j->wall=darc_now()-m.wall;
+			j->cpu=darc_cpu_now()-m.cpu;
+		}
+		pthread_mutex_lock(&pool->mtx);
+		if(!ok)
+			pool->failed=SET_INI_TRUE;
+		j->done=SET_INI_TRUE;
+		pthread_cond_broadcast(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mtx);
+	if(pool->inflating)
+		inflateEnd(&s);
+	else
+		deflateEnd(&s);
+	return NULL;
+}
+
+static void darc_pool_free_jobs(struct darc_pool*pool){
+	for(size_t n=0;n<pool->njobs;++n){
+		free(pool->jobs[n].ibuf);
+		free(pool->jobs[n].obuf);
+	}
+	free(pool->jobs);
+}
+
+/* Allocates njobs slots(ibs bytes of input, obs bytes of output each; zero means no buffer)
+and launches nthreads workers, each owning one raw z_stream. */
+static SET_INI_BOOLEAN darc_pool_start(struct darc_pool*pool,size_t nthreads,size_t njobs,
+size_t ibs,size_t obs,darc_pool_work work,SET_INI_BOOLEAN inflating,int level){
+	assert(nthreads>0 && njobs>0);
+	memset(pool,0,sizeof(*pool));
+	pool->work=work;
+	pool->inflating=inflating;
+	pool->level=level;
+	pool->jobs=calloc(njobs,sizeof(*pool->jobs));
+	if(!pool->jobs){
+		critmalloc(njobs*sizeof(*pool->jobs),"");
+		return SET_INI_FALSE;
+	}
+	pool->njobs=njobs;
+	for(size_t n=0;n<njobs;++n){
+		if(ibs && !(pool->jobs[n].ibuf=malloc(ibs))){
+			critmalloc(ibs,"");
+			darc_pool_free_jobs(pool);
+			return SET_INI_FALSE;
+		}
+		if(obs && !(pool->jobs[n].obuf=malloc(obs))){
+			critmalloc(obs,"");
+			darc_pool_free_jobs(pool);
+			return SET_INI_FALSE;
+		}
+		pool->jobs[n].obufsz=obs;
+	}
+	pool->threads=malloc(nthreads*sizeof(*pool->threads));
+	if(!pool->threads){
+		critmalloc(nthreads*sizeof(*pool->threads),"");
+		darc_pool_free_jobs(pool);
+		return SET_INI_FALSE;
+	}
+	pthread_mutex_init(&pool->mtx,NULL);
+	pthread_cond_init(&pool->work_cond,NULL);
+	pthread_cond_init(&pool->done_cond,NULL);
+	for(;pool->nthreads<nthreads;++pool->nthreads){
+		int e=pthread_create(pool->threads+pool->nthreads,NULL,darc_pool_worker,pool);
+		if(e){
+			elog("pthread_create: %s.",strerror(e));
+			break;
+		}
+	}
+	if(!pool->nthreads){
+		free(pool->threads);
+		darc_pool_free_jobs(pool);
+		pthread_cond_destroy(&pool->done_cond);
+		pthread_cond_destroy(&pool->work_cond);
+		pthread_mutex_destroy(&pool->mtx);
+		return SET_INI_FALSE;
+	}
+	return SET_INI_TRUE;
+}
+
+static void darc_pool_stop(struct darc_pool*pool){
+	pthread_mutex_lock(&pool->mtx);
+	pool->stop=SET_INI_TRUE;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mtx);
+	for(size_t n=0;n<pool->nthreads;++n)
+		pthread_join(pool->threads[n],NULL);
+	free(pool->threads);
+	darc_pool_free_jobs(pool);
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mtx);
+}
+
+/* The slot for the next job; it is free once all jobs before it were collected. */
+static struct darc_pool_job *darc_pool_next(struct darc_pool*pool){
+	return pool->jobs+pool->nfilled%pool->njobs;
+}
+
+static void darc_pool_submit(struct darc_pool*pool){
+	pthread_mutex_lock(&pool->mtx);
+	pool->jobs[pool->nfilled++%pool->njobs].done=SET_INI_FALSE;
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mtx);
+}
+
+/* Waits for the job number seq, returns NULL if any worker has failed. */
+static struct darc_pool_job *darc_pool_collect(struct darc_pool*pool,size_t seq){
+	struct darc_pool_job *j=pool->jobs+seq%pool->njobs;
+	pthread_mutex_lock(&pool->mtx);
+	while(!j->done && !pool->failed)
+		pthread_cond_wait(&pool->done_cond,&pool->mtx);
+	SET_INI_BOOLEAN failed=pool->failed;
+	pthread_mutex_unlock(&pool->mtx);
+	if(failed)
+		return NULL;
+	darc_stats.wall[darc_stats_codec]+=j->wall;
+	darc_stats.cpu[darc_stats_codec]+=j->cpu;
+	return j;
+}
+
+static SET_INI_BOOLEAN darc_pool_deflate_block(z_stream*s,struct darc_pool_job*j){
+	int strategy=j->strategy;
+	if(strategy==STRATEGY_AUTO)
+		strategy=darc_probe_strategy(s,j->in,j->insz,j->level,j->obuf,j->obufsz);
+	if(deflateReset(s)!=Z_OK){
+		elog("deflateReset: The stream state was inconsistent.");
+		return SET_INI_FALSE;
+	}
+	if(deflateParams(s,j->level,strategy)!=Z_OK){
+		elog("deflateParams: The stream state was inconsistent.");
+		return SET_INI_FALSE;
+	}
+	if(j->dictsz && deflateSetDictionary(s,j->dict,j->dictsz)!=Z_OK){
+		elog("deflateSetDictionary: The stream state was inconsistent.");
+		return SET_INI_FALSE;
+	}
+	const Bytef *in=j->in;
+	size_t left=j->insz;
+	s->next_out=j->obuf;
+	s->avail_out=j->obufsz>UINT_MAX?UINT_MAX:j->obufsz;
+	do{
+		s->next_in=(Bytef*)in;
+		s->avail_in=left>UINT_MAX?UINT_MAX:left;
+		in+=s->avail_in;
+		left-=s->avail_in;
+		int e=deflate(s,left?Z_NO_FLUSH:j->flush);
+		if(e!=(left || j->flush!=Z_FINISH?Z_OK:Z_STREAM_END) || s->avail_in || !s->avail_out){
+			elog("deflate: Unexpected state(%i). msg='%s'.",e,s->msg==Z_NULL?"":s->msg);
+			return SET_INI_FALSE;
+		}
+	}while(left);
+	j->outsz=s->next_out-j->obuf;
+	j->check=adler32_z(1,j->in,j->insz);
+	return SET_INI_TRUE;
+}
+
+enum darc_compress_parallel_result{
+	darc_compress_parallel_ok,darc_compress_parallel_critical_malloc_error,
+	darc_compress_parallel_pool_error,darc_compress_parallel_worker_error,
+	darc_compress_parallel_fread_error,darc_compress_parallel_fwrite_error
+};
+
+/* pigz-style: every ibs-sized block is deflated on its own thread, primed with
+the last 32 KiB of the previous block and ended with a sync flush, so the
+concatenation of blocks is a single valid zlib stream.
+In the blocked format every block is an independent raw deflate stream preceded
+by its compressed size, expanded size and adler32(all little-endian uint32);
+the file starts with BLOCKED_MAGIC, the version and the block size, and ends
+with a zero entry. */
+static int darc_compress_parallel(FILE*inf,const Bytef*map,size_t mapsz,FILE*outf,
+int level,size_t ibs,size_t nthreads,SET_INI_BOOLEAN blocked,const struct darc_tune*tune,const struct darc_dict*dict){
+	assert(ibs>0 && nthreads>0);
+	if(blocked && ibs>UINT32_MAX){
+		elog("The block size is too large(%zu). The maximum block size allowed is %zu bytes.",ibs,(size_t)UINT32_MAX);
+		return darc_compress_parallel_critical_malloc_error;
+	}
+	z_stream bnd={.zalloc=Z_NULL,.zfree=Z_NULL,.opaque=Z_NULL};
+	if(darc_deflate_init(&bnd,level,SET_INI_TRUE)!=Z_OK){
+		elog("deflateInit2: Invalid compression level(%i).",level);
+		return darc_compress_parallel_pool_error;
+	}
+	size_t obs=deflateBound(&bnd,ibs);
+	deflateEnd(&bnd);
+	if(obs<ibs || __builtin_add_overflow(obs,16,&obs)){
+		elog("The input buffer size is too large(%zu).",ibs);
+		return darc_compress_parallel_critical_malloc_error;
+	}
+	/* darc_decompress_blocked and --test take any block up to this size back. */
+	assert(!blocked || obs<=darc_blocked_bound(ibs));
+	struct darc_pool pool;
+	if(!darc_pool_start(&pool,nthreads,nthreads*2,map?0:ibs,obs,darc_pool_deflate_block,SET_INI_FALSE,level))
+		return darc_compress_parallel_pool_error;
+	size_t mappos=0;
+	Bytef hdr[BLOCKED_MAGIC_SIZE+9];
+	size_t hdrsz;
+	if(blocked){
+		memcpy(hdr,BLOCKED_MAGIC,BLOCKED_MAGIC_SIZE);
+		hdr[BLOCKED_MAGIC_SIZE]=dict?BLOCKED_VERSION_DICT:BLOCKED_VERSION;
+		darc_put32le(hdr+BLOCKED_MAGIC_SIZE+1,ibs);
+		hdrsz=BLOCKED_MAGIC_SIZE+5;
+		if(dict){
+			darc_put32le(hdr+hdrsz,dict->id);
+			hdrsz+=4;
+		}
+	}else{
+		/* CINFO from wb= as the workers deflate with it, FLEVEL as deflate sets it. */
+		int lvl=level==Z_DEFAULT_COMPRESSION?6:level;
+		hdr[0]=(opt_window_bits-8)<<4|Z_DEFLATED;
+		hdr[1]=(lvl<2?0:lvl<6?1:lvl==6?2:3)<<6|(dict?0x20:0);
+		hdr[1]+=(31-(hdr[0]<<8|hdr[1])%31)%31;
+		hdrsz=2;
+		if(dict){
+			hdr[2]=dict->id>>24;
+			hdr[3]=dict->id>>16;
+			hdr[4]=dict->id>>8;
+			hdr[5]=dict->id;
+			hdrsz+=4;
+		}
+	}
+	int r=darc_compress_parallel_ok;
+	if(darc_stats_fwrite(hdr,hdrsz,outf)!=hdrsz){
+		elog("Output error.");
+		darc_pool_stop(&pool);
+		return darc_compress_parallel_fwrite_error;
+	}
+	uLong check=adler32(0,Z_NULL,0);
+	/* A streamed job is primed from the input slot of the one before it, so
+	that slot stays out of use until the job is collected too. */
+	size_t written=0,depth=map || blocked?pool.njobs:pool.njobs-1;
+	struct darc_pool_job *prev=NULL;
+	SET_INI_BOOLEAN eof=SET_INI_FALSE;
+	while(1){
+		if(!eof && pool.nfilled-written<depth){
+			struct darc_pool_job *j=darc_pool_next(&pool);
+			if(map){
+				struct darc_stats_mark m;
+				darc_stats_start(&m);
+				j->insz=mapsz-mappos<ibs?mapsz-mappos:ibs;
+				j->in=map+mappos;
+				mappos+=j->insz;
+				darc_map_advise(map,mapsz,mappos,ibs);
+				darc_stats_stop(darc_stats_read,&m,j->insz);
+			}else{
+				j->insz=darc_stats_fread(j->ibuf,ibs,inf);
+				if(ferror(inf)){
+					elog("Input error.");
+					r=darc_compress_parallel_fread_error;
+					break;
+				}
+				j->in=j->ibuf;
+			}
+			if(!j->insz){
+				eof=SET_INI_TRUE;
+				continue;
+			}
+			j->flush=blocked?Z_FINISH:Z_SYNC_FLUSH;
+			j->level=tune && tune->adaptive && darc_incompressible(j->in,j->insz)?Z_NO_COMPRESSION:level;
+			j->strategy=!tune || !tune->automatic?opt_strategy:j->level==Z_NO_COMPRESSION?Z_DEFAULT_STRATEGY:STRATEGY_AUTO;
+			/* The previous slot is not refilled before this job is collected. */
+			if(prev && !blocked){
+				j->dictsz=prev->insz<WINDOW_SIZE?prev->insz:WINDOW_SIZE;
+				j->dict=prev->in+prev->insz-j->dictsz;
+			}else if(dict){
+				j->dictsz=dict->size<WINDOW_SIZE?dict->size:WINDOW_SIZE;
+				j->dict=dict->data+dict->size-j->dictsz;
+			}else{
+				j->dictsz=0;
+			}
+			prev=j;
+			darc_pool_submit(&pool);
+			continue;
+		}
+		if(written==pool.nfilled)
+			break;
+		struct darc_pool_job *j=darc_pool_collect(&pool,written);
+		if(!j){
+			r=darc_compress_parallel_worker_error;
+			break;
+		}
+		if(blocked){
+			Bytef ent[12];
+			darc_put32le(ent,j->outsz);
+			darc_put32le(ent+4,j->insz);
+			darc_put32le(ent+8,j->check);
+			if(darc_stats_fwrite(ent,12,outf)!=12){
+				elog("Output error.");
+				r=darc_compress_parallel_fwrite_error;
+				break;
+			}
+		}
+		if(darc_stats_fwrite(j->obuf,j->outsz,outf)!=j->outsz){
+			elog("Output error.");
+			r=darc_compress_parallel_fwrite_error;
+			break;
+		}
+		check=adler32_combine(check,j->check,j->insz);
+		++written;
+	}
+	darc_pool_stop(&pool);
+	if(r!=darc_compress_parallel_ok)
+		return r;
+	if(blocked){
+		Bytef ent[12]={0};
+		if(darc_stats_fwrite(ent,12,outf)!=12){
+			elog("Output error.");
+			return darc_compress_parallel_fwrite_error;
+		}
+		return darc_compress_parallel_ok;
+	}
+	/* An empty final fixed block and the adler32 trailer. */
+	Bytef trl[6]={0x03,0x00,check>>24,check>>16,check>>8,check};
+	if(darc_stats_fwrite(trl,6,outf)!=6){
+		elog("Output error.");
+		return darc_compress_parallel_fwrite_error;
+	}
+	return darc_compress_parallel_ok;
+}
+
+static SET_INI_BOOLEAN darc_pool_inflate_block(z_stream*s,struct darc_pool_job*j){
+	if(inflateReset(s)!=Z_OK){
+		elog("inflateReset: The stream state was inconsistent.");
+		return SET_INI_FALSE;
+	}
+	if(j->dictsz && inflateSetDictionary(s,j->dict,j->dictsz)!=Z_OK){
+		elog("inflateSetDictionary: The stream state was inconsistent.");
+		return SET_INI_FALSE;
+	}
+	s->next_in=(Bytef*)j->in;
+	s->avail_in=j->insz;
+	s->next_out=j->obuf;
+	s->avail_out=j->outsz;
+	int e=inflate(s,Z_FINISH);
+	if(e!=Z_STREAM_END || s->avail_out){
+		elog("inflate: The input data was corrupted(%i). msg='%s'.",e,s->msg==Z_NULL?"":s->msg);
+		return SET_INI_FALSE;
+	}
+	if(adler32_z(1,j->obuf,j->outsz)!=j->check){
+		elog("inflate: The block checksum mismatch.");
+		return SET_INI_FALSE;
+	}
+	return SET_INI_TRUE;
+}
+
+enum darc_decompress_blocked_result{
+	darc_decompress_blocked_ok,darc_decompress_blocked_version_error,
+	darc_decompress_blocked_pool_error,darc_decompress_blocked_worker_error,
+	darc_decompress_blocked_fread_error,darc_decompress_blocked_fwrite_error,
+	darc_decompress_blocked_data_error,darc_decompress_blocked_dictionary_error
+};
+
+/* Reads n bytes, first from the already consumed prefix, then from the file. */
+static size_t darc_read_prefixed(FILE*inf,const Bytef**pre,size_t*presz,Bytef*dst,size_t n){
+	size_t c=*presz<n?*presz:n;
+	memcpy(dst,*pre,c);
+	*pre+=c;
+	*presz-=c;
+	if(c<n)
+		c+=darc_stats_fread(dst+c,n-c,inf);
+	return c;
+}
+
+/* buf holds the *bufsz bytes already read from inf; it is left holding the
+ones read past the member. */
+static int darc_decompress_blocked(FILE*inf,FILE*outf,Bytef*buf,size_t*bufsz,size_t nthreads,
+const struct darc_dict*dict){
+	const Bytef *pre=buf;
+	size_t presz=*bufsz;
+	Bytef hdr[BLOCKED_MAGIC_SIZE+9];
+	if(darc_read_prefixed(inf,&pre,&presz,hdr,BLOCKED_MAGIC_SIZE+5)!=BLOCKED_MAGIC_SIZE+5){
+		elog("%s.",ferror(inf)?"Input error":"Unexpected end of the input data");
+		return ferror(inf)?darc_decompress_blocked_fread_error:darc_decompress_blocked_data_error;
+	}
+	if(hdr[BLOCKED_MAGIC_SIZE]==BLOCKED_VERSION_DICT){
+		if(darc_read_prefixed(inf,&pre,&presz,hdr+BLOCKED_MAGIC_SIZE+5,4)!=4){
+			elog("%s.",ferror(inf)?"Input error":"Unexpected end of the input data");
+			return ferror(inf)?darc_decompress_blocked_fread_error:darc_decompress_blocked_data_error;
+		}
+		uLong id=darc_get32le(hdr+BLOCKED_MAGIC_SIZE+5);
+		if(!dict || dict->id!=id){
+			elog("A preset dictionary(id %08lx) required.",id);
+			return darc_decompress_blocked_dictionary_error;
+		}
+	}else if(hdr[BLOCKED_MAGIC_SIZE]!=BLOCKED_VERSION){
+		elog("Unsupported version of the blocked format(%i).",hdr[BLOCKED_MAGIC_SIZE]);
+		return darc_decompress_blocked_version_error;
+	}else{
+		dict=NULL;
+	}
+	size_t bs=darc_get32le(hdr+BLOCKED_MAGIC_SIZE+1);
+	size_t cbs=darc_blocked_bound(bs);
+	if(!bs || !cbs){
+		elog("Invalid block size(%zu).",bs);
+		return darc_decompress_blocked_data_error;
+	}
+	struct darc_pool pool;
+	if(!darc_pool_start(&pool,nthreads,nthreads*2,cbs,bs,darc_pool_inflate_block,SET_INI_TRUE,0))
+		return darc_decompress_blocked_pool_error;
+	int r=darc_decompress_blocked_ok;
+	size_t written=0;
+	SET_INI_BOOLEAN eof=SET_INI_FALSE;
+	while(1){
+		if(!eof && pool.nfilled-written<pool.njobs){
+			struct darc_pool_job *j=darc_pool_next(&pool);
+			Bytef ent[12];
+			if(darc_read_prefixed(inf,&pre,&presz,ent,12)!=12){
+				elog("%s.",ferror(inf)?"Input error":"Unexpected end of the input data");
+				r=ferror(inf)?darc_decompress_blocked_fread_error:darc_decompress_blocked_data_error;
+				break;
+			}
+			j->insz=darc_get32le(ent);
+			j->outsz=darc_get32le(ent+4);
+			j->check=darc_get32le(ent+8);
+			if(!j->insz && !j->outsz){
+				eof=SET_INI_TRUE;
+				continue;
+			}
+			if(!j->insz || j->insz>cbs || !j->outsz || j->outsz>bs){
+				elog("The block table entry is corrupted(%zu/%zu).",j->insz,j->outsz);
+				r=darc_decompress_blocked_data_error;
+				break;
+			}
+			if(darc_read_prefixed(inf,&pre,&presz,j->ibuf,j->insz)!=j->insz){
+				elog("%s.",ferror(inf)?"Input error":"Unexpected end of the input data");
+				r=ferror(inf)?darc_decompress_blocked_fread_error:darc_decompress_blocked_data_error;
+				break;
+			}
+			j->in=j->ibuf;
+			if(dict){
+				j->dictsz=dict->size<WINDOW_SIZE?dict->size:WINDOW_SIZE;
+				j->dict=dict->data+dict->size-j->dictsz;
+			}else{
+				j->dictsz=0;
+			}
+			darc_pool_submit(&pool);
+			continue;
+		}
+		if(written==pool.nfilled)
+			break;
+		struct darc_pool_job *j=darc_pool_collect(&pool,written);
+		if(!j){
+			r=darc_decompress_blocked_worker_error;
+			break;
+		}
+		if(darc_stats_fwrite(j->obuf,j->outsz,outf)!=j->outsz){
+			elog("Output error.");
+			r=darc_decompress_blocked_fwrite_error;
+			break;
+		}
+		++written;
+	}
+	darc_pool_stop(&pool);
+	memmove(buf,pre,presz);
+	*bufsz=presz;
+	return r;
+}
+
+#define DEDUP_MIN_CHUNK 0x800
+#define DEDUP_MAX_CHUNK 0x10000
+#define DEDUP_CHUNK_MASK 0x1fff
+#define DEDUP_MAX_ENTRIES 0x1000000
+#define DEDUP_REF 0x80000000u
+#define DEDUP_MAX_RECORD 0x7fffffff
+
+/* --dedup: the input is cut into content-defined chunks(a gear rolling hash,
+8 KiB on average) and every chunk seen before is replaced by a reference to
+its first copy, so repeats farther apart than the deflate window cost a few
+bytes and skip deflate. The file is DEDUP_MAGIC and the version followed by a
+zlib stream of records: a little-endian uint32 n, then n literal bytes, or,
+with DEDUP_REF set, an uint64 offset in the output to copy n&~DEDUP_REF bytes
+from; n of 0 ends the records. */
+struct darc_dedup_entry{
+	uint64_t off;
+	uint32_t key,len;
+};
+
+struct darc_dedup{
+	z_stream s;
+	FILE *outf;
+	Bytef *obuf,*vbuf;
+	size_t obs;
+	struct darc_dedup_entry *tab;
+	size_t cap,n;
+	const Bytef *map;
+	int spool;
+	uint64_t pos,refoff,reflen;
+};
+
+static uint64_t darc_dedup_gear[256];
+
+static void darc_dedup_gear_init(void){
+	uint64_t x=0x9e3779b97f4a7c15;
+	for(int n=0;n<256;++n){
+		uint64_t z=x+=0x9e3779b97f4a7c15;
+		z=(z^z>>30)*0xbf58476d1ce4e5b9;
+		z=(z^z>>27)*0x94d049bb133111eb;
+		darc_dedup_gear[n]=z^z>>31;
+	}
+}
+
+/* The length of the chunk at p: the first cut point after DEDUP_MIN_CHUNK. */
+static size_t darc_dedup_cut(const Bytef*p,size_t n){
+	if(n>DEDUP_MAX_CHUNK)
+		n=DEDUP_MAX_CHUNK;
+	if(n<=DEDUP_MIN_CHUNK)
+		return n;
+	uint64_t h=0;
+	for(size_t i=DEDUP_MIN_CHUNK;i<n;++i){
+		h=(h<<1)+darc_dedup_gear[p[i]];
+		if(!(h>>48&DEDUP_CHUNK_MASK))
+			return i+1;
+	}
+	return n;
+}
+
+static SET_INI_BOOLEAN darc_dedup_deflate(struct darc_dedup*d,const void*p,size_t n,int flush){
+	d->s.next_in=(Bytef*)p;
+	d->s.avail_in=n;
+	while(1){
+		int e=darc_stats_deflate(&d->s,flush);
+		if(e==Z_STREAM_ERROR){
+			elog("deflate: The stream state was inconsistent. msg='%s'.",d->s.msg==Z_NULL?"":d->s.msg);
+			return SET_INI_FALSE;
+		}
+		if(!d->s.avail_out || e==Z_STREAM_END){
+			size_t sz=d->obs-d->s.avail_out;
+			if(darc_stats_fwrite(d->obuf,sz,d->outf)!=sz){
+				elog("Output error.");
+				return SET_INI_FALSE;
+			}
+			d->s.next_out=d->obuf;
+			d->s.avail_out=d->obs;
+		}
+		if(e==Z_STREAM_END || (flush!=Z_FINISH && !d->s.avail_in && d->s.avail_out))
+			return SET_INI_TRUE;
+	}
+}
+
+static SET_INI_BOOLEAN darc_dedup_flush_ref(struct darc_dedup*d){
+	if(!d->reflen)
+		return SET_INI_TRUE;
+	Bytef rec[12];
+	darc_put32le(rec,d->reflen|DEDUP_REF);
+	darc_put32le(rec+4,d->refoff);
+	darc_put32le(rec+8,d->refoff>>32);
+	d->reflen=0;
+	return darc_dedup_deflate(d,rec,12,Z_NO_FLUSH);
+}
+
+/* Whether the len bytes at p are the ones at off of the input. */
+static SET_INI_BOOLEAN darc_dedup_same(struct darc_dedup*d,uint64_t off,const Bytef*p,size_t len){
+	if(d->map)
+		return !memcmp(d->map+off,p,len);
+	return pread64(d->spool,d->vbuf,len,off)==(ssize_t)len && !memcmp(d->vbuf,p,len);
+}
+
+static SET_INI_BOOLEAN darc_dedup_grow(struct darc_dedup*d){
+	size_t cap=d->cap?d->cap*2:0x10000;
+	struct darc_dedup_entry *tab=calloc(cap,sizeof(*tab));
+	if(!tab){
+		critmalloc(cap*sizeof(*tab),"");
+		return SET_INI_FALSE;
+	}
+	for(size_t n=0;n<d->cap;++n){
+		if(!d->tab[n].len)
+			continue;
+		size_t i=d->tab[n].key&(cap-1);
+		while(tab[i].len)
+			i=(i+1)&(cap-1);
+		tab[i]=d->tab[n];
+	}
+	free(d->tab);
+	d->tab=tab;
+	d->cap=cap;
+	return SET_INI_TRUE;
+}
+
+static SET_INI_BOOLEAN darc_dedup_chunk(struct darc_dedup*d,const Bytef*p,size_t len){
+	uint32_t key=crc32_z(0,p,len);
+	size_t i=key&(d->cap-1);
+	for(;d->tab[i].len;i=(i+1)&(d->cap-1)){
+		struct darc_dedup_entry *e=d->tab+i;
+		if(e->key!=key || e->len!=len || !darc_dedup_same(d,e->off,p,len))
+			continue;
+		if(d->reflen && (d->refoff+d->reflen!=e->off || d->reflen+len>DEDUP_MAX_RECORD)
+			&& !darc_dedup_flush_ref(d))
+			return SET_INI_FALSE;
+		if(!d->reflen)
+			d->refoff=e->off;
+		d->reflen+=len;
+		d->pos+=len;
+		return SET_INI_TRUE;
+	}
+	if(!darc_dedup_flush_ref(d))
+		return SET_INI_FALSE;
+	if(!d->map && pwrite64(d->spool,p,len,d->pos)!=(ssize_t)len){
+		errnolog("Can't write the spool file");
+		return SET_INI_FALSE;
+	}
+	/* Once the table is full new chunks are only looked up. */
+	if(d->n<DEDUP_MAX_ENTRIES){
+		d->tab[i]=(struct darc_dedup_entry){.off=d->pos,.key=key,.len=len};
+		if(++d->n*2>d->cap && d->cap<DEDUP_MAX_ENTRIES*2 && !darc_dedup_grow(d))
+			return SET_INI_FALSE;
+	}
+	d->pos+=len;
+	Bytef rec[4];
+	darc_put32le(rec,len);
+	return darc_dedup_deflate(d,rec,4,Z_NO_FLUSH) && darc_dedup_deflate(d,p,len,Z_NO_FLUSH);
+}
+
+/* Streamed input is kept in an unlinked temporary file to compare candidate
+chunks with; a mapped one is compared in place. */
+static int darc_compress_dedup(FILE*inf,const Bytef*map,size_t mapsz,FILE*outf,int level,size_t ibs,size_t obs,
+const struct darc_dict*dict){
+	assert(ibs>0 && obs>0);
+	if(obs>UINT_MAX)
+		obs=UINT_MAX;
+	if(ibs<DEDUP_MAX_CHUNK*2)
+		ibs=DEDUP_MAX_CHUNK*2;
+	struct darc_dedup d={.s={.zalloc=Z_NULL,.zfree=Z_NULL,.opaque=Z_NULL},.outf=outf,.obs=obs,.map=map,.spool=-1};
+	Bytef *ibuf=NULL;
+	FILE *spool=NULL;
+	int r=darc_compress_ok;
+	if(darc_deflate_init(&d.s,level,SET_INI_FALSE)!=Z_OK){
+		elog("deflateInit2: Invalid compression level(%i).",level);
+		return darc_compress_deflateinit_level_error;
+	}
+	if(dict && deflateSetDictionary(&d.s,dict->data,dict->size)!=Z_OK){
+		elog("deflateSetDictionary: The stream state was inconsistent.");
+		deflateEnd(&d.s);
+		return darc_compress_deflate_stream_error;
+	}
+	if(!(d.obuf=malloc(obs)) || !darc_dedup_grow(&d)){
+		if(!d.obuf)
+			critmalloc(obs,"");
+		r=darc_compress_critical_malloc_error;
+		goto l_end;
+	}
+	if(!map){
+		if(!(ibuf=malloc(ibs)) || !(d.vbuf=malloc(DEDUP_MAX_CHUNK))){
+			critmalloc(ibuf?DEDUP_MAX_CHUNK:ibs,"");
+			r=darc_compress_critical_malloc_error;
+			goto l_end;
+		}
+		if(!(spool=tmpfile64())){
+			errnolog("Can't create the spool file");
+			r=darc_compress_fwrite_error;
+			goto l_end;
+		}
+		d.spool=fileno(spool);
+	}
+	if(!darc_dedup_gear[0])
+		darc_dedup_gear_init();
+	d.s.next_out=d.obuf;
+	d.s.avail_out=obs;
+	Bytef hdr[DEDUP_MAGIC_SIZE+1]=DEDUP_MAGIC;
+	hdr[DEDUP_MAGIC_SIZE]=DEDUP_VERSION;
+	if(darc_stats_fwrite(hdr,DEDUP_MAGIC_SIZE+1,outf)!=DEDUP_MAGIC_SIZE+1){
+		elog("Output error.");
+		r=darc_compress_fwrite_error;
+		goto l_end;
+	}
+	if(map){
+		struct darc_stats_mark m;
+		darc_stats_start(&m);
+		darc_stats_stop(darc_stats_read,&m,mapsz);
+		for(size_t pos=0,len;pos<mapsz;pos+=len){
+			len=darc_dedup_cut(map+pos,mapsz-pos);
+			if(!darc_dedup_chunk(&d,map+pos,len)){
+				r=darc_compress_deflate_stream_error;
+				goto l_end;
+			}
+		}
+	}else{
+		size_t have=0;
+		SET_INI_BOOLEAN eof=SET_INI_FALSE;
+		while(!eof || have){
+			if(!eof){
+				size_t got=darc_stats_fread(ibuf+have,ibs-have,inf);
+				if(ferror(inf)){
+					elog("Input error.");
+					r=darc_compress_fread_error;
+					goto l_end;
+				}
+				have+=got;
+				eof=feof(inf);
+			}
+			size_t off=0,len;
+			for(;have-off>=DEDUP_MAX_CHUNK || (eof && off<have);off+=len){
+				len=darc_dedup_cut(ibuf+off,have-off);
+				if(!darc_dedup_chunk(&d,ibuf+off,len)){
+					r=darc_compress_deflate_stream_error;
+					goto l_end;
+				}
+			}
+			memmove(ibuf,ibuf+off,have-off);
+			have-=off;
+		}
+	}
+	Bytef end[4]={0};
+	if(!darc_dedup_flush_ref(&d) || !darc_dedup_deflate(&d,end,4,Z_FINISH))
+		r=darc_compress_deflate_stream_error;
+l_end:
+	deflateEnd(&d.s);
+	if(spool)
+		fclose(spool);
+	free(d.vbuf);
+	free(ibuf);
+	free(d.tab);
+	free(d.obuf);
+	return r;
+}
+
+enum darc_decompress_dedup_result{
+	darc_decompress_dedup_ok,darc_decompress_dedup_version_error,
+	darc_decompress_dedup_critical_malloc_error,darc_decompress_dedup_inflate_error,
+	darc_decompress_dedup_fread_error,darc_decompress_dedup_fwrite_error,
+	darc_decompress_dedup_data_error
+};
+
+/* Where the references of a dedup stream are read back from: the output
+itself when it is a regular file open for reading, otherwise an unlinked
+temporary copy of it. */
+struct darc_undedup{
+	FILE *outf;
+	int fd;
+	FILE *spool;
+	__off64_t base;
+	uint64_t pos;
+	Bytef *cbuf;
+};
+
+static SET_INI_BOOLEAN darc_undedup_write(struct darc_undedup*u,const Bytef*p,size_t n){
+	if(darc_stats_fwrite(p,n,u->outf)!=n){
+		elog("Output error.");
+		return SET_INI_FALSE;
+	}
+	if(u->spool && pwrite64(u->fd,p,n,u->pos)!=(ssize_t)n){
+		errnolog("Can't write the spool file");
+		return SET_INI_FALSE;
+	}
+	u->pos+=n;
+	return SET_INI_TRUE;
+}
+
+/* The source may overlap the bytes being produced; it is copied in pieces
+that are already written. */
+static SET_INI_BOOLEAN darc_undedup_copy(struct darc_undedup*u,uint64_t off,uint64_t len){
+	if(off>=u->pos){
+		elog("The reference is out of the data(%llu/%llu).",(unsigned long long)off,(unsigned long long)u->pos);
+		return SET_INI_FALSE;
+	}
+	while(len){
+		size_t n=len<DEDUP_MAX_CHUNK?len:DEDUP_MAX_CHUNK;
+		if(n>u->pos-off)
+			n=u->pos-off;
+		if(!u->spool && fflush(u->outf)){
+			elog("Output error.");
+			return SET_INI_FALSE;
+		}
+		if(pread64(u->fd,u->cbuf,n,u->base+off)!=(ssize_t)n){
+			errnolog("Can't read back the output");
+			return SET_INI_FALSE;
+		}
+		if(!darc_undedup_write(u,u->cbuf,n))
+			return SET_INI_FALSE;
+		off+=n;
+		len-=n;
+	}
+	return SET_INI_TRUE;
+}
+
+/* As darc_decompress_blocked; buf holds at least ibs bytes. */
+static int darc_decompress_dedup(FILE*inf,FILE*outf,Bytef*buf,size_t*bufsz,size_t ibs,size_t obs,
+const struct darc_dict*dict){
+	const Bytef *pre=buf;
+	size_t presz=*bufsz;
+	Bytef hdr[DEDUP_MAGIC_SIZE+1];
+	if(darc_read_prefixed(inf,&pre,&presz,hdr,DEDUP_MAGIC_SIZE+1)!=DEDUP_MAGIC_SIZE+1){
+		elog("%s.",ferror(inf)?"Input error":"Unexpected end of the input data");
+		return ferror(inf)?darc_decompress_dedup_fread_error:darc_decompress_dedup_data_error;
+	}
+	if(hdr[DEDUP_MAGIC_SIZE]!=DEDUP_VERSION){
+		elog("Unsupported version of the dedup format(%i).",hdr[DEDUP_MAGIC_SIZE]);
+		return darc_decompress_dedup_version_error;
+	}
+	if(ibs>UINT_MAX)
+		ibs=UINT_MAX;
+	if(obs>UINT_MAX)
+		obs=UINT_MAX;
+	struct darc_undedup u={.outf=outf,.fd=fileno(outf)};
+	struct stat st;
+	int fl=fcntl(u.fd,F_GETFL);
+	if(fstat(u.fd,&st) || !S_ISREG(st.st_mode) || fl==-1 || (fl&O_ACCMODE)!=O_RDWR || (u.base=ftello64(outf))==-1){
+		if(!(u.spool=tmpfile64())){
+			errnolog("Can't create the spool file");
+			return darc_decompress_dedup_fwrite_error;
+		}
+		u.fd=fileno(u.spool);
+		u.base=0;
+	}
+	z_stream s={.zalloc=Z_NULL,.zfree=Z_NULL,.opaque=Z_NULL};
+	Bytef *ibuf=malloc(ibs),*obuf=malloc(obs);
+	int r=darc_decompress_dedup_ok;
+	if(!ibuf || !obuf || !(u.cbuf=malloc(DEDUP_MAX_CHUNK))){
+		critmalloc(!ibuf?ibs:!obuf?obs:DEDUP_MAX_CHUNK,"");
+		r=darc_decompress_dedup_critical_malloc_error;
+		goto l_end;
+	}
+	if(inflateInit(&s)!=Z_OK){
+		elog("inflateInit: error. msg='%s'.",s.msg==Z_NULL?"":s.msg);
+		r=darc_decompress_dedup_inflate_error;
+		goto l_end;
+	}
+	/* The record being parsed: rec holds its header, left the literal bytes to go. */
+	Bytef rec[12];
+	size_t recsz=0,recneed=4;
+	uint64_t left=0;
+	SET_INI_BOOLEAN done=SET_INI_FALSE;
+	int e=Z_OK;
+	s.next_in=(Bytef*)pre;
+	s.avail_in=presz;
+	while(e!=Z_STREAM_END){
+		if(!s.avail_in){
+			s.avail_in=darc_stats_fread(ibuf,ibs,inf);
+			if(ferror(inf)){
+				elog("Input error.");
+				r=darc_decompress_dedup_fread_error;
+				break;
+			}
+			if(!s.avail_in){
+				elog("Unexpected end of the input data.");
+				r=darc_decompress_dedup_data_error;
+				break;
+			}
+			s.next_in=ibuf;
+		}
+		s.next_out=obuf;
+		s.avail_out=obs;
+		e=darc_stats_inflate(&s,Z_NO_FLUSH);
+		if(e==Z_NEED_DICT && dict && s.adler==dict->id)
+			e=inflateSetDictionary(&s,dict->data,dict->size)==Z_OK?Z_OK:Z_STREAM_ERROR;
+		if(e!=Z_OK && e!=Z_STREAM_END && e!=Z_BUF_ERROR){
+			elog("inflate: %s. msg='%s'.",e==Z_NEED_DICT?"A preset dictionary required":
+				e==Z_MEM_ERROR?"Not enough memory":"The input data was corrupted",s.msg==Z_NULL?"":s.msg);
+			r=darc_decompress_dedup_inflate_error;
+			break;
+		}
+		const Bytef *p=obuf,*pe=s.next_out;
+		while(p<pe && r==darc_decompress_dedup_ok){
+			if(done){
+				elog("The data after the end of the records.");
+				r=darc_decompress_dedup_data_error;
+			}else if(left){
+				size_t n=pe-p<left?pe-p:left;
+				if(!darc_undedup_write(&u,p,n))
+					r=darc_decompress_dedup_fwrite_error;
+				p+=n;
+				left-=n;
+			}else{
+				size_t n=pe-p<recneed-recsz?pe-p:recneed-recsz;
+				memcpy(rec+recsz,p,n);
+				p+=n;
+				if((recsz+=n)<recneed)
+					continue;
+				uint32_t v=darc_get32le(rec);
+				if(v&DEDUP_REF && recneed==4){
+					recneed=12;
+					continue;
+				}
+				if(v&DEDUP_REF){
+					uint64_t off=darc_get32le(rec+4)|(uint64_t)darc_get32le(rec+8)<<32;
+					if(!darc_undedup_copy(&u,off,v&~DEDUP_REF))
+						r=darc_decompress_dedup_data_error;
+				}else if(v){
+					left=v;
+				}else{
+					done=SET_INI_TRUE;
+				}
+				recsz=0;
+				recneed=4;
+			}
+		}
+		if(r!=darc_decompress_dedup_ok)
+			break;
+	}
+	if(r==darc_decompress_dedup_ok && !done){
+		elog("Unexpected end of the records.");
+		r=darc_decompress_dedup_data_error;
+	}
+	memmove(buf,s.next_in,s.avail_in);
+	*bufsz=s.avail_in;
+	inflateEnd(&s);
+l_end:
+	free(u.cbuf);
+	free(obuf);
+	free(ibuf);
+	if(u.spool)
+		fclose(u.spool);
+	return r;
+}
+
+#define ASYNC_RING_SIZE 4
+
+/* --io-uring: the ring does its I/O through an io_uring instead of a thread,
+with a request in flight per buffer; the buffers are registered with the
+kernel. Requests carry file offsets, so only regular files go this way. */
+struct darc_uring{
+	int fd,file;
+	unsigned *sqtail,*sqmask,*sqarray,*cqhead,*cqtail,*cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq,*cq;
+	size_t sqsz,cqsz,sqesz;
+	/* The file offset of the next request and, per buffer, that of its
+	request, the size asked for and whether it is in flight. */
+	uint64_t pos,offs[ASYNC_RING_SIZE];
+	size_t want[ASYNC_RING_SIZE];
+	SET_INI_BOOLEAN busy[ASYNC_RING_SIZE];
+};
+
+static void darc_uring_free(struct darc_uring*u){
+	if(u->sqes)
+		munmap(u->sqes,u->sqesz);
+	if(u->cq && u->cq!=u->sq)
+		munmap(u->cq,u->cqsz);
+	if(u->sq)
+		munmap(u->sq,u->sqsz);
+	close(u->fd);
+	free(u);
+}
+
+/* NULL if the kernel has no io_uring or does not let the buffers be registered. */
+static struct darc_uring *darc_uring_new(int file,Bytef*mem,size_t bs){
+#ifdef HAVE_LINUX_IO_URING_H
+	struct darc_uring *u=calloc(1,sizeof(*u));
+	if(!u){
+		critmalloc(sizeof(*u),"");
+		return NULL;
+	}
+	struct io_uring_params p;
+	memset(&p,0,sizeof(p));
+	if((u->fd=syscall(__NR_io_uring_setup,ASYNC_RING_SIZE,&p))==-1){
+		free(u);
+		return NULL;
+	}
+	u->file=file;
+	u->sqsz=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+	u->cqsz=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+	if(p.features&IORING_FEAT_SINGLE_MMAP)
+		u->sqsz=u->cqsz=u->sqsz>u->cqsz?u->sqsz:u->cqsz;
+	u->sqesz=p.sq_entries*sizeof(struct io_uring_sqe);
+	void *m=mmap(NULL,u->sqsz,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,u->fd,IORING_OFF_SQ_RING);
+	if(m==MAP_FAILED)
+		goto l_fail;
+	u->sq=m;
+	if(p.features&IORING_FEAT_SINGLE_MMAP){
+		u->cq=m;
+	}else{
+		if((m=mmap(NULL,u->cqsz,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,u->fd,IORING_OFF_CQ_RING))==MAP_FAILED)
+			goto l_fail;
+		u->cq=m;
+	}
+	if((m=mmap(NULL,u->sqesz,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,u->fd,IORING_OFF_SQES))==MAP_FAILED)
+		goto l_fail;
+	u->sqes=m;
+	u->sqtail=(unsigned*)((char*)u->sq+p.sq_off.tail);
+	u->sqmask=(unsigned*)((char*)u->sq+p.sq_off.ring_mask);
+	u->sqarray=(unsigned*)((char*)u->sq+p.sq_off.array);
+	u->cqhead=(unsigned*)((char*)u->cq+p.cq_off.head);
+	u->cqtail=(unsigned*)((char*)u->cq+p.cq_off.tail);
+	u->cqmask=(unsigned*)((char*)u->cq+p.cq_off.ring_mask);
+	u->cqes=(struct io_uring_cqe*)((char*)u->cq+p.cq_off.cqes);
+	struct iovec iov[ASYNC_RING_SIZE];
+	for(size_t n=0;n<ASYNC_RING_SIZE;++n)
+		iov[n]=(struct iovec){mem+n*bs,bs};
+	if(syscall(__NR_io_uring_register,u->fd,IORING_REGISTER_BUFFERS,iov,ASYNC_RING_SIZE))
+		goto l_fail;
+	return u;
+l_fail:
+	darc_uring_free(u);
+#endif
+	return NULL;
+}
+
+/* Reads or writes len bytes at buf, a part of registered buffer slot. */
+static SET_INI_BOOLEAN darc_uring_submit(struct darc_uring*u,SET_INI_BOOLEAN reading,size_t slot,Bytef*buf,
+size_t len,uint64_t off){
+#ifdef HAVE_LINUX_IO_URING_H
+	unsigned tail=*u->sqtail,idx=tail&*u->sqmask;
+	struct io_uring_sqe *e=&u->sqes[idx];
+	memset(e,0,sizeof(*e));
+	e->opcode=reading?IORING_OP_READ_FIXED:IORING_OP_WRITE_FIXED;
+	e->fd=u->file;
+	e->addr=(uintptr_t)buf;
+	e->len=len;
+	e->off=off;
+	e->buf_index=slot;
+	e->user_data=slot;
+	u->sqarray[idx]=idx;
+	__atomic_store_n(u->sqtail,tail+1,__ATOMIC_RELEASE);
+	u->busy[slot]=SET_INI_TRUE;
+	while(syscall(__NR_io_uring_enter,u->fd,1,0,0,NULL,0)==-1){
+		if(errno!=EINTR){
+			errnolog("io_uring_enter");
+			return SET_INI_FALSE;
+		}
+	}
+	return SET_INI_TRUE;
+#else
+	return SET_INI_FALSE;
+#endif
+}
+
+/* Waits for the next completion. */
+static SET_INI_BOOLEAN darc_uring_wait(struct darc_uring*u,size_t*slot,int*res){
+#ifdef HAVE_LINUX_IO_URING_H
+	unsigned head=*u->cqhead;
+	while(head==__atomic_load_n(u->cqtail,__ATOMIC_ACQUIRE)){
+		if(syscall(__NR_io_uring_enter,u->fd,0,1,IORING_ENTER_GETEVENTS,NULL,0)==-1 && errno!=EINTR){
+			errnolog("io_uring_enter");
+			return SET_INI_FALSE;
+		}
+	}
+	struct io_uring_cqe *c=&u->cqes[head&*u->cqmask];
+	*slot=c->user_data;
+	*res=c->res;
+	__atomic_store_n(u->cqhead,head+1,__ATOMIC_RELEASE);
+	return SET_INI_TRUE;
+#else
+	return SET_INI_FALSE;
+#endif
+}
+
+/* A ring of equally sized buffers between the codec and an I/O thread: the
+reader thread fills buffers from a file, the writer thread drains them to it.
+With uring set there is no thread; head counts the requests issued and lens
+the bytes done of each. */
+struct darc_ring{
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	Bytef *mem;
+	size_t lens[ASYNC_RING_SIZE];
+	size_t bs,head,tail;
+	FILE *f;
+	pthread_t thread;
+	struct darc_uring *uring;
+	SET_INI_BOOLEAN eof,failed,cancel,reading;
+};
+
+static SET_INI_BOOLEAN darc_ring_issue(struct darc_ring*r,size_t slot,size_t len){
+	struct darc_uring *u=r->uring;
+	u->offs[slot]=u->pos;
+	u->want[slot]=len;
+	u->pos+=len;
+	r->lens[slot]=0;
+	if(darc_uring_submit(u,r->reading,slot,r->mem+slot*r->bs,len,u->offs[slot]))
+		return SET_INI_TRUE;
+	r->failed=SET_INI_TRUE;
+	return SET_INI_FALSE;
+}
+
+/* Handles a completion; short reads and writes are asked for the rest again.
+FALSE only if the io_uring itself failed. */
+static SET_INI_BOOLEAN darc_ring_complete(struct darc_ring*r){
+	struct darc_uring *u=r->uring;
+	size_t slot;
+	int res;
+	if(!darc_uring_wait(u,&slot,&res)){
+		r->failed=SET_INI_TRUE;
+		return SET_INI_FALSE;
+	}
+	if(res<0 || (!res && !r->reading)){
+		elog("%s error: %s.",r->reading?"Input":"Output",res<0?strerror(-res):"nothing was written");
+		u->busy[slot]=SET_INI_FALSE;
+		r->failed=SET_INI_TRUE;
+		return SET_INI_TRUE;
+	}
+	r->lens[slot]+=res;
+	if(!res)
+		r->eof=SET_INI_TRUE;
+	if(!res || r->lens[slot]==u->want[slot]){
+		u->busy[slot]=SET_INI_FALSE;
+	}else if(!darc_uring_submit(u,r->reading,slot,r->mem+slot*r->bs+r->lens[slot],
+		u->want[slot]-r->lens[slot],u->offs[slot]+r->lens[slot])){
+		r->failed=SET_INI_TRUE;
+		return SET_INI_FALSE;
+	}
+	return SET_INI_TRUE;
+}
+
+/* Waits for all the requests in flight. */
+static void darc_ring_settle(struct darc_ring*r){
+	for(size_t n=0;n<ASYNC_RING_SIZE;++n)
+		while(r->uring->busy[n])
+			if(!darc_ring_complete(r))
+				return;
+}
+
+/* Whether f suits the io_uring: a regular file, written at known offsets. */
+static SET_INI_BOOLEAN darc_ring_uring(struct darc_ring*r,FILE*f,SET_INI_BOOLEAN reading){
+	static SET_INI_BOOLEAN warned=SET_INI_FALSE;
+	struct stat st;
+	int fd=fileno(f),fl=fcntl(fd,F_GETFL);
+	__off64_t pos;
+	if(fstat(fd,&st) || !S_ISREG(st.st_mode) || fl==-1 || (!reading && (fl&O_APPEND)) ||
+	(!reading && fflush(f)) || (pos=ftello64(f))==-1)
+		return SET_INI_FALSE;
+	if(!(r->uring=darc_uring_new(fd,r->mem,r->bs))){
+		if(!warned)
+			wlog("The io_uring is not available, the I/O is done by threads.");
+		warned=SET_INI_TRUE;
+		return SET_INI_FALSE;
+	}
+	r->uring->pos=pos;
+	if(reading){
+		for(;r->head<ASYNC_RING_SIZE;++r->head)
+			if(!darc_ring_issue(r,r->head,r->bs))
+				break;
+	}
+	return SET_INI_TRUE;
+}
+
+static void *darc_ring_reader(void*p){
+	struct darc_ring *r=p;
+	pthread_mutex_lock(&r->mtx);
+	while(1){
+		while(!r->cancel && r->head-r->tail==ASYNC_RING_SIZE)
+			pthread_cond_wait(&r->cond,&r->mtx);
+		if(r->cancel)
+			break;
+		size_t slot=r->head%ASYNC_RING_SIZE;
+		pthread_mutex_unlock(&r->mtx);
+		size_t len=fread(r->mem+slot*r->bs,1,r->bs,r->f);
+		int err=ferror(r->f);
+		pthread_mutex_lock(&r->mtx);
+		if(err){
+			elog("Input error.");
+			r->failed=SET_INI_TRUE;
+			break;
+		}
+		if(!len)
+			break;
+		r->lens[slot]=len;
+		++r->head;
+		pthread_cond_broadcast(&r->cond);
+	}
+	r->eof=SET_INI_TRUE;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mtx);
+	return NULL;
+}
+
+static void *darc_ring_writer(void*p){
+	struct darc_ring *r=p;
+	pthread_mutex_lock(&r->mtx);
+	while(1){
+		while(!r->cancel && !r->eof && r->head==r->tail)
+			pthread_cond_wait(&r->cond,&r->mtx);
+		if(r->cancel || r->head==r->tail)
+			break;
+		size_t slot=r->tail%ASYNC_RING_SIZE;
+		pthread_mutex_unlock(&r->mtx);
+		SET_INI_BOOLEAN ok=fwrite(r->mem+slot*r->bs,1,r->lens[slot],r->f)==r->lens[slot];
+		pthread_mutex_lock(&r->mtx);
+		if(!ok){
+			elog("Output error.");
+			r->failed=SET_INI_TRUE;
+			break;
+		}
+		++r->tail;
+		pthread_cond_broadcast(&r->cond);
+	}
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mtx);
+	return NULL;
+}
+
+static SET_INI_BOOLEAN darc_ring_start(struct darc_ring*r,FILE*f,size_t bs,SET_INI_BOOLEAN reading){
+	size_t total;
+	memset(r,0,sizeof(*r));
+	if(__builtin_mul_overflow(bs,ASYNC_RING_SIZE,&total) || !(r->mem=malloc(total))){
+		critmalloc(bs*ASYNC_RING_SIZE,"");
+		return SET_INI_FALSE;
+	}
+	r->bs=bs;
+	r->f=f;
+	r->reading=reading;
+	if(opt_io_uring && darc_ring_uring(r,f,reading))
+		return SET_INI_TRUE;
+	pthread_mutex_init(&r->mtx,NULL);
+	pthread_cond_init(&r->cond,NULL);
+	int e=pthread_create(&r->thread,NULL,reading?darc_ring_reader:darc_ring_writer,r);
+	if(e){
+		elog("pthread_create: %s.",strerror(e));
+		pthread_cond_destroy(&r->cond);
+		pthread_mutex_destroy(&r->mtx);
+		free(r->mem);
+		return SET_INI_FALSE;
+	}
+	return SET_INI_TRUE;
+}
+
+/* Lets the writer drain the committed buffers(or drops them if cancel) and
+joins the I/O thread. */
+static SET_INI_BOOLEAN darc_ring_stop(struct darc_ring*r,SET_INI_BOOLEAN cancel){
+	if(r->uring){
+		/* What was written so far is followed by stdio. */
+		darc_ring_settle(r);
+		if(!r->reading && !r->failed && fseeko64(r->f,r->uring->pos,SEEK_SET)){
+			errnolog("Output error");
+			r->failed=SET_INI_TRUE;
+		}
+		darc_uring_free(r->uring);
+		free(r->mem);
+		return !r->failed;
+	}
+	pthread_mutex_lock(&r->mtx);
+	r->eof=SET_INI_TRUE;
+	r->cancel=cancel;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mtx);
+	pthread_join(r->thread,NULL);
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->mtx);
+	free(r->mem);
+	return !r->failed;
+}
+
+/* The next filled buffer or NULL at the end of the input or on error. */
+static Bytef *darc_ring_get(struct darc_ring*r,size_t*len){
+	Bytef *b=NULL;
+	if(r->uring){
+		size_t slot=r->tail%ASYNC_RING_SIZE;
+		while(!r->failed && r->uring->busy[slot])
+			darc_ring_complete(r);
+		if(r->failed || !r->lens[slot])
+			return NULL;
+		*len=r->lens[slot];
+		return r->mem+slot*r->bs;
+	}
+	pthread_mutex_lock(&r->mtx);
+	while(!r->eof && r->head==r->tail)
+		pthread_cond_wait(&r->cond,&r->mtx);
+	if(!r->failed && r->head!=r->tail){
+		b=r->mem+r->tail%ASYNC_RING_SIZE*r->bs;
+		*len=r->lens[r->tail%ASYNC_RING_SIZE];
+	}
+	pthread_mutex_unlock(&r->mtx);
+	return b;
+}
+
+/* Stops a reader and frees r; the result, to be freed, holds the leadsz bytes
+at lead(the unused part of the buffer being held) followed by the buffers read
+ahead. NULL on error. */
+static Bytef *darc_ring_drain(struct darc_ring*r,const Bytef*lead,size_t leadsz,size_t*presz){
+	if(r->uring){
+		darc_ring_settle(r);
+	}else{
+		pthread_mutex_lock(&r->mtx);
+		r->cancel=SET_INI_TRUE;
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->mtx);
+		pthread_join(r->thread,NULL);
+	}
+	Bytef *pre=r->failed?NULL:malloc(r->bs*ASYNC_RING_SIZE);
+	if(pre){
+		memcpy(pre,lead,leadsz);
+		*presz=leadsz;
+		uint64_t end=r->uring?r->uring->offs[r->tail%ASYNC_RING_SIZE]+r->lens[r->tail%ASYNC_RING_SIZE]:0;
+		for(++r->tail;r->tail!=r->head && r->lens[r->tail%ASYNC_RING_SIZE];++r->tail){
+			size_t slot=r->tail%ASYNC_RING_SIZE;
+			memcpy(pre+*presz,r->mem+slot*r->bs,r->lens[slot]);
+			*presz+=r->lens[slot];
+			if(r->uring)
+				end=r->uring->offs[slot]+r->lens[slot];
+		}
+		/* stdio goes on reading after what was handed over. */
+		if(r->uring && fseeko64(r->f,end,SEEK_SET)){
+			errnolog("Input error");
+			free(pre);
+			pre=NULL;
+		}
+	}else if(!r->failed){
+		critmalloc(r->bs*ASYNC_RING_SIZE,"");
+	}
+	if(r->uring){
+		darc_uring_free(r->uring);
+	}else{
+		pthread_cond_destroy(&r->cond);
+		pthread_mutex_destroy(&r->mtx);
+	}
+	free(r->mem);
+	return pre;
+}
+
+static void darc_ring_release(struct darc_ring*r){
+	if(r->uring){
+		size_t slot=r->tail++%ASYNC_RING_SIZE;
+		if(r->eof || r->failed)
+			r->lens[slot]=0;
+		else if(darc_ring_issue(r,slot,r->bs))
+			++r->head;
+		return;
+	}
+	pthread_mutex_lock(&r->mtx);
+	++r->tail;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mtx);
+}
+
+/* An empty buffer to be filled by the codec or NULL if the writer has failed. */
+static Bytef *darc_ring_acquire(struct darc_ring*r){
+	Bytef *b=NULL;
+	if(r->uring){
+		size_t slot=r->head%ASYNC_RING_SIZE;
+		while(!r->failed && r->uring->busy[slot])
+			darc_ring_complete(r);
+		return r->failed?NULL:r->mem+slot*r->bs;
+	}
+	pthread_mutex_lock(&r->mtx);
+	while(!r->failed && r->head-r->tail==ASYNC_RING_SIZE)
+		pthread_cond_wait(&r->cond,&r->mtx);
+	if(!r->failed)
+		b=r->mem+r->head%ASYNC_RING_SIZE*r->bs;
+	pthread_mutex_unlock(&r->mtx);
+	return b;
+}
+
+static void darc_ring_commit(struct darc_ring*r,size_t len){
+	if(!len)
+		return;
+	if(r->uring){
+		darc_ring_issue(r,r->head++%ASYNC_RING_SIZE,len);
+		return;
+	}
+	pthread_mutex_lock(&r->mtx);
+	r->lens[r->head%ASYNC_RING_SIZE]=len;
+	++r->head;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mtx);
+}
+
+/* The write function of the contexts of the async loops: the output is
+copied into the next buffer of the writer. */
+static int darc_ring_write(void*user,const void*buf,size_t size){
+	struct darc_ring *r=user;
+	Bytef *b=darc_ring_acquire(r);
+	if(!b)
+		return 1;
+	memcpy(b,buf,size);
+	darc_ring_commit(r,size);
+	return 0;
+}
+
+/* darc_compress with the reading and writing moved to their own threads. */
+static int darc_compress_async(FILE*inf,const Bytef*map,size_t mapsz,FILE*outf,int level,size_t ibs,size_t obs,
+struct darc_tune*tune,const struct darc_dict*dict){
+	assert(ibs>0 && obs>0);
+	if(ibs>UINT_MAX)
+		ibs=UINT_MAX;
+	if(obs>UINT_MAX)
+		obs=UINT_MAX;
+	darc_ctx *ctx=darc_deflate_ctx(level,SET_INI_FALSE,obs,dict);
+	if(!ctx)
+		return darc_compress_deflateinit_level_error;
+	struct darc_ring in,out;
+	if(!map && !darc_ring_start(&in,inf,ibs,SET_INI_TRUE)){
+		darc_ctx_free(ctx);
+		return darc_compress_thread_error;
+	}
+	if(!darc_ring_start(&out,outf,obs,SET_INI_FALSE)){
+		if(!map)
+			darc_ring_stop(&in,SET_INI_TRUE);
+		darc_ctx_free(ctx);
+		return darc_compress_thread_error;
+	}
+	int r=darc_compress_ok,e=DARC_OK;
+	size_t mappos=0;
+	while(e==DARC_OK){
+		const Bytef *p;
+		size_t len;
+		if(map){
+			p=map+mappos;
+			len=mapsz-mappos<ibs?mapsz-mappos:ibs;
+			mappos+=len;
+			darc_map_advise(map,mapsz,mappos,ibs);
+			if(!len)
+				break;
+		}else if(!(p=darc_ring_get(&in,&len))){
+			if(in.failed)
+				r=darc_compress_fread_error;
+			break;
+		}
+		if(tune){
+			int lvl,strategy;
+			darc_tune_block(tune,p,len,level,&lvl,&strategy);
+			e=darc_ctx_set_level(ctx,lvl,strategy,darc_ring_write,&out);
+		}
+		if(e==DARC_OK)
+			e=darc_ctx_push(ctx,p,len,0,darc_ring_write,&out);
+		if(!map)
+			darc_ring_release(&in);
+	}
+	if(r==darc_compress_ok && e==DARC_OK)
+		e=darc_ctx_push(ctx,NULL,0,1,darc_ring_write,&out);
+	/* The writer has told why it failed. */
+	if(e==DARC_WRITE_ERROR)
+		r=darc_compress_fwrite_error;
+	else if(e!=DARC_OK)
+		r=darc_compress_status(ctx,e);
+	if(!map)
+		darc_ring_stop(&in,SET_INI_TRUE);
+	if(!darc_ring_stop(&out,r!=darc_compress_ok) && r==darc_compress_ok)
+		r=darc_compress_fwrite_error;
+	darc_ctx_free(ctx);
+	return r;
+}
+
+/* darc_decompress with the reading and writing moved to their own threads.
+The zlib members are inflated here; from a member of the blocked or dedup
+format, which have their own pipelines, or one whose start is too short to
+tell, the rest is left to darc_decompress. */
+static int darc_decompress_async(FILE*inf,FILE*outf,size_t ibs,size_t obs,size_t nthreads,
+const struct darc_dict*dict){
+	assert(ibs>0 && obs>0);
+	if(ibs>UINT_MAX)
+		ibs=UINT_MAX;
+	if(obs>UINT_MAX)
+		obs=UINT_MAX;
+	struct darc_ring in,out;
+	if(!darc_ring_start(&in,inf,ibs,SET_INI_TRUE))
+		return darc_decompress_thread_error;
+	size_t len;
+	const Bytef *b=darc_ring_get(&in,&len);
+	if(!b){
+		SET_INI_BOOLEAN failed=in.failed;
+		darc_ring_stop(&in,SET_INI_TRUE);
+		return failed?darc_decompress_fread_error:darc_decompress_no_data_error;
+	}
+	darc_ctx *ctx=darc_inflate_ctx(obs,dict);
+	if(!ctx){
+		darc_ring_stop(&in,SET_INI_TRUE);
+		return darc_decompress_critical_malloc_error;
+	}
+	if(!darc_ring_start(&out,outf,obs,SET_INI_FALSE)){
+		darc_ctx_free(ctx);
+		darc_ring_stop(&in,SET_INI_TRUE);
+		return darc_decompress_thread_error;
+	}
+	int r=darc_decompress_ok,e=DARC_OK;
+	while(len>=ARCHIVE_MAGIC_SIZE && memcmp(b,BLOCKED_MAGIC,BLOCKED_MAGIC_SIZE) && memcmp(b,DEDUP_MAGIC,DEDUP_MAGIC_SIZE)){
+		if((e=darc_ctx_reset(ctx))!=DARC_OK)
+			goto l_end;
+		while(1){
+			size_t n=len;
+			if((e=darc_ctx_push_member(ctx,b,&n,darc_ring_write,&out))!=DARC_OK)
+				goto l_end;
+			b+=len-n;
+			if((len=n))
+				break;
+			darc_ring_release(&in);
+			if(!(b=darc_ring_get(&in,&len))){
+				if(in.failed){
+					r=darc_decompress_fread_error;
+				}else if(!darc_ctx_at_end(ctx)){
+					elog("Unexpected end of the input data.");
+					r=darc_decompress_inflate_data_error;
+				}
+				goto l_end;
+			}
+			if(darc_ctx_at_end(ctx))
+				break;
+		}
+	}
+	/* The output so far goes out before darc_decompress writes with stdio. */
+	if(!darc_ring_stop(&out,SET_INI_FALSE)){
+		darc_ring_stop(&in,SET_INI_TRUE);
+		darc_ctx_free(ctx);
+		return darc_decompress_fwrite_error;
+	}
+	darc_ctx_free(ctx);
+	size_t presz;
+	Bytef *pre=darc_ring_drain(&in,b,len,&presz);
+	if(!pre)
+		return darc_decompress_critical_malloc_error;
+	r=darc_decompress(inf,outf,pre,presz,ibs,obs,nthreads,dict);
+	free(pre);
+	return r;
+l_end:
+	/* The writer has told why it failed. */
+	if(e==DARC_WRITE_ERROR)
+		r=darc_decompress_fwrite_error;
+	else if(e!=DARC_OK)
+		r=darc_decompress_status(ctx,e);
+	darc_ring_stop(&in,SET_INI_TRUE);
+	if(!darc_ring_stop(&out,r!=darc_decompress_ok) && r==darc_decompress_ok)
+		r=darc_decompress_fwrite_error;
+	darc_ctx_free(ctx);
+	return r;
+}
+
+#define INDEX_MAGIC "DARCIDX\1"
+#define INDEX_MAGIC_SIZE 8
+
+enum darc_build_index_result{
+	darc_build_index_ok,darc_build_index_critical_malloc_error,
+	darc_build_index_inflateinit_error,darc_build_index_fread_error,
+	darc_build_index_fwrite_error,darc_build_index_data_error,
+	darc_build_index_no_data_error
+};
+
+/* zran-style: one pass over a zlib stream, emitting a checkpoint(the input
+offset and bit position of a deflate block boundary plus the preceding 32 KiB
+of output, deflated) each time span more bytes of output have been produced.
+Index layout: INDEX_MAGIC, uint64 span, then checkpoints of uint64 output
+offset, uint64 input offset, uint8 bits, uint32 window size and the window. */
+static int darc_build_index(FILE*inf,FILE*outf,size_t ibs,uint64_t span,const struct darc_dict*dict){
+	assert(ibs>0 && span>0);
+	size_t cwsz=compressBound(WINDOW_SIZE);
+	Bytef *ibuf=malloc(ibs),*win=malloc(WINDOW_SIZE*2+cwsz);
+	if(!ibuf || !win){
+		critmalloc(ibuf?WINDOW_SIZE*2+cwsz:ibs,"");
+		free(win);
+		free(ibuf);
+		return darc_build_index_critical_malloc_error;
+	}
+	Bytef *line=win+WINDOW_SIZE,*cwin=line+WINDOW_SIZE;
+	z_stream cmp={.zalloc=Z_NULL,.zfree=Z_NULL,.opaque=Z_NULL};
+	if(inflateInit(&cmp)!=Z_OK){
+		elog("inflateInit: error. msg='%s'.",cmp.msg==Z_NULL?"":cmp.msg);
+		free(win);
+		free(ibuf);
+		return darc_build_index_inflateinit_error;
+	}
+	Bytef hdr[INDEX_MAGIC_SIZE+8];
+	memcpy(hdr,INDEX_MAGIC,INDEX_MAGIC_SIZE);
+	darc_put64le(hdr+INDEX_MAGIC_SIZE,span);
+	int r=darc_build_index_ok;
+	if(fwrite(hdr,1,sizeof(hdr),outf)!=sizeof(hdr)){
+		elog("Output error.");
+		r=darc_build_index_fwrite_error;
+		goto l_end;
+	}
+	uint64_t totin=0,totout=0,last=0;
+	SET_INI_BOOLEAN first=SET_INI_TRUE;
+	cmp.avail_out=0;
+	/* The dictionary is the history before the first checkpoints. */
+	memset(win,0,WINDOW_SIZE);
+	if(dict){
+		size_t dsz=dict->size<WINDOW_SIZE?dict->size:WINDOW_SIZE;
+		memcpy(win+WINDOW_SIZE-dsz,dict->data+dict->size-dsz,dsz);
+	}
+	int e;
+	do{
+		cmp.avail_in=fread(ibuf,1,ibs>UINT_MAX?UINT_MAX:ibs,inf);
+		if(ferror(inf)){
+			elog("Input error.");
+			r=darc_build_index_fread_error;
+			goto l_end;
+		}
+		if(!cmp.avail_in){
+			elog("Unexpected end of the input data.");
+			r=totin?darc_build_index_data_error:darc_build_index_no_data_error;
+			goto l_end;
+		}
+		cmp.next_in=ibuf;
+		do{
+			if(!cmp.avail_out){
+				cmp.avail_out=WINDOW_SIZE;
+				cmp.next_out=win;
+			}
+			totin+=cmp.avail_in;
+			totout+=cmp.avail_out;
+			e=inflate(&cmp,Z_BLOCK);
+			totin-=cmp.avail_in;
+			totout-=cmp.avail_out;
+			if(e==Z_NEED_DICT && dict && cmp.adler==dict->id)
+				e=inflateSetDictionary(&cmp,dict->data,dict->size)==Z_OK?Z_OK:Z_STREAM_ERROR;
+			if(e==Z_NEED_DICT || e==Z_DATA_ERROR || e==Z_MEM_ERROR || e==Z_STREAM_ERROR){
+				elog("inflate: The input data was corrupted(%i). msg='%s'.",e,cmp.msg==Z_NULL?"":cmp.msg);
+				r=darc_build_index_data_error;
+				goto l_end;
+			}
+			if(e==Z_STREAM_END)
+				break;
+			if((cmp.data_type&128) && !(cmp.data_type&64) && (first || totout-last>=span)){
+				/* The window is circular, unroll it. */
+				memcpy(line,win+WINDOW_SIZE-cmp.avail_out,cmp.avail_out);
+				memcpy(line+cmp.avail_out,win,WINDOW_SIZE-cmp.avail_out);
+				uLongf csz=cwsz;
+				if(compress2(cwin,&csz,line,WINDOW_SIZE,Z_BEST_COMPRESSION)!=Z_OK){
+					elog("compress2: error.");
+					r=darc_build_index_data_error;
+					goto l_end;
+				}
+				Bytef ent[21];
+				darc_put64le(ent,totout);
+				darc_put64le(ent+8,totin);
+				ent[16]=cmp.data_type&7;
+				darc_put32le(ent+17,csz);
+				if(fwrite(ent,1,21,outf)!=21 || fwrite(cwin,1,csz,outf)!=csz){
+					elog("Output error.");
+					r=darc_build_index_fwrite_error;
+					goto l_end;
+				}
+				last=totout;
+				first=SET_INI_FALSE;
+			}
+		}while(cmp.avail_in);
+	}while(e!=Z_STREAM_END);
+l_end:
+	inflateEnd(&cmp);
+	free(win);
+	free(ibuf);
+	return r;
+}
+
+enum darc_extract_range_result{
+	darc_extract_range_ok,darc_extract_range_critical_malloc_error,
+	darc_extract_range_index_error,darc_extract_range_inflateinit_error,
+	darc_extract_range_seek_error,darc_extract_range_fread_error,
+	darc_extract_range_fwrite_error,darc_extract_range_data_error
+};
+
+/* Picks the last checkpoint at or before offset from the index file. */
+static int darc_read_index(FILE*idxf,uint64_t offset,uint64_t*out,uint64_t*in,int*bits,Bytef*window){
+	Bytef hdr[INDEX_MAGIC_SIZE+8],ent[21];
+	if(fread(hdr,1,sizeof(hdr),idxf)!=sizeof(hdr) || memcmp(hdr,INDEX_MAGIC,INDEX_MAGIC_SIZE)){
+		elog("Not a darc index.");
+		return darc_extract_range_index_error;
+	}
+	size_t cwsz=compressBound(WINDOW_SIZE);
+	Bytef *cwin=malloc(cwsz);
+	if(!cwin){
+		critmalloc(cwsz,"");
+		return darc_extract_range_critical_malloc_error;
+	}
+	SET_INI_BOOLEAN found=SET_INI_FALSE;
+	while(fread(ent,1,21,idxf)==21){
+		uint64_t o=darc_get64le(ent);
+		size_t csz=darc_get32le(ent+17);
+		if(o>offset)
+			break;
+		if(csz>cwsz || ent[16]>7 || fread(cwin,1,csz,idxf)!=csz){
+			elog("The index is corrupted.");
+			free(cwin);
+			return darc_extract_range_index_error;
+		}
+		uLongf wsz=WINDOW_SIZE;
+		if(uncompress(window,&wsz,cwin,csz)!=Z_OK || wsz!=WINDOW_SIZE){
+			elog("The index is corrupted.");
+			free(cwin);
+			return darc_extract_range_index_error;
+		}
+		*out=o;
+		*in=darc_get64le(ent+8);
+		*bits=ent[16];
+		found=SET_INI_TRUE;
+	}
+	free(cwin);
+	if(ferror(idxf)){
+		elog("Index input error.");
+		return darc_extract_range_index_error;
+	}
+	if(!found){
+		elog("The index has no checkpoints.");
+		return darc_extract_range_index_error;
+	}
+	return darc_extract_range_ok;
+}
+
+/* Writes length bytes of the expanded data starting at offset. With an index
+the input is seeked to the nearest preceding checkpoint, without it the data
+is inflated from the start. */
+static int darc_extract_range(FILE*inf,FILE*idxf,FILE*outf,uint64_t offset,
+uint64_t length,size_t ibs,size_t obs,const struct darc_dict*dict){
+	assert(ibs>0 && obs>0);
+	Bytef *ibuf=malloc(ibs),*obuf=malloc(obs),*window=NULL;
+	if(!ibuf || !obuf){
+		critmalloc(ibuf?obs:ibs,"");
+		free(obuf);
+		free(ibuf);
+		return darc_extract_range_critical_malloc_error;
+	}
+	z_stream cmp={.zalloc=Z_NULL,.zfree=Z_NULL,.opaque=Z_NULL};
+	int r=darc_extract_range_ok;
+	if(idxf){
+		if(!(window=malloc(WINDOW_SIZE))){
+			critmalloc((size_t)WINDOW_SIZE,"");
+			free(obuf);
+			free(ibuf);
+			return darc_extract_range_critical_malloc_error;
+		}
+		uint64_t out,in;
+		int bits=0;
+		if((r=darc_read_index(idxf,offset,&out,&in,&bits,window))!=darc_extract_range_ok){
+			free(window);
+			free(obuf);
+			free(ibuf);
+			return r;
+		}
+		if(fseeko64(inf,in-(bits?1:0),SEEK_SET)==-1){
+			errnolog("Failed to change the file pointer in the input file");
+			free(window);
+			free(obuf);
+			free(ibuf);
+			return darc_extract_range_seek_error;
+		}
+		if(inflateInit2(&cmp,-MAX_WBITS)!=Z_OK){
+			elog("inflateInit2: error. msg='%s'.",cmp.msg==Z_NULL?"":cmp.msg);
+			free(window);
+			free(obuf);
+			free(ibuf);
+			return darc_extract_range_inflateinit_error;
+		}
+		if(bits){
+			int b=getc(inf);
+			if(b==EOF){
+				elog("Unexpected end of the input data.");
+				r=darc_extract_range_data_error;
+				goto l_end;
+			}
+			inflatePrime(&cmp,bits,b>>(8-bits));
+		}
+		inflateSetDictionary(&cmp,window,WINDOW_SIZE);
+		offset-=out;
+	}else if(inflateInit(&cmp)!=Z_OK){
+		elog("inflateInit: error. msg='%s'.",cmp.msg==Z_NULL?"":cmp.msg);
+		free(obuf);
+		free(ibuf);
+		return darc_extract_range_inflateinit_error;
+	}
+	int e=Z_OK;
+	while(length && e!=Z_STREAM_END){
+		cmp.avail_in=fread(ibuf,1,ibs>UINT_MAX?UINT_MAX:ibs,inf);
+		if(ferror(inf)){
+			elog("Input error.");
+			r=darc_extract_range_fread_error;
+			goto l_end;
+		}
+		if(!cmp.avail_in){
+			elog("Unexpected end of the input data.");
+			r=darc_extract_range_data_error;
+			goto l_end;
+		}
+		cmp.next_in=ibuf;
+		do{
+			cmp.next_out=obuf;
+			cmp.avail_out=obs>UINT_MAX?UINT_MAX:obs;
+			e=inflate(&cmp,Z_NO_FLUSH);
+			if(e==Z_NEED_DICT && dict && cmp.adler==dict->id)
+				e=inflateSetDictionary(&cmp,dict->data,dict->size)==Z_OK?Z_OK:Z_STREAM_ERROR;
+			if(e==Z_NEED_DICT || e==Z_DATA_ERROR || e==Z_MEM_ERROR || e==Z_STREAM_ERROR){
+				elog("inflate: The input data was corrupted(%i). msg='%s'.",e,cmp.msg==Z_NULL?"":cmp.msg);
+				r=darc_extract_range_data_error;
+				goto l_end;
+			}
+			uint64_t got=cmp.next_out-obuf;
+			const Bytef *from=obuf;
+			if(offset){
+				uint64_t skip=offset<got?offset:got;
+				offset-=skip;
+				from+=skip;
+				got-=skip;
+			}
+			if(got>length)
+				got=length;
+			if(got){
+				if(fwrite(from,1,got,outf)!=got){
+					elog("Output error.");
+					r=darc_extract_range_fwrite_error;
+					goto l_end;
+				}
+				length-=got;
+			}
+		}while(length && e!=Z_STREAM_END && (cmp.avail_in || !cmp.avail_out));
+	}
+	if(offset){
+		elog("The offset is beyond the end of the data.");
+		r=darc_extract_range_data_error;
+	}
+l_end:
+	inflateEnd(&cmp);
+	free(window);
+	free(obuf);
+	free(ibuf);
+	return r;
+}
+
+#define BENCH_REPEATS 5
+#define BENCH_CORPUS_SIZE 0x400000
+
+/* A reproducible text-like corpus for --bench without an input file. */
+static Bytef *darc_bench_corpus(size_t sz){
+	static const char *const words[]={"the","of","and","to","in","is","that","for",
+		"it","as","was","with","be","by","on","not","he","this","are","or",
+		"his","from","at","which","but","have","an","had","they","you","were",
+		"their","one","all","we","can","her","has","there","been","if","more",
+		"when","will","would","who","so","no","{\"id\":","\"name\":","\"value\":",
+		"null","true","false","},","0x7f3a","1024","-1","\t","struct","return"};
+	Bytef *m=malloc(sz);
+	if(!m){
+		critmalloc(sz,"");
+		return NULL;
+	}
+	uint32_t x=0x2545f491;
+	for(size_t p=0;p<sz;){
+		x=x*1103515245+12345;
+		const char *w=words[(x>>16)%(sizeof(words)/sizeof(*words))];
+		size_t l=strlen(w);
+		if(l>sz-p)
+			l=sz-p;
+		memcpy(m+p,w,l);
+		p+=l;
+		if(p<sz)
+			m[p++]=(x>>8)%13?' ':(x>>4)%3?'\n':(Bytef)(x>>20);
+	}
+	return m;
+}
+
+/* Reads the whole input into memory. */
+static Bytef *darc_slurp(FILE*inf,size_t ibs,size_t*sz){
+	Bytef *m=NULL;
+	size_t cap=0;
+	*sz=0;
+	while(1){
+		if(cap-*sz<ibs){
+			size_t ncap;
+			if(__builtin_add_overflow(cap,cap>ibs?cap:ibs,&ncap)){
+				elog("The input is too large.");
+				free(m);
+				return NULL;
+			}
+			Bytef *n=realloc(m,ncap);
+			if(!n){
+				critrealloc(ncap,"");
+				free(m);
+				return NULL;
+			}
+			m=n;
+			cap=ncap;
+		}
+		size_t l=fread(m+*sz,1,ibs,inf);
+		if(ferror(inf)){
+			elog("Input error.");
+			free(m);
+			return NULL;
+		}
+		if(!l)
+			break;
+		*sz+=l;
+	}
+	return m;
+}
+
+static int darc_bench_cmp(const void*a,const void*b){
+	double x=*(const double*)a,y=*(const double*)b;
+	return x<y?-1:x>y;
+}
+
+/* BENCH_REPEATS samples are too few for a tail percentile; the extremes
+are reported instead. */
+struct darc_bench_result{
+	double mbps,min,p50,max;
+};
+
+static void darc_bench_stats(const double*lat,size_t sz,struct darc_bench_result*r){
+	double s[BENCH_REPEATS],total=0;
+	memcpy(s,lat,sizeof(s));
+	qsort(s,BENCH_REPEATS,sizeof(*s),darc_bench_cmp);
+	for(int n=0;n<BENCH_REPEATS;++n)
+		total+=s[n];
+	r->mbps=sz*(double)BENCH_REPEATS/total/1e6;
+	r->min=s[0]*1e3;
+	r->p50=s[BENCH_REPEATS/2]*1e3;
+	r->max=s[BENCH_REPEATS-1]*1e3;
+}
+
+enum darc_bench_result_code{
+	darc_bench_ok,darc_bench_critical_malloc_error,darc_bench_input_error,
+	darc_bench_codec_error,darc_bench_mismatch_error
+};
+
+/* Runs the codecs over the sample in memory for every combination of
+level, buffer size and thread count, BENCH_REPEATS calls each. */
+static int darc_bench(FILE*inf,FILE*outf,enum darc_bench_format fmt,size_t ibs,
+size_t nthreads,SET_INI_BOOLEAN blocked){
+	size_t sz;
+	Bytef *in=inf?darc_slurp(inf,ibs,&sz):darc_bench_corpus(sz=BENCH_CORPUS_SIZE);
+	if(!in)
+		return darc_bench_input_error;
+	if(!sz){
+		elog("The input is empty.");
+		free(in);
+		return darc_bench_input_error;
+	}
+	/* Room for the format overhead of the smallest blocks. */
+	size_t csz=compressBound(sz)+sz/0x1000*32+4096;
+	Bytef *cbuf=malloc(csz),*dbuf=malloc(sz+1);
+	if(!cbuf || !dbuf){
+		critmalloc(cbuf?sz+1:csz,"");
+		free(cbuf);
+		free(in);
+		return darc_bench_critical_malloc_error;
+	}
+	static const int levels[]={1,3,6,9};
+	static const size_t bufs[]={0x10000,0x100000};
+	size_t threads[]={1,nthreads};
+	int r=darc_bench_ok;
+	if(fmt==darc_bench_json)
+		fprintf(outf,"[");
+	else
+		fprintf(outf,"%-5s %-8s %-7s %-7s %-10s %-9s %-9s %-9s %-10s %-9s %-9s %-9s\n","level","ibs","threads",
+			"ratio","c MB/s","c min ms","c p50 ms","c max ms","d MB/s","d min ms","d p50 ms","d max ms");
+	SET_INI_BOOLEAN first=SET_INI_TRUE;
+	for(size_t t=0;t<(nthreads>1?2:1);++t)
+	for(size_t b=0;b<sizeof(bufs)/sizeof(*bufs);++b)
+	for(size_t l=0;l<sizeof(levels)/sizeof(*levels);++l){
+		double clat[BENCH_REPEATS],dlat[BENCH_REPEATS];
+		size_t osz=0;
+		for(int n=0;n<BENCH_REPEATS;++n){
+			FILE *o=fmemopen(cbuf,csz,"wb");
+			if(!o){
+				errnolog("fmemopen");
+				r=darc_bench_critical_malloc_error;
+				goto l_end;
+			}
+			double s=darc_now();
+			int e=threads[t]>1 || blocked?
+				darc_compress_parallel(NULL,in,sz,o,levels[l],bufs[b],threads[t],blocked,NULL,NULL)!=darc_compress_parallel_ok:
+				darc_compress(NULL,in,sz,o,levels[l],bufs[b],bufs[b]*2,NULL,NULL,NULL)!=darc_compress_ok;
+			fflush(o);
+			clat[n]=darc_now()-s;
+			osz=ftell(o);
+			fclose(o);
+			if(e){
+				r=darc_bench_codec_error;
+				goto l_end;
+			}
+			FILE *ci=fmemopen(cbuf,osz,"rb");
+			o=fmemopen(dbuf,sz+1,"wb");
+			if(!ci || !o){
+				errnolog("fmemopen");
+				if(ci)
+					fclose(ci);
+				if(o)
+					fclose(o);
+				r=darc_bench_critical_malloc_error;
+				goto l_end;
+			}
+			s=darc_now();
+			e=darc_decompress(ci,o,NULL,0,bufs[b],bufs[b]*2,threads[t],NULL)!=darc_decompress_ok;
+			fflush(o);
+			dlat[n]=darc_now()-s;
+			size_t dsz=ftell(o);
+			fclose(o);
+			fclose(ci);
+			if(e){
+				r=darc_bench_codec_error;
+				goto l_end;
+			}
+			if(dsz!=sz || memcmp(in,dbuf,sz)){
+				elog("The decompressed data does not match the input(level %i, ibs %zu).",levels[l],bufs[b]);
+				r=darc_bench_mismatch_error;
+				goto l_end;
+			}
+		}
+		struct darc_bench_result c,d;
+		darc_bench_stats(clat,sz,&c);
+		darc_bench_stats(dlat,sz,&d);
+		if(fmt==darc_bench_json){
+			fprintf(outf,"%s\n{\"level\":%i,\"ibs\":%zu,\"obs\":%zu,\"threads\":%zu,\"blocked\":%s,"
+				"\"size\":%zu,\"compressed\":%zu,\"ratio\":%.4f,"
+				"\"compress\":{\"mbps\":%.2f,\"min_ms\":%.3f,\"p50_ms\":%.3f,\"max_ms\":%.3f},"
+				"\"decompress\":{\"mbps\":%.2f,\"min_ms\":%.3f,\"p50_ms\":%.3f,\"max_ms\":%.3f}}",
+				first?"":",",levels[l],bufs[b],bufs[b]*2,threads[t],blocked?"true":"false",
+				sz,osz,(double)osz/sz,c.mbps,c.min,c.p50,c.max,d.mbps,d.min,d.p50,d.max);
+		}else{
+			fprintf(outf,"%-5i %-8zu %-7zu %-7.4f %-10.2f %-9.3f %-9.3f %-9.3f %-10.2f %-9.3f %-9.3f %-9.3f\n",
+				levels[l],bufs[b],threads[t],(double)osz/sz,c.mbps,c.min,c.p50,c.max,d.mbps,d.min,d.p50,d.max);
+		}
+		fflush(outf);
+		first=SET_INI_FALSE;
+	}
+	if(fmt==darc_bench_json)
+		fprintf(outf,"\n]\n");
+l_end:
+	free(dbuf);
+	free(cbuf);
+	free(in);
+	return r;
+}
+
+#define TRAIN_GRAM 8
+#define TRAIN_SEGMENT 128
+#define TRAIN_HASH_BITS 20
+
+struct darc_train_segment{
+	const Bytef *p;
+	uint64_t score;
+};
+
+static uint32_t darc_train_hash(const Bytef*p){
+	uint64_t v;
+	memcpy(&v,p,TRAIN_GRAM);
+	return (v*0x9e3779b97f4a7c15ull)>>(64-TRAIN_HASH_BITS);
+}
+
+/* A gram shared by several samples weighs its frequency, divided by one more
+than the number of times it was covered already. */
+static uint64_t darc_train_score(const uint32_t*freq,const uint32_t*used,const Bytef*p){
+	uint64_t s=0;
+	for(size_t n=0;n+TRAIN_GRAM<=TRAIN_SEGMENT;++n){
+		uint32_t h=darc_train_hash(p+n);
+		if(freq[h]>1)
+			s+=((uint64_t)freq[h]<<8)/(used[h]+1);
+	}
+	return s;
+}
+
+/* segs is a max-heap by score. */
+static void darc_train_sift(struct darc_train_segment*segs,size_t nsegs,size_t i){
+	struct darc_train_segment s=segs[i];
+	for(size_t c;(c=2*i+1)<nsegs;i=c){
+		if(c+1<nsegs && segs[c+1].score>segs[c].score)
+			++c;
+		if(segs[c].score<=s.score)
+			break;
+		segs[i]=segs[c];
+	}
+	segs[i]=s;
+}
+
+enum darc_train_dictionary_result{
+	darc_train_dictionary_ok,darc_train_dictionary_critical_malloc_error,
+	darc_train_dictionary_input_error,darc_train_dictionary_no_data_error,
+	darc_train_dictionary_fwrite_error
+};
+
+/* Builds a WINDOW_SIZE dictionary from the sample files listed one per line
+in inf. 8-byte grams are weighted by the number of samples they occur in,
+128-byte segments of the samples laid end to end(so that records shorter than
+a segment count too) by the weights of their grams, and the best segments are
+picked greedily until the dictionary is full(the scores of the rest are
+brought up to date lazily, as covered grams count less) and laid out with
+the best at the end, closest to the data. */
+static int darc_train_dictionary(FILE*inf,FILE*outf,size_t ibs){
+	size_t lsz;
+	char *list=(char*)darc_slurp(inf,ibs,&lsz);
+	if(!list)
+		return darc_train_dictionary_input_error;
+	Bytef *corpus=NULL;
+	size_t nsamples=0,total=0,cap=0;
+	uint32_t *freq=calloc((size_t)2<<TRAIN_HASH_BITS,sizeof(*freq)),*seen=freq+((size_t)1<<TRAIN_HASH_BITS);
+	struct darc_train_segment *segs=NULL;
+	Bytef *dict=NULL;
+	int r=darc_train_dictionary_ok;
+	if(!freq){
+		critmalloc(((size_t)2<<TRAIN_HASH_BITS)*sizeof(*freq),"");
+		r=darc_train_dictionary_critical_malloc_error;
+		goto l_end;
+	}
+	for(size_t p=0;p<lsz;){
+		size_t e=p;
+		while(e<lsz && list[e]!='\n')
+			++e;
+		if(e==p){
+			p=e+1;
+			continue;
+		}
+		char *path=malloc(e-p+1);
+		if(!path){
+			critmalloc(e-p+1,"");
+			r=darc_train_dictionary_critical_malloc_error;
+			goto l_end;
+		}
+		memcpy(path,list+p,e-p);
+		path[e-p]='\0';
+		p=e+1;
+		FILE *f=fopen64(path,"rb");
+		if(!f){
+			errnolog("Can't open file '%s'",path);
+			free(path);
+			r=darc_train_dictionary_input_error;
+			goto l_end;
+		}
+		free(path);
+		size_t sz;
+		Bytef *m=darc_slurp(f,ibs,&sz);
+		fclose(f);
+		if(!m){
+			r=darc_train_dictionary_input_error;
+			goto l_end;
+		}
+		if(sz<TRAIN_GRAM){
+			free(m);
+			continue;
+		}
+		if(total+sz>cap){
+			size_t ncap=cap?cap:0x10000;
+			while(ncap<total+sz)
+				ncap*=2;
+			Bytef *nc=realloc(corpus,ncap);
+			if(!nc){
+				critrealloc(ncap,"");
+				free(m);
+				r=darc_train_dictionary_critical_malloc_error;
+				goto l_end;
+			}
+			corpus=nc;
+			cap=ncap;
+		}
+		memcpy(corpus+total,m,sz);
+		free(m);
+		++nsamples;
+		for(size_t n=0;n+TRAIN_GRAM<=sz;++n){
+			uint32_t h=darc_train_hash(corpus+total+n);
+			if(seen[h]!=nsamples){
+				seen[h]=nsamples;
+				++freq[h];
+			}
+		}
+		total+=sz;
+	}
+	if(total<TRAIN_SEGMENT){
+		elog("The samples make less than %i bytes.",TRAIN_SEGMENT);
+		r=darc_train_dictionary_no_data_error;
+		goto l_end;
+	}
+	size_t nsegs=0;
+	if(!(segs=malloc((total/(TRAIN_SEGMENT/2)+1)*sizeof(*segs)))){
+		critmalloc((total/(TRAIN_SEGMENT/2)+1)*sizeof(*segs),"");
+		r=darc_train_dictionary_critical_malloc_error;
+		goto l_end;
+	}
+	/* seen counts the coverage from here on. */
+	memset(seen,0,sizeof(*seen)<<TRAIN_HASH_BITS);
+	for(size_t n=0;n+TRAIN_SEGMENT<=total;n+=TRAIN_SEGMENT/2){
+		segs[nsegs].p=corpus+n;
+		if((segs[nsegs].score=darc_train_score(freq,seen,segs[nsegs].p)))
+			++nsegs;
+	}
+	for(size_t n=nsegs/2;n--;)
+		darc_train_sift(segs,nsegs,n);
+	if(!(dict=malloc(WINDOW_SIZE))){
+		critmalloc((size_t)WINDOW_SIZE,"");
+		r=darc_train_dictionary_critical_malloc_error;
+		goto l_end;
+	}
+	size_t left=WINDOW_SIZE;
+	while(nsegs && left>=TRAIN_SEGMENT){
+		uint64_t s=darc_train_score(freq,seen,segs[0].p);
+		if(s<segs[0].score){
+			segs[0].score=s;
+		}else{
+			left-=TRAIN_SEGMENT;
+			memcpy(dict+left,segs[0].p,TRAIN_SEGMENT);
+			for(size_t g=0;g+TRAIN_GRAM<=TRAIN_SEGMENT;++g)
+				++seen[darc_train_hash(segs[0].p+g)];
+			segs[0]=segs[--nsegs];
+		}
+		darc_train_sift(segs,nsegs,0);
+	}
+	if(left==WINDOW_SIZE){
+		elog("The samples have nothing in common.");
+		r=darc_train_dictionary_no_data_error;
+		goto l_end;
+	}
+	if(fwrite(dict+left,1,WINDOW_SIZE-left,outf)!=WINDOW_SIZE-left){
+		elog("Output error.");
+		r=darc_train_dictionary_fwrite_error;
+	}
+l_end:
+	free(dict);
+	free(segs);
+	free(corpus);
+	free(freq);
+	free(list);
+	return r;
+}
+
+/* Only the last WINDOW_SIZE bytes of a dictionary can ever be referenced. */
+static struct darc_dict *darc_load_dictionary(const char*path,size_t ibs,struct darc_dict*d){
+	FILE *f=fopen64(path,"rb");
+	if(!f){
+		errnolog("Can't open file '%s'",path);
+		return NULL;
+	}
+	size_t sz;
+	Bytef *m=darc_slurp(f,ibs,&sz);
+	fclose(f);
+	if(!m)
+		return NULL;
+	if(!sz){
+		elog("The dictionary '%s' is empty.",path);
+		free(m);
+		return NULL;
+	}
+	d->size=sz<WINDOW_SIZE?sz:WINDOW_SIZE;
+	memmove(m,m+sz-d->size,d->size);
+	d->data=m;
+	d->id=adler32(adler32(0L,Z_NULL,0),d->data,d->size);
+	return d;
+}
+
+#define TEST_SCRATCH_SIZE 0x10000
+
+struct darc_test;
+
+typedef SET_INI_BOOLEAN (*darc_test_sink)(struct darc_test*,const Bytef*,size_t);
+
+/* --test: a file is inflated by ctx into its small buffer, which is passed to
+sink and thrown away. in is the input offset reached, out the bytes expanded
+so far; error is set on the first fault. */
+struct darc_test{
+	FILE *f;
+	darc_ctx *ctx;
+	darc_test_sink sink;
+	Bytef *ibuf;
+	size_t ibs,pos,len;
+	uint64_t in,out,base;
+	const struct darc_dict *dict;
+	char error[128];
+	/* The adler32 of a block of the blocked format. */
+	uLong check;
+	/* The dedup records: rec holds the header being read, left the literal
+	bytes to go and size the data they expand to. */
+	Bytef rec[12];
+	size_t recsz,recneed;
+	uint64_t left,size;
+	SET_INI_BOOLEAN done;
+};
+
+static void darc_test_error(struct darc_test*t,const char*msg){
+	if(!*t->error){
+		snprintf(t->error,sizeof(t->error),"%s",msg);
+		t->in=t->base+t->pos;
+	}
+}
+
+/* Makes at least n bytes available at t->pos if the file has them. */
+static SET_INI_BOOLEAN darc_test_peek(struct darc_test*t,size_t n){
+	if(t->len-t->pos>=n)
+		return SET_INI_TRUE;
+	memmove(t->ibuf,t->ibuf+t->pos,t->len-t->pos);
+	t->base+=t->pos;
+	t->len-=t->pos;
+	t->pos=0;
+	while(t->len<n){
+		size_t got=darc_stats_fread(t->ibuf+t->len,t->ibs-t->len,t->f);
+		if(ferror(t->f)){
+			darc_test_error(t,"input error");
+			return SET_INI_FALSE;
+		}
+		if(!got)
+			return SET_INI_FALSE;
+		t->len+=got;
+	}
+	return SET_INI_TRUE;
+}
+
+/* Makes input available; FALSE at the end of the file or on an error. */
+static SET_INI_BOOLEAN darc_test_fill(struct darc_test*t){
+	if(darc_test_peek(t,1))
+		return SET_INI_TRUE;
+	darc_test_error(t,"unexpected end of the input data");
+	return SET_INI_FALSE;
+}
+
+static SET_INI_BOOLEAN darc_test_read(struct darc_test*t,Bytef*dst,size_t n){
+	while(n){
+		if(!darc_test_fill(t))
+			return SET_INI_FALSE;
+		size_t c=t->len-t->pos<n?t->len-t->pos:n;
+		memcpy(dst,t->ibuf+t->pos,c);
+		t->pos+=c;
+		dst+=c;
+		n-=c;
+	}
+	return SET_INI_TRUE;
+}
+
+static int darc_test_write(void*user,const void*buf,size_t size){
+	struct darc_test *t=user;
+	if(t->sink && !t->sink(t,buf,size))
+		return 1;
+	t->out+=size;
+	return 0;
+}
+
+/* Inflates one stream of at most limit input bytes with t->ctx, made ready
+for it. */
+static SET_INI_BOOLEAN darc_test_inflate(struct darc_test*t,uint64_t limit,darc_test_sink sink){
+	t->sink=sink;
+	while(!darc_ctx_at_end(t->ctx)){
+		if(!limit){
+			darc_test_error(t,"the block is truncated");
+			return SET_INI_FALSE;
+		}
+		if(!darc_test_fill(t))
+			return SET_INI_FALSE;
+		size_t n=t->len-t->pos,left;
+		if(n>limit)
+			n=limit;
+		left=n;
+		int e=darc_stats_push_member(t->ctx,t->ibuf+t->pos,&left,darc_test_write,t);
+		t->pos+=n-left;
+		limit-=n-left;
+		/* A sink that failed has set the error. */
+		if(e!=DARC_OK && e!=DARC_WRITE_ERROR){
+			char msg[96];
+			if(e==DARC_NEED_DICT)
+				snprintf(msg,sizeof(msg),"a preset dictionary(id %08lx) required",darc_ctx_dictionary_id(t->ctx));
+			else
+				snprintf(msg,sizeof(msg),"%s",*darc_ctx_message(t->ctx)?darc_ctx_message(t->ctx):"the data was corrupted");
+			darc_test_error(t,msg);
+		}
+		if(e!=DARC_OK)
+			return SET_INI_FALSE;
+	}
+	return SET_INI_TRUE;
+}
+
+static SET_INI_BOOLEAN darc_test_adler(struct darc_test*t,const Bytef*p,size_t n){
+	t->check=adler32_z(t->check,p,n);
+	return SET_INI_TRUE;
+}
+
+static SET_INI_BOOLEAN darc_test_blocked(struct darc_test*t){
+	Bytef hdr[BLOCKED_MAGIC_SIZE+9];
+	if(!darc_test_read(t,hdr,BLOCKED_MAGIC_SIZE+5))
+		return SET_INI_FALSE;
+	const struct darc_dict *dict=NULL;
+	if(hdr[BLOCKED_MAGIC_SIZE]==BLOCKED_VERSION_DICT){
+		if(!darc_test_read(t,hdr+BLOCKED_MAGIC_SIZE+5,4))
+			return SET_INI_FALSE;
+		uLong id=darc_get32le(hdr+BLOCKED_MAGIC_SIZE+5);
+		if(!t->dict || t->dict->id!=id){
+			char msg[64];
+			snprintf(msg,sizeof(msg),"a preset dictionary(id %08lx) required",id);
+			darc_test_error(t,msg);
+			return SET_INI_FALSE;
+		}
+		dict=t->dict;
+	}else if(hdr[BLOCKED_MAGIC_SIZE]!=BLOCKED_VERSION){
+		darc_test_error(t,"unsupported version of the blocked format");
+		return SET_INI_FALSE;
+	}
+	size_t bs=darc_get32le(hdr+BLOCKED_MAGIC_SIZE+1),cbs=darc_blocked_bound(bs);
+	if(!bs || !cbs){
+		darc_test_error(t,"invalid block size");
+		return SET_INI_FALSE;
+	}
+	if(darc_ctx_set_params(t->ctx,-MAX_WBITS,0,0)!=DARC_OK ||
+	darc_ctx_set_dictionary(t->ctx,dict?dict->data:NULL,dict?dict->size:0)!=DARC_OK){
+		darc_test_error(t,"inflateInit2 failed");
+		return SET_INI_FALSE;
+	}
+	SET_INI_BOOLEAN ok=SET_INI_TRUE;
+	while(ok){
+		Bytef ent[12];
+		if(!(ok=darc_test_read(t,ent,12)))
+			break;
+		uint32_t csize=darc_get32le(ent),esize=darc_get32le(ent+4);
+		if(!csize && !esize)
+			break;
+		if(!csize || csize>cbs || !esize || esize>bs){
+			darc_test_error(t,"the block table entry is corrupted");
+			ok=SET_INI_FALSE;
+			break;
+		}
+		uint64_t out=t->out;
+		if(!(ok=darc_ctx_reset(t->ctx)==DARC_OK)){
+			darc_test_error(t,"the stream state was inconsistent");
+			break;
+		}
+		t->check=adler32(0,Z_NULL,0);
+		if(!(ok=darc_test_inflate(t,csize,darc_test_adler)))
+			break;
+		if(t->out-out!=esize || t->check!=darc_get32le(ent+8)){
+			darc_test_error(t,t->out-out!=esize?"the block size mismatch":"the block checksum mismatch");
+			ok=SET_INI_FALSE;
+		}
+	}
+	return ok;
+}
+
+/* Walks the records of a dedup stream without resolving the references. */
+static SET_INI_BOOLEAN darc_test_records(struct darc_test*t,const Bytef*p,size_t n){
+	const Bytef *pe=p+n;
+	while(p<pe){
+		if(t->done){
+			darc_test_error(t,"the data after the end of the records");
+			return SET_INI_FALSE;
+		}
+		if(t->left){
+			size_t c=pe-p<t->left?pe-p:t->left;
+			p+=c;
+			t->left-=c;
+			continue;
+		}
+		size_t c=pe-p<t->recneed-t->recsz?pe-p:t->recneed-t->recsz;
+		memcpy(t->rec+t->recsz,p,c);
+		p+=c;
+		if((t->recsz+=c)<t->recneed)
+			continue;
+		uint32_t v=darc_get32le(t->rec);
+		if(v&DEDUP_REF && t->recneed==4){
+			t->recneed=12;
+			continue;
+		}
+		if(v&DEDUP_REF){
+			if((darc_get32le(t->rec+4)|(uint64_t)darc_get32le(t->rec+8)<<32)>=t->size){
+				darc_test_error(t,"the reference is out of the data");
+				return SET_INI_FALSE;
+			}
+			t->size+=v&~DEDUP_REF;
+		}else if(v){
+			t->left=v;
+			t->size+=v;
+		}else{
+			t->done=SET_INI_TRUE;
+		}
+		t->recsz=0;
+		t->recneed=4;
+	}
+	return SET_INI_TRUE;
+}
+
+static SET_INI_BOOLEAN darc_test_archive(struct darc_test*t,const char*path){
+	if(!path){
+		darc_test_error(t,"archives are tested by path(i=)");
+		return SET_INI_FALSE;
+	}
+	int s;
+	darc_archive *a=darc_archive_open(path,&s);
+	if(!a){
+		darc_test_error(t,darc_status_string(s));
+		return SET_INI_FALSE;
+	}
+	for(size_t n=0;n<darc_archive_count(a);++n){
+		const struct darc_member *m=darc_archive_member(a,n);
+		if((s=darc_archive_extract(a,m,darc_test_write,t))!=DARC_OK){
+			char msg[128];
+			snprintf(msg,sizeof(msg),"member '%.*s': %s",(int)(m->namesz<64?m->namesz:64),m->name,darc_status_string(s));
+			darc_test_error(t,msg);
+			t->in=m->offset;
+			darc_archive_close(a);
+			return SET_INI_FALSE;
+		}
+	}
+	darc_archive_close(a);
+	return SET_INI_TRUE;
+}
+
+/* Tests one file of any of the formats darc writes. The result is reported to
+report as a line, name first. */
+static SET_INI_BOOLEAN darc_test_file(FILE*f,const char*path,const char*name,FILE*report,size_t ibs,
+const struct darc_dict*dict){
+	struct darc_test t={.f=f,.ibs=ibs,.dict=dict};
+	SET_INI_BOOLEAN ok=SET_INI_FALSE;
+	if(!(t.ibuf=malloc(ibs))){
+		critmalloc(ibs,"");
+		return SET_INI_FALSE;
+	}
+	if(!(t.ctx=darc_inflate_ctx(TEST_SCRATCH_SIZE,NULL))){
+		free(t.ibuf);
+		return SET_INI_FALSE;
+	}
+	darc_test_peek(&t,ARCHIVE_MAGIC_SIZE);
+	if(t.len>=ARCHIVE_MAGIC_SIZE && !memcmp(t.ibuf,ARCHIVE_MAGIC,ARCHIVE_MAGIC_SIZE)){
+		ok=darc_test_archive(&t,path);
+	}else if(darc_test_fill(&t)){
+		/* The members one after another, as darc_decompress reads them. */
+		do{
+			darc_test_peek(&t,DEDUP_MAGIC_SIZE);
+			const Bytef *p=t.ibuf+t.pos;
+			SET_INI_BOOLEAN dedup=t.len-t.pos>=DEDUP_MAGIC_SIZE && !memcmp(p,DEDUP_MAGIC,DEDUP_MAGIC_SIZE);
+			Bytef hdr[DEDUP_MAGIC_SIZE+1];
+			ok=SET_INI_FALSE;
+			if(t.len-t.pos>=BLOCKED_MAGIC_SIZE && !memcmp(p,BLOCKED_MAGIC,BLOCKED_MAGIC_SIZE)){
+				ok=darc_test_blocked(&t);
+			}else if(dedup && (!darc_test_read(&t,hdr,DEDUP_MAGIC_SIZE+1) || hdr[DEDUP_MAGIC_SIZE]!=DEDUP_VERSION)){
+				darc_test_error(&t,"unsupported version of the dedup format");
+			}else if(darc_ctx_set_params(t.ctx,MAX_WBITS,0,0)!=DARC_OK ||
+			darc_ctx_set_dictionary(t.ctx,dict?dict->data:NULL,dict?dict->size:0)!=DARC_OK){
+				darc_test_error(&t,"inflateInit failed");
+			}else{
+				uint64_t out=t.out;
+				t.size=t.left=0;
+				t.recsz=0;
+				t.recneed=4;
+				t.done=SET_INI_FALSE;
+				ok=darc_test_inflate(&t,UINT64_MAX,dedup?darc_test_records:NULL);
+				if(ok && dedup && !t.done){
+					darc_test_error(&t,"unexpected end of the records");
+					ok=SET_INI_FALSE;
 				}
-			}while(cmp.avail_in);
-			cmp.avail_in=fread(ibuf,1,ibs,inf);
-			if(ferror(inf)){
-				elog("Input error.");
-				inflateEnd(&cmp);
-				if(overflow)
-					free(obuf);
-				free(ibuf);
-				return darc_decompress_fread_error;
+				if(dedup)
+					t.out=out+t.size;
+			}
+		}while(ok && darc_test_peek(&t,1));
+		if(*t.error)
+			ok=SET_INI_FALSE;
+	}
+	int e=ok?fprintf(report,"%s: OK, %llu bytes.\n",name,(unsigned long long)t.out):
+		fprintf(report,"%s: FAILED at byte %llu(%llu bytes expanded): %s.\n",name,(unsigned long long)t.in,
+			(unsigned long long)t.out,t.error);
+	if(e<0){
+		elog("Output error.");
+		ok=SET_INI_FALSE;
+	}
+	darc_ctx_free(t.ctx);
+	free(t.ibuf);
+	return ok;
+}
+
+/* libdarc callbacks over stdio. */
+static size_t darc_stdio_read(void*user,void*buf,size_t size){
+	size_t l=fread(buf,1,size,user);
+	return ferror((FILE*)user)?(size_t)-1:l;
+}
+
+static int darc_stdio_write(void*user,const void*buf,size_t size){
+	return fwrite(buf,1,size,user)!=size;
+}
+
+#define BATCH_SUFFIX ".z"
+#define BATCH_SUFFIX_SIZE 2
+
+/* With report set the files are tested(--test) and have no outputs. */
+struct darc_batch{
+	pthread_mutex_t mutex;
+	char **in,**out;
+	size_t n,next,failed;
+	SET_INI_BOOLEAN inflating;
+	FILE *report;
+	size_t ibs;
+	const struct darc_dict *dict;
+};
+
+struct darc_batch_worker{
+	pthread_t thread;
+	struct darc_batch*b;
+	darc_ctx *ctx;
+};
+
+static void *darc_batch_worker(void*arg){
+	struct darc_batch_worker *w=arg;
+	struct darc_batch *b=w->b;
+	while(1){
+		pthread_mutex_lock(&b->mutex);
+		size_t n=b->next<b->n?b->next++:b->n;
+		pthread_mutex_unlock(&b->mutex);
+		if(n==b->n)
+			break;
+		SET_INI_BOOLEAN ok=SET_INI_FALSE;
+		FILE *inf=fopen64(b->in[n],"rb"),*outf=NULL;
+		if(!inf){
+			errnolog("Can't open file '%s'",b->in[n]);
+		}else if(b->report){
+			ok=darc_test_file(inf,b->in[n],b->in[n],b->report,b->ibs,b->dict);
+			fclose(inf);
+		}else{
+			if(!(outf=fopen64(b->out[n],"wb"))){
+				errnolog("Can't open file '%s'",b->out[n]);
+			}else{
+				int e=darc_ctx_stream(w->ctx,darc_stdio_read,inf,darc_stdio_write,outf);
+				if(e==DARC_NEED_DICT){
+					elog("A preset dictionary(id %08lx) required.",darc_ctx_dictionary_id(w->ctx));
+				}else if(e!=DARC_OK){
+					elog("%s. msg='%s'.",darc_status_string(e),darc_ctx_message(w->ctx));
+				}
+				ok=e==DARC_OK;
+				if(fclose(outf)){
+					errnolog("Can't close file '%s'",b->out[n]);
+					ok=SET_INI_FALSE;
+				}
+				if(!ok){
+					elog("While processing '%s'.",b->in[n]);
+					unlink(b->out[n]);
+				}
+			}
+			fclose(inf);
+		}
+		if(!ok){
+			pthread_mutex_lock(&b->mutex);
+			++b->failed;
+			pthread_mutex_unlock(&b->mutex);
+		}
+	}
+	return NULL;
+}
+
+static SET_INI_BOOLEAN darc_batch_add(struct darc_batch*b,size_t*cap,char*in,char*out){
+	if(b->n==*cap){
+		size_t ncap=*cap?*cap*2:64;
+		char **nin=realloc(b->in,ncap*sizeof(*nin));
+		if(!nin){
+			critrealloc(ncap*sizeof(*nin),"");
+			return SET_INI_FALSE;
+		}
+		b->in=nin;
+		char **nout=realloc(b->out,ncap*sizeof(*nout));
+		if(!nout){
+			critrealloc(ncap*sizeof(*nout),"");
+			return SET_INI_FALSE;
+		}
+		b->out=nout;
+		*cap=ncap;
+	}
+	b->in[b->n]=in;
+	b->out[b->n++]=out;
+	return SET_INI_TRUE;
+}
+
+/* The output of a file given without one: BATCH_SUFFIX is appended on
+compression and stripped on decompression. NULL if there is no suffix to strip. */
+static char *darc_batch_default_output(const char*in,size_t insz,SET_INI_BOOLEAN inflating){
+	char *out;
+	if(inflating){
+		if(insz<=BATCH_SUFFIX_SIZE || memcmp(in+insz-BATCH_SUFFIX_SIZE,BATCH_SUFFIX,BATCH_SUFFIX_SIZE))
+			return NULL;
+		if(!(out=malloc(insz-BATCH_SUFFIX_SIZE+1))){
+			critmalloc(insz-BATCH_SUFFIX_SIZE+1,"");
+			return NULL;
+		}
+		memcpy(out,in,insz-BATCH_SUFFIX_SIZE);
+		out[insz-BATCH_SUFFIX_SIZE]='\0';
+	}else{
+		if(!(out=malloc(insz+BATCH_SUFFIX_SIZE+1))){
+			critmalloc(insz+BATCH_SUFFIX_SIZE+1,"");
+			return NULL;
+		}
+		memcpy(out,in,insz);
+		memcpy(out+insz,BATCH_SUFFIX,BATCH_SUFFIX_SIZE+1);
+	}
+	return out;
+}
+
+static char *darc_batch_strdup(const char*s,size_t sz){
+	char *d=malloc(sz+1);
+	if(!d){
+		critmalloc(sz+1,"");
+		return NULL;
+	}
+	memcpy(d,s,sz);
+	d[sz]='\0';
+	return d;
+}
+
+/* Every regular file of the directory that is not compressed already on
+compression, or that ends with BATCH_SUFFIX on decompression. */
+static SET_INI_BOOLEAN darc_batch_scan_dir(struct darc_batch*b,size_t*cap,const char*path){
+	DIR *d=opendir(path);
+	if(!d){
+		errnolog("Can't open directory '%s'",path);
+		return SET_INI_FALSE;
+	}
+	size_t psz=strlen(path);
+	struct dirent *de;
+	while((errno=0,de=readdir(d))){
+		size_t nsz=strlen(de->d_name),fsz=psz+1+nsz;
+		char *in=malloc(fsz+1),*out=NULL;
+		if(!in){
+			critmalloc(fsz+1,"");
+			closedir(d);
+			return SET_INI_FALSE;
+		}
+		memcpy(in,path,psz);
+		in[psz]='/';
+		memcpy(in+psz+1,de->d_name,nsz+1);
+		struct stat st;
+		if(stat(in,&st) || !S_ISREG(st.st_mode) || (!b->report && ((!b->inflating && fsz>BATCH_SUFFIX_SIZE &&
+			!memcmp(in+fsz-BATCH_SUFFIX_SIZE,BATCH_SUFFIX,BATCH_SUFFIX_SIZE)) ||
+			!(out=darc_batch_default_output(in,fsz,b->inflating))))){
+			free(in);
+			continue;
+		}
+		if(!darc_batch_add(b,cap,in,out)){
+			free(out);
+			free(in);
+			closedir(d);
+			return SET_INI_FALSE;
+		}
+	}
+	SET_INI_BOOLEAN r=!errno;
+	if(!r)
+		errnolog("Can't read directory '%s'",path);
+	closedir(d);
+	return r;
+}
+
+/* One pair per line: the input path, then optionally a tab and the output path. */
+static SET_INI_BOOLEAN darc_batch_read_list(struct darc_batch*b,size_t*cap,const char*path,size_t ibs){
+	FILE *f=fopen64(path,"rb");
+	if(!f){
+		errnolog("Can't open file '%s'",path);
+		return SET_INI_FALSE;
+	}
+	size_t lsz;
+	char *list=(char*)darc_slurp(f,ibs,&lsz);
+	fclose(f);
+	if(!list)
+		return SET_INI_FALSE;
+	SET_INI_BOOLEAN r=SET_INI_TRUE;
+	for(size_t p=0,l=1;p<lsz && r;++l){
+		size_t e=p,t;
+		while(e<lsz && list[e]!='\n')
+			++e;
+		for(t=p;t<e && list[t]!='\t';++t);
+		char *in=NULL,*out=NULL;
+		if(t>p && !(in=darc_batch_strdup(list+p,t-p))){
+			r=SET_INI_FALSE;
+		}else if(in && !b->report && !(out=t<e?darc_batch_strdup(list+t+1,e-t-1):
+			darc_batch_default_output(in,t-p,b->inflating))){
+			if(t==e && b->inflating)
+				elog("%s:%zu: no output file for '%s'.",path,l,in);
+			r=SET_INI_FALSE;
+		}else if(in && !darc_batch_add(b,cap,in,out)){
+			r=SET_INI_FALSE;
+		}
+		if(!r){
+			free(out);
+			free(in);
+		}
+		p=e+1;
+	}
+	free(list);
+	return r;
+}
+
+enum darc_batch_result{
+	darc_batch_ok,darc_batch_list_error,darc_batch_critical_malloc_error,
+	darc_batch_init_error,darc_batch_thread_error,darc_batch_file_error
+};
+
+static int darc_batch(const char*path,SET_INI_BOOLEAN inflating,int level,size_t ibs,size_t obs,
+size_t nthreads,const struct darc_dict*dict,FILE*report){
+	struct darc_batch b={.inflating=inflating,.report=report,.ibs=ibs,.dict=dict};
+	size_t cap=0,nw=0;
+	struct darc_batch_worker *w=NULL;
+	int r=darc_batch_ok;
+	struct stat st;
+	if(stat(path,&st)){
+		errnolog("Can't stat '%s'",path);
+		return darc_batch_list_error;
+	}
+	if(!(S_ISDIR(st.st_mode)?darc_batch_scan_dir(&b,&cap,path):darc_batch_read_list(&b,&cap,path,ibs))){
+		r=darc_batch_list_error;
+		goto l_end;
+	}
+	if(nthreads>b.n)
+		nthreads=b.n;
+	if(nthreads && !(w=calloc(nthreads,sizeof(*w)))){
+		critmalloc(nthreads*sizeof(*w),"");
+		r=darc_batch_critical_malloc_error;
+		goto l_end;
+	}
+	pthread_mutex_init(&b.mutex,NULL);
+	for(;nw<nthreads;++nw){
+		w[nw].b=&b;
+		if(!report && !(w[nw].ctx=darc_ctx_new(inflating,level))){
+			elog("%s: Initialization failed.",inflating?"inflateInit":"deflateInit");
+			r=darc_batch_init_error;
+			break;
+		}
+		int e;
+		if(!report && ((e=inflating?DARC_OK:darc_ctx_set_params(w[nw].ctx,opt_window_bits,opt_mem_level,
+		opt_strategy))!=DARC_OK || (e=darc_ctx_set_buffers(w[nw].ctx,ibs,obs))!=DARC_OK ||
+		(dict && (e=darc_ctx_set_dictionary(w[nw].ctx,dict->data,dict->size))!=DARC_OK))){
+			elog("The context can't be set up: %s.",darc_status_string(e));
+			darc_ctx_free(w[nw].ctx);
+			r=darc_batch_init_error;
+			break;
+		}
+		if(pthread_create(&w[nw].thread,NULL,darc_batch_worker,w+nw)){
+			elog("Can't create a thread.");
+			darc_ctx_free(w[nw].ctx);
+			r=darc_batch_thread_error;
+			break;
+		}
+	}
+	if(r!=darc_batch_ok){
+		pthread_mutex_lock(&b.mutex);
+		b.next=b.n;
+		pthread_mutex_unlock(&b.mutex);
+	}
+	for(size_t n=0;n<nw;++n){
+		pthread_join(w[n].thread,NULL);
+		darc_ctx_free(w[n].ctx);
+	}
+	pthread_mutex_destroy(&b.mutex);
+	if(r==darc_batch_ok && b.failed){
+		elog("%zu of %zu files failed.",b.failed,b.n);
+		r=darc_batch_file_error;
+	}
+l_end:
+	free(w);
+	for(size_t n=0;n<b.n;++n){
+		free(b.in[n]);
+		free(b.out[n]);
+	}
+	free(b.in);
+	free(b.out);
+	return r;
+}
+
+enum darc_archive_result{
+	darc_archive_ok,darc_archive_critical_malloc_error,darc_archive_input_error,
+	darc_archive_codec_error,darc_archive_not_found_error,darc_archive_fwrite_error
+};
+
+static darc_archive *darc_archive_load(const char*path){
+	int s;
+	darc_archive *a=darc_archive_open(path,&s);
+	if(!a){
+		if(s==DARC_READ_ERROR)
+			errnolog("Can't read archive '%s'",path);
+		else
+			elog("'%s': %s.",path,darc_status_string(s));
+	}
+	return a;
+}
+
+enum darc_archive_item_state{
+	darc_archive_item_pending,darc_archive_item_packed,darc_archive_item_failed
+};
+
+struct darc_archive_item{
+	char *path;
+	const char *name;
+	size_t namesz;
+	const struct darc_member *base;
+	struct darc_member m;
+	const Bytef *map;
+	size_t mapsz;
+	Bytef *data,*buf;
+	enum darc_archive_item_state state;
+};
+
+struct darc_archive_build{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct darc_archive_item *items;
+	size_t n,next,added,window,ibs;
+	SET_INI_BOOLEAN stop;
+};
+
+struct darc_archive_worker{
+	pthread_t thread;
+	struct darc_archive_build *b;
+	darc_ctx *ctx;
+};
+
+static void darc_archive_item_free(struct darc_archive_item*it){
+	if(it->map)
+		munmap((void*)it->map,it->mapsz);
+	free(it->data);
+	free(it->buf);
+	it->map=it->data=it->buf=NULL;
+}
+
+static SET_INI_BOOLEAN darc_archive_item_pack(struct darc_archive_item*it,darc_ctx*ctx,size_t ibs){
+	FILE *f=fopen64(it->path,"rb");
+	if(!f){
+		errnolog("Can't open file '%s'",it->path);
+		return SET_INI_FALSE;
+	}
+	size_t sz=0;
+	SET_INI_BOOLEAN r=darc_map_file(f,&it->map,&sz) || (it->data=darc_slurp(f,ibs,&sz));
+	fclose(f);
+	if(!r)
+		return SET_INI_FALSE;
+	if(it->map)
+		it->mapsz=sz;
+	size_t bound=darc_compress_bound(sz);
+	if(!(it->buf=malloc(bound))){
+		critmalloc(bound,"");
+		return SET_INI_FALSE;
+	}
+	int s=darc_archive_pack(ctx,it->map?it->map:it->data,sz,it->buf,&bound,&it->m);
+	if(s!=DARC_OK){
+		elog("'%s': %s.",it->path,darc_status_string(s));
+		return SET_INI_FALSE;
+	}
+	if(it->m.stored){
+		free(it->buf);
+		it->buf=NULL;
+	}else{
+		Bytef *buf=it->buf;
+		it->buf=NULL;
+		darc_archive_item_free(it);
+		it->buf=buf;
+	}
+	return SET_INI_TRUE;
+}
+
+/* Workers stay at most window members ahead of the ones already written, so
+the packed data waiting for its turn is bounded. */
+static void *darc_archive_worker(void*arg){
+	struct darc_archive_worker *w=arg;
+	struct darc_archive_build *b=w->b;
+	while(1){
+		pthread_mutex_lock(&b->mutex);
+		while(1){
+			while(b->next<b->n && b->items[b->next].base)
+				++b->next;
+			if(b->stop || b->next==b->n || b->next<b->added+b->window)
+				break;
+			pthread_cond_wait(&b->cond,&b->mutex);
+		}
+		if(b->stop || b->next==b->n){
+			pthread_mutex_unlock(&b->mutex);
+			break;
+		}
+		struct darc_archive_item *it=b->items+b->next++;
+		pthread_mutex_unlock(&b->mutex);
+		SET_INI_BOOLEAN ok=darc_archive_item_pack(it,w->ctx,b->ibs);
+		pthread_mutex_lock(&b->mutex);
+		it->state=ok?darc_archive_item_packed:darc_archive_item_failed;
+		pthread_cond_broadcast(&b->cond);
+		pthread_mutex_unlock(&b->mutex);
+	}
+	return NULL;
+}
+
+/* Members are listed in inf one per line: the path, then optionally a tab
+and the name to store it under(the path by default). A line with a name but
+no path takes that member from the base archive as it is, without
+recompressing it. The listed files are compressed on nthreads threads. */
+static int darc_archive_create(FILE*inf,FILE*outf,int level,size_t ibs,size_t nthreads,const char*basepath){
+	size_t lsz,cap=0,nw=0;
+	char *list=(char*)darc_slurp(inf,ibs,&lsz);
+	if(!list)
+		return darc_archive_input_error;
+	struct darc_archive_build b={.ibs=ibs,.window=nthreads*2};
+	struct darc_archive_worker *w=NULL;
+	darc_archive_writer *aw=NULL;
+	darc_archive *base=NULL;
+	int r=darc_archive_ok;
+	if(basepath && !(base=darc_archive_load(basepath))){
+		free(list);
+		return darc_archive_input_error;
+	}
+	for(size_t p=0,l=1;p<lsz && r==darc_archive_ok;++l){
+		size_t e=p,t;
+		while(e<lsz && list[e]!='\n')
+			++e;
+		for(t=p;t<e && list[t]!='\t';++t);
+		if(e>p){
+			if(b.n==cap){
+				size_t ncap=cap?cap*2:64;
+				struct darc_archive_item *ni=realloc(b.items,ncap*sizeof(*ni));
+				if(!ni){
+					critrealloc(ncap*sizeof(*ni),"");
+					r=darc_archive_critical_malloc_error;
+					break;
+				}
+				b.items=ni;
+				cap=ncap;
+			}
+			struct darc_archive_item *it=memset(b.items+b.n,0,sizeof(*b.items));
+			it->name=t<e?list+t+1:list+p;
+			it->namesz=t<e?e-t-1:t-p;
+			if(t>p){
+				if(!(it->path=darc_batch_strdup(list+p,t-p)))
+					r=darc_archive_critical_malloc_error;
+			}else if(!base){
+				elog("%zu: '%.*s' has no path and there is no base archive(base=).",l,(int)it->namesz,it->name);
+				r=darc_archive_input_error;
+			}else if(!(it->base=darc_archive_find(base,it->name,it->namesz))){
+				elog("No member '%.*s' in '%s'.",(int)it->namesz,it->name,basepath);
+				r=darc_archive_not_found_error;
+			}
+			if(r==darc_archive_ok)
+				++b.n;
+		}
+		p=e+1;
+	}
+	if(r!=darc_archive_ok)
+		goto l_end;
+	if(!(aw=darc_archive_writer_new(level,darc_stdio_write,outf))){
+		clog("While trying to create an archive writer.");
+		r=darc_archive_critical_malloc_error;
+		goto l_end;
+	}
+	if(nthreads>b.n)
+		nthreads=b.n;
+	if(nthreads && !(w=calloc(nthreads,sizeof(*w)))){
+		critmalloc(nthreads*sizeof(*w),"");
+		r=darc_archive_critical_malloc_error;
+		goto l_end;
+	}
+	pthread_mutex_init(&b.mutex,NULL);
+	pthread_cond_init(&b.cond,NULL);
+	for(;nw<nthreads;++nw){
+		w[nw].b=&b;
+		if(!(w[nw].ctx=darc_ctx_new(0,level))){
+			elog("deflateInit: Initialization failed.");
+			break;
+		}
+		if(pthread_create(&w[nw].thread,NULL,darc_archive_worker,w+nw)){
+			elog("Can't create a thread.");
+			darc_ctx_free(w[nw].ctx);
+			break;
+		}
+	}
+	if(!nw && nthreads)
+		r=darc_archive_codec_error;
+	for(size_t n=0;n<b.n && r==darc_archive_ok;++n){
+		struct darc_archive_item *it=b.items+n;
+		int s;
+		if(it->base){
+			s=darc_archive_copy(aw,base,it->base,it->name,it->namesz);
+		}else{
+			pthread_mutex_lock(&b.mutex);
+			while(it->state==darc_archive_item_pending)
+				pthread_cond_wait(&b.cond,&b.mutex);
+			pthread_mutex_unlock(&b.mutex);
+			if(it->state==darc_archive_item_failed){
+				r=darc_archive_input_error;
+				break;
+			}
+			s=darc_archive_add_packed(aw,it->name,it->namesz,&it->m,
+				it->buf?it->buf:it->map?it->map:it->data);
+			darc_archive_item_free(it);
+		}
+		if(s!=DARC_OK){
+			elog("'%.*s': %s.",(int)it->namesz,it->name,darc_status_string(s));
+			r=s==DARC_WRITE_ERROR?darc_archive_fwrite_error:
+				s==DARC_READ_ERROR?darc_archive_input_error:darc_archive_codec_error;
+		}
+		pthread_mutex_lock(&b.mutex);
+		b.added=n+1;
+		pthread_cond_broadcast(&b.cond);
+		pthread_mutex_unlock(&b.mutex);
+	}
+	pthread_mutex_lock(&b.mutex);
+	b.stop=SET_INI_TRUE;
+	pthread_cond_broadcast(&b.cond);
+	pthread_mutex_unlock(&b.mutex);
+	for(size_t n=0;n<nw;++n){
+		pthread_join(w[n].thread,NULL);
+		darc_ctx_free(w[n].ctx);
+	}
+	pthread_cond_destroy(&b.cond);
+	pthread_mutex_destroy(&b.mutex);
+l_end:
+	if(aw){
+		int s=darc_archive_finish(aw);
+		if(r==darc_archive_ok && s!=DARC_OK){
+			elog("%s.",darc_status_string(s));
+			r=s==DARC_WRITE_ERROR?darc_archive_fwrite_error:darc_archive_codec_error;
+		}
+	}
+	free(w);
+	for(size_t n=0;n<b.n;++n){
+		darc_archive_item_free(b.items+n);
+		free(b.items[n].path);
+	}
+	free(b.items);
+	darc_archive_close(base);
+	free(list);
+	return r;
+}
+
+static int darc_archive_get(const char*path,const char*name,FILE*outf){
+	darc_archive *a=darc_archive_load(path);
+	if(!a)
+		return darc_archive_input_error;
+	int r=darc_archive_ok;
+	const struct darc_member *m=darc_archive_find(a,name,strlen(name));
+	if(!m){
+		elog("No member '%s' in '%s'.",name,path);
+		r=darc_archive_not_found_error;
+	}else{
+		int s=darc_archive_extract(a,m,darc_stdio_write,outf);
+		if(s!=DARC_OK){
+			elog("'%s': %s.",name,darc_status_string(s));
+			r=s==DARC_WRITE_ERROR?darc_archive_fwrite_error:darc_archive_codec_error;
+		}
+	}
+	darc_archive_close(a);
+	return r;
+}
+
+/* One line per member: the expanded and the stored sizes and the name. */
+static int darc_archive_list(const char*path,FILE*outf){
+	darc_archive *a=darc_archive_load(path);
+	if(!a)
+		return darc_archive_input_error;
+	int r=darc_archive_ok;
+	for(size_t n=0;n<darc_archive_count(a) && r==darc_archive_ok;++n){
+		const struct darc_member *m=darc_archive_member(a,n);
+		if(fprintf(outf,"%llu\t%llu\t%.*s\n",m->esize,m->csize,(int)m->namesz,m->name)<0){
+			elog("Output error.");
+			r=darc_archive_fwrite_error;
+		}
+	}
+	darc_archive_close(a);
+	return r;
+}
+
+#define SERVE_MAGIC "DARS"
+#define SERVE_MAGIC_SIZE 4
+#define SERVE_VERSION 1
+#define SERVE_HEADER_SIZE 8
+#define SERVE_LEVELS 11
+#define SERVE_BACKLOG 128
+
+/* --serve: a daemon that does the work of --client over a Unix socket, so a
+short job costs a connection instead of a process. A request is SERVE_MAGIC,
+the version, 1 to decompress or 0, the level+1 and a reserved byte, then the
+data until the client shuts down its writing. The reply is the output in
+chunks of an uint32le size and the bytes, ended by a chunk of size 0 and the
+uint32le darc_status of the request. Each worker thread keeps a context per
+direction and level, made on the first request that needs it(the server's
+own level and decompression up front); compression takes st, wb and ml from
+the server's options. */
+enum darc_serve_result{
+	darc_serve_ok,darc_serve_socket_error,darc_serve_thread_error,darc_serve_protocol_error,
+	darc_serve_fread_error,darc_serve_fwrite_error,darc_serve_remote_error
+};
+
+struct darc_serve{
+	int fd,level;
+	size_t ibs,obs;
+	const struct darc_dict *dict;
+};
+
+static SET_INI_BOOLEAN darc_recv_all(int fd,void*buf,size_t n){
+	while(n){
+		ssize_t r=recv(fd,buf,n,0);
+		if(r<=0){
+			if(r<0 && errno==EINTR)
+				continue;
+			return SET_INI_FALSE;
+		}
+		buf=(char*)buf+r;
+		n-=r;
+	}
+	return SET_INI_TRUE;
+}
+
+static size_t darc_serve_read(void*user,void*buf,size_t size){
+	while(1){
+		ssize_t r=recv(*(int*)user,buf,size,0);
+		if(r>=0)
+			return r;
+		if(errno!=EINTR)
+			return (size_t)-1;
+	}
+}
+
+static int darc_serve_write(void*user,const void*buf,size_t size){
+	Bytef hdr[4];
+	darc_put32le(hdr,size);
+	struct iovec iov[2]={{hdr,4},{(void*)buf,size}};
+	return !darc_writev_all(*(int*)user,iov,2);
+}
+
+static darc_ctx *darc_serve_ctx(const struct darc_serve*sv,darc_ctx*ctx[2][SERVE_LEVELS],int decompress,int level){
+	darc_ctx **c=&ctx[decompress][decompress?0:level+1];
+	if(!*c && (*c=darc_ctx_new(decompress,level))){
+		int e=decompress?DARC_OK:darc_ctx_set_params(*c,opt_window_bits,opt_mem_level,opt_strategy);
+		if(e==DARC_OK)
+			e=darc_ctx_set_buffers(*c,sv->ibs,sv->obs);
+		if(e==DARC_OK && sv->dict)
+			e=darc_ctx_set_dictionary(*c,sv->dict->data,sv->dict->size);
+		if(e!=DARC_OK){
+			elog("The context can't be set up: %s.",darc_status_string(e));
+			darc_ctx_free(*c);
+			*c=NULL;
+		}
+	}
+	return *c;
+}
+
+/* Decompresses the zlib members of a request one after another, as darc d
+does. A member of the blocked or dedup format, which only darc d reads, ends
+the request with DARC_FORMAT_ERROR instead of a broken zlib header. */
+static int darc_serve_inflate(darc_ctx*c,int fd,Bytef*buf,size_t bs){
+	size_t len=0,members=0;
+	int e;
+	while(1){
+		/* Enough of the start of a member to tell the format. */
+		while(len<BLOCKED_MAGIC_SIZE){
+			size_t n=darc_serve_read(&fd,buf+len,bs-len);
+			if(n==(size_t)-1)
+				return DARC_READ_ERROR;
+			if(!n)
+				break;
+			len+=n;
+		}
+		if(!len)
+			return members?DARC_OK:DARC_TRUNCATED;
+		if(len>=BLOCKED_MAGIC_SIZE && (!memcmp(buf,BLOCKED_MAGIC,BLOCKED_MAGIC_SIZE) ||
+		!memcmp(buf,DEDUP_MAGIC,DEDUP_MAGIC_SIZE)))
+			return DARC_FORMAT_ERROR;
+		if((e=darc_ctx_reset(c))!=DARC_OK)
+			return e;
+		const Bytef *p=buf;
+		while(1){
+			size_t n=len;
+			if((e=darc_ctx_push_member(c,p,&n,darc_serve_write,&fd))!=DARC_OK)
+				return e;
+			p+=len-n;
+			len=n;
+			if(darc_ctx_at_end(c))
+				break;
+			p=buf;
+			if((len=darc_serve_read(&fd,buf,bs))==(size_t)-1)
+				return DARC_READ_ERROR;
+			if(!len)
+				return DARC_TRUNCATED;
+		}
+		memmove(buf,p,len);
+		++members;
+	}
+}
+
+static void *darc_serve_worker(void*p){
+	const struct darc_serve *sv=p;
+	darc_ctx *ctx[2][SERVE_LEVELS]={{NULL}};
+	darc_serve_ctx(sv,ctx,0,sv->level);
+	darc_serve_ctx(sv,ctx,1,0);
+	size_t bs=sv->ibs<ARCHIVE_MAGIC_SIZE?ARCHIVE_MAGIC_SIZE:sv->ibs;
+	Bytef *buf=malloc(bs);
+	if(!buf)
+		critmalloc(bs,"");
+	while(1){
+		int fd=accept4(sv->fd,NULL,NULL,SOCK_CLOEXEC);
+		if(fd==-1){
+			if(errno==EINTR || errno==ECONNABORTED)
+				continue;
+			/* The listening socket was shut down. */
+			break;
+		}
+		Bytef hdr[SERVE_HEADER_SIZE];
+		int status=DARC_FORMAT_ERROR;
+		if(darc_recv_all(fd,hdr,SERVE_HEADER_SIZE) && !memcmp(hdr,SERVE_MAGIC,SERVE_MAGIC_SIZE) &&
+		hdr[SERVE_MAGIC_SIZE]==SERVE_VERSION && hdr[SERVE_MAGIC_SIZE+1]<2 && hdr[SERVE_MAGIC_SIZE+2]<SERVE_LEVELS){
+			int decompress=hdr[SERVE_MAGIC_SIZE+1];
+			darc_ctx *c=darc_serve_ctx(sv,ctx,decompress,hdr[SERVE_MAGIC_SIZE+2]-1);
+			if(!c || (decompress && !buf))
+				status=DARC_MEM_ERROR;
+			else if(decompress)
+				status=darc_serve_inflate(c,fd,buf,bs);
+			else
+				status=darc_ctx_stream(c,darc_serve_read,&fd,darc_serve_write,&fd);
+		}
+		Bytef end[8];
+		darc_put32le(end,0);
+		darc_put32le(end+4,status);
+		struct iovec iov={end,8};
+		darc_writev_all(fd,&iov,1);
+		close(fd);
+	}
+	for(size_t n=0;n<2*SERVE_LEVELS;++n)
+		if(ctx[n/SERVE_LEVELS][n%SERVE_LEVELS])
+			darc_ctx_free(ctx[n/SERVE_LEVELS][n%SERVE_LEVELS]);
+	free(buf);
+	return NULL;
+}
+
+static SET_INI_BOOLEAN darc_socket_address(struct sockaddr_un*a,const char*path){
+	memset(a,0,sizeof(*a));
+	a->sun_family=AF_UNIX;
+	if(strlen(path)>=sizeof(a->sun_path)){
+		elog("The socket path is too long '%s'.",path);
+		return SET_INI_FALSE;
+	}
+	strcpy(a->sun_path,path);
+	return SET_INI_TRUE;
+}
+
+/* Serves until SIGINT or SIGTERM; the requests in progress are finished. */
+static int darc_serve(const char*path,size_t nthreads,int level,size_t ibs,size_t obs,const struct darc_dict*dict){
+	struct sockaddr_un a;
+	if(!darc_socket_address(&a,path))
+		return darc_serve_socket_error;
+	struct darc_serve sv={.level=level,.ibs=ibs,.obs=obs,.dict=dict};
+	if((sv.fd=socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0))==-1){
+		errnolog("Can't create a socket");
+		return darc_serve_socket_error;
+	}
+	/* A socket left behind by a server that is gone is replaced. */
+	struct stat st;
+	if(!lstat(path,&st) && S_ISSOCK(st.st_mode)){
+		if(!connect(sv.fd,(struct sockaddr*)&a,sizeof(a))){
+			elog("'%s' is being served already.",path);
+			close(sv.fd);
+			return darc_serve_socket_error;
+		}
+		unlink(path);
+	}
+	if(bind(sv.fd,(struct sockaddr*)&a,sizeof(a)) || listen(sv.fd,SERVE_BACKLOG)){
+		errnolog("Can't listen on '%s'",path);
+		close(sv.fd);
+		return darc_serve_socket_error;
+	}
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set,SIGINT);
+	sigaddset(&set,SIGTERM);
+	pthread_sigmask(SIG_BLOCK,&set,NULL);
+	signal(SIGPIPE,SIG_IGN);
+	pthread_t *threads=malloc(nthreads*sizeof(*threads));
+	int r=darc_serve_ok;
+	size_t n=0;
+	if(!threads){
+		critmalloc(nthreads*sizeof(*threads),"");
+		r=darc_serve_thread_error;
+	}
+	for(;r==darc_serve_ok && n<nthreads;++n){
+		int e=pthread_create(threads+n,NULL,darc_serve_worker,&sv);
+		if(e){
+			elog("pthread_create: %s.",strerror(e));
+			r=darc_serve_thread_error;
+			break;
+		}
+	}
+	if(r==darc_serve_ok){
+		int sig;
+		sigwait(&set,&sig);
+	}
+	shutdown(sv.fd,SHUT_RDWR);
+	while(n)
+		pthread_join(threads[--n],NULL);
+	free(threads);
+	close(sv.fd);
+	unlink(path);
+	return r;
+}
+
+struct darc_client_send{
+	pthread_t thread;
+	int fd;
+	FILE *inf;
+	Bytef *buf;
+	size_t ibs;
+	SET_INI_BOOLEAN failed;
+};
+
+static void *darc_client_sender(void*p){
+	struct darc_client_send *s=p;
+	size_t n;
+	while((n=darc_stats_fread(s->buf,s->ibs,s->inf))){
+		struct iovec iov={s->buf,n};
+		if(!darc_writev_all(s->fd,&iov,1))
+			break;
+	}
+	if(ferror(s->inf)){
+		elog("Input error.");
+		s->failed=SET_INI_TRUE;
+	}
+	shutdown(s->fd,SHUT_WR);
+	return NULL;
+}
+
+/* The options --serve(client FALSE) or --client can't carry out, so that
+neither makes anything other than what the same options make locally; the
+client's streams take st, wb, ml and dict from the server. Input of the
+blocked and dedup formats is refused by the server as it comes. */
+static const char *darc_serve_unsupported(SET_INI_BOOLEAN client){
+	if(opt_blocked)
+		return "b";
+	if(opt_dedup)
+		return "dd";
+	if(opt_adaptive)
+		return "ad";
+	if(opt_strategy==STRATEGY_AUTO)
+		return "st=auto";
+	if(opt_checkpoint_file)
+		return "ck";
+	if(opt_flush_interval || opt_flush_bytes || opt_follow)
+		return opt_follow?"follow":opt_flush_interval?"fi":"fb";
+	if(opt_async_io || opt_io_uring)
+		return opt_async_io?"aio":"uring";
+	if(opt_test || opt_batch_file)
+		return opt_test?"test":"batch";
+	if(opt_archive || opt_list || opt_extract_name)
+		return opt_archive?"a":opt_list?"ls":"x";
+	if(opt_bench || opt_build_index || opt_range || opt_index_file)
+		return opt_bench?"bench":opt_build_index?"bi":opt_range?"off/len":"idx";
+	if(!client)
+		return opt_client_path?"client":NULL;
+	if(opt_strategy!=Z_DEFAULT_STRATEGY)
+		return "st";
+	if(opt_window_bits!=MAX_WBITS || opt_mem_level!=DEFAULT_MEM_LEVEL)
+		return opt_window_bits!=MAX_WBITS?"wb":"ml";
+	if(opt_dict_file)
+		return "dict";
+	return NULL;
+}
+
+/* --client: the data from inf goes to the server at path and its output to
+outf, the input sent by a thread of its own while the output comes back. */
+static int darc_client(const char*path,FILE*inf,FILE*outf,SET_INI_BOOLEAN decompress,int level,size_t ibs,size_t obs){
+	struct sockaddr_un a;
+	if(!darc_socket_address(&a,path))
+		return darc_serve_socket_error;
+	struct darc_client_send s={.inf=inf,.ibs=ibs};
+	if((s.fd=socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0))==-1 || connect(s.fd,(struct sockaddr*)&a,sizeof(a))){
+		errnolog("Can't connect to '%s'",path);
+		if(s.fd!=-1)
+			close(s.fd);
+		return darc_serve_socket_error;
+	}
+	signal(SIGPIPE,SIG_IGN);
+	Bytef hdr[SERVE_HEADER_SIZE]={0};
+	memcpy(hdr,SERVE_MAGIC,SERVE_MAGIC_SIZE);
+	hdr[SERVE_MAGIC_SIZE]=SERVE_VERSION;
+	hdr[SERVE_MAGIC_SIZE+1]=decompress;
+	hdr[SERVE_MAGIC_SIZE+2]=level+1;
+	struct iovec iov={hdr,SERVE_HEADER_SIZE};
+	Bytef *obuf=malloc(obs);
+	int r=darc_serve_ok,e;
+	if(!obuf || !(s.buf=malloc(ibs))){
+		critmalloc(obuf?ibs:obs,"");
+		free(obuf);
+		close(s.fd);
+		return darc_serve_thread_error;
+	}
+	if(!darc_writev_all(s.fd,&iov,1)){
+		errnolog("Can't send the request");
+		r=darc_serve_socket_error;
+	}else if((e=pthread_create(&s.thread,NULL,darc_client_sender,&s))){
+		elog("pthread_create: %s.",strerror(e));
+		r=darc_serve_thread_error;
+	}else{
+		while(1){
+			Bytef chunk[4];
+			if(!darc_recv_all(s.fd,chunk,4)){
+				elog("The server closed the connection.");
+				r=darc_serve_protocol_error;
+				break;
+			}
+			uint32_t n=darc_get32le(chunk);
+			if(!n){
+				if(!darc_recv_all(s.fd,chunk,4)){
+					elog("The server closed the connection.");
+					r=darc_serve_protocol_error;
+				}else if((e=darc_get32le(chunk))==DARC_FORMAT_ERROR && decompress){
+					elog("The input holds a member of the blocked or dedup format, which --client can't "
+						"decompress; use d without client.");
+					r=darc_serve_remote_error;
+				}else if(e!=DARC_OK){
+					elog("The server failed: %s.",darc_status_string(e));
+					r=darc_serve_remote_error;
+				}
+				break;
 			}
-			if(!cmp.avail_in)
+			while(n && r==darc_serve_ok){
+				size_t c=n<obs?n:obs;
+				if(!darc_recv_all(s.fd,obuf,c)){
+					elog("The server closed the connection.");
+					r=darc_serve_protocol_error;
+				}else if(darc_stats_fwrite(obuf,c,outf)!=c){
+					elog("Output error.");
+					r=darc_serve_fwrite_error;
+				}
+				n-=c;
+			}
+			if(r!=darc_serve_ok)
 				break;
-			cmp.next_in=ibuf;
-		}while(1);
+		}
+		/* The sender is stuck no longer once the socket is gone. */
+		shutdown(s.fd,SHUT_RDWR);
+		pthread_join(s.thread,NULL);
+		if(s.failed && r==darc_serve_ok)
+			r=darc_serve_fread_error;
 	}
-	return darc_decompress_no_data_error;
+	close(s.fd);
+	free(s.buf);
+	free(obuf);
+	return r;
 }
 
 int main(int i,char**v){
@@ -733,7 +5347,7 @@ int main(int i,char**v){
 				if(opt_syntax_error==SET_INI_FALSE){
 					if(opt_show_help==SET_INI_TRUE || opt_show_version==SET_INI_TRUE){
 						if(opt_show_help){
-							ilog("\n+-------------------+------------+------------------+------------+\n|   long options    |   short    |    vaue type     |description |\n|                   |  options   |                  |            |\n+-------------------+------------+------------------+------------+\n|      --help       |     h      |     boolean      | show this  |\n|                   |            |                  |    help    |\n+-------------------+------------+------------------+------------+\n|     --version     |     v      |     boolean      |show version|\n+-------------------+------------+------------------+------------+\n|   --decompress    |     d      |     boolean      | decompress |\n|                   |            |                  | input data |\n+-------------------+------------+------------------+------------+\n|                   |            |     [-1..9]|     |compression |\n|--compression-level|     l      |none|default|speed|   level    |\n|                   |            |                  |            |\n+-------------------+------------+------------------+------------+\n|                   |            |                  |input buffer|\n| --in-buffer-size  |    ibs     |      size_t      |    size    |\n|                   |            |                  |            |\n+-------------------+------------+------------------+------------+\n| --out-buffer-size |    obs     |      size_t      |   output   |\n|                   |            |                  |buffer size |\n+-------------------+------------+------------------+------------+\n|     --in-file     |     i      |      string      | read data  |\n|                   |            |                  |from a file |\n+-------------------+------------+------------------+------------+\n|    --out-file     |     o      |      string      | write data |\n|                   |            |                  | to a file  |\n+-------------------+------------+------------------+------------+\n|                   |            |                  |  to load   |\n|     --in-conf     |     c      |      string      |  settings  |\n|                   |            |                  |from a file |\n+-------------------+------------+------------------+------------+\nsize_t:[1..%zu]\n",typemax(size_t));
+							ilog("\n+-------------------+------------+------------------+------------+\n|   long options    |   short    |    vaue type     |description |\n|                   |  options   |                  |            |\n+-------------------+------------+------------------+------------+\n|      --help       |     h      |     boolean      | show this  |\n|                   |            |                  |    help    |\n+-------------------+------------+------------------+------------+\n|     --version     |     v      |     boolean      |show version|\n+-------------------+------------+------------------+------------+\n|   --decompress    |     d      |     boolean      | decompress |\n|                   |            |                  | input data |\n+-------------------+------------+------------------+------------+\n|                   |            |     [-1..9]|     |compression |\n|--compression-level|     l      |none|default|speed|   level    |\n|                   |            |                  |            |\n+-------------------+------------+------------------+------------+\n|     --threads     |     t      |  [1..1024]|auto  | number of  |\n|                   |            |                  |   worker   |\n|                   |            |                  |  threads   |\n+-------------------+------------+------------------+------------+\n|     --blocked     |     b      |     boolean      |  blocked   |\n|                   |            |                  |   output   |\n|                   |            |                  |   format   |\n+-------------------+------------+------------------+------------+\n|    --async-io     |    aio     |     boolean      |  read and  |\n|                   |            |                  |  write in  |\n|                   |            |                  |  separate  |\n|                   |            |                  |  threads   |\n+-------------------+------------+------------------+------------+\n|    --io-uring     |   uring    |     boolean      |asynchronous|\n|                   |            |                  |I/O through |\n|                   |            |                  |  io_uring  |\n+-------------------+------------+------------------+------------+\n| --flush-interval  |     fi     |      uint64      | flush the  |\n|                   |            |                  | output at  |\n|                   |            |                  | most this  |\n|                   |            |                  |  many ms   |\n|                   |            |                  |after input |\n+-------------------+------------+------------------+------------+\n|   --flush-bytes   |     fb     |      uint64      | flush the  |\n|                   |            |                  |output after|\n|                   |            |                  | this many  |\n|                   |            |                  |input bytes |\n+-------------------+------------+------------------+------------+\n|     --follow      |   follow   |     boolean      |keep reading|\n|                   |            |                  | a growing  |\n|                   |            |                  | input file |\n+-------------------+------------+------------------+------------+\n|      --bench      |   bench    |boolean|table|json| benchmark  |\n|                   |            |                  | the codec  |\n|                   |            |                  |  settings  |\n+-------------------+------------+------------------+------------+\n|      --stats      |   stats    |boolean|text|json |report time |\n|                   |            |                  | per phase  |\n|                   |            |                  |    and     |\n|                   |            |                  | throughput |\n+-------------------+------------+------------------+------------+\n|    --adaptive     |     ad     |     boolean      |store random|\n|                   |            |                  |    data    |\n+-------------------+------------+------------------+------------+\n|    --strategy     |     st     |      string      |  deflate   |\n|                   |            |                  |  strategy  |\n+-------------------+------------+------------------+------------+\n|                   |            |   [0..1000]|     |   output   |\n|    --objective    |    obj     |   ratio|speed    | size slack |\n|                   |            |                  | in percent |\n|                   |            |                  |for strategy|\n|                   |            |                  |   =auto    |\n+-------------------+------------+------------------+------------+\n|   --window-bits   |     wb     |     [9..15]      |log2 of the |\n|                   |            |                  |window size |\n+-------------------+------------+------------------+------------+\n|    --mem-level    |     ml     |      [1..9]      | memory for |\n|                   |            |                  | the match  |\n|                   |            |                  |   state    |\n+-------------------+------------+------------------+------------+\n|      --dedup      |     dd     |     boolean      |  replace   |\n|                   |            |                  |  repeated  |\n|                   |            |                  |chunks with |\n|                   |            |                  | references |\n+-------------------+------------+------------------+------------+\n|      --test       |    test    |     boolean      | verify the |\n|                   |            |                  |   input    |\n|                   |            |                  |  without   |\n|                   |            |                  | writing it |\n|                   |            |                  |    out     |\n+-------------------+------------+------------------+------------+\n|     --append      |     ap     |     boolean      | append to  |\n|                   |            |                  | the output |\n|                   |            |                  |    file    |\n+-------------------+------------+------------------+------------+\n|   --build-index   |     bi     |     boolean      |  build an  |\n|                   |            |                  | index of a |\n|                   |            |                  |zlib stream |\n+-------------------+------------+------------------+------------+\n|   --index-span    |    span    |      uint64      |MiB between |\n|                   |            |                  |   index    |\n|                   |            |                  |checkpoints |\n+-------------------+------------+------------------+------------+\n| --in-buffer-size  |    ibs     |   size_t|auto    |input buffer|\n|                   |            |                  |    size    |\n+-------------------+------------+------------------+------------+\n| --out-buffer-size |    obs     |   size_t|auto    |   output   |\n|                   |            |                  |buffer size |\n+-------------------+------------+------------------+------------+\n|     --in-file     |     i      |      string      | read data  |\n|                   |            |                  |from a file |\n+-------------------+------------+------------------+------------+\n|    --out-file     |     o      |      string      | write data |\n|                   |            |                  | to a file  |\n+-------------------+------------+------------------+------------+\n|      --index      |    idx     |      string      |  read the  |\n|                   |            |                  |index from a|\n|                   |            |                  |    file    |\n+-------------------+------------+------------------+------------+\n|     --offset      |    off     |      uint64      | first byte |\n|                   |            |                  |of the range|\n|                   |            |                  | to extract |\n+-------------------+------------+------------------+------------+\n|     --length      |    len     |      uint64      | length of  |\n|                   |            |                  |the range to|\n|                   |            |                  |  extract   |\n+-------------------+------------+------------------+------------+\n|--train-dictionary |     td     |     boolean      |  train a   |\n|                   |            |                  | dictionary |\n|                   |            |                  | on sample  |\n|                   |            |                  |   files    |\n+-------------------+------------+------------------+------------+\n|   --dictionary    |    dict    |      string      |   preset   |\n|                   |            |                  | dictionary |\n|                   |            |                  |    file    |\n+-------------------+------------+------------------+------------+\n|      --batch      |   batch    |      string      |  list or   |\n|                   |            |                  |directory of|\n|                   |            |                  |  files to  |\n|                   |            |                  |  process   |\n+-------------------+------------+------------------+------------+\n|     --archive     |     a      |     boolean      |  make an   |\n|                   |            |                  | archive of |\n|                   |            |                  | the listed |\n|                   |            |                  |   files    |\n+-------------------+------------+------------------+------------+\n|     --extract     |     x      |      string      | extract a  |\n|                   |            |                  |member of an|\n|                   |            |                  |  archive   |\n+-------------------+------------+------------------+------------+\n|      --list       |     ls     |     boolean      |  list the  |\n|                   |            |                  | members of |\n|                   |            |                  | an archive |\n+-------------------+------------+------------------+------------+\n|  --base-archive   |    base    |      string      | archive to |\n|                   |            |                  |    take    |\n|                   |            |                  | unchanged  |\n|                   |            |                  |members from|\n+-------------------+------------+------------------+------------+\n|      --serve      |   serve    |      string      |   serve    |\n|                   |            |                  |--client on |\n|                   |            |                  |   a Unix   |\n|                   |            |                  |   socket   |\n+-------------------+------------+------------------+------------+\n|     --client      |   client   |      string      |  compress  |\n|                   |            |                  | through a  |\n|                   |            |                  |  --serve   |\n|                   |            |                  |   socket   |\n+-------------------+------------+------------------+------------+\n|   --checkpoint    |     ck     |      string      | checkpoint |\n|                   |            |                  |file of the |\n|                   |            |                  |compression |\n+-------------------+------------+------------------+------------+\n| --checkpoint-span |    cks     |      uint64      |MiB between |\n|                   |            |                  |checkpoints |\n+-------------------+------------+------------------+------------+\n|     --resume      |   resume   |     boolean      | go on from |\n|                   |            |                  |    the     |\n|                   |            |                  | checkpoint |\n+-------------------+------------+------------------+------------+\n|                   |            |                  |  to load   |\n|     --in-conf     |     c      |      string      |  settings  |\n|                   |            |                  |from a file |\n+-------------------+------------+------------------+------------+\nsize_t:[1..%zu]\n",typemax(size_t));
 						}
 						if(opt_show_version){
 							ilog(PACKAGE_VERSION);
@@ -750,7 +5364,12 @@ int main(int i,char**v){
 							}
 						}
 						if(opt_out_file){
-							writeto=fopen64(opt_out_file->data,"wb");
+							/* The references of the dedup format are read back from the output;
+							--resume keeps what was written up to the checkpoint. */
+							SET_INI_BOOLEAN resume=opt_resume && opt_checkpoint_file && !opt_decompress;
+							writeto=resume?fopen64(opt_out_file->data,"r+b"):NULL;
+							if(!writeto && (!resume || errno==ENOENT))
+								writeto=fopen64(opt_out_file->data,opt_append?"ab":opt_decompress?"w+b":"wb");
 							if(!writeto){
 								errnolog("Can't open file '%s'",opt_out_file->data);
 								tcstr_free(opt_out_file);
@@ -761,17 +5380,134 @@ int main(int i,char**v){
 								return exit_code;
 							}
 						}
-						if(opt_decompress){
-							exit_code=darc_decompress(readfrom,writeto,
-								opt_in_buf_size,opt_out_buf_size)!=darc_decompress_ok;
+						darc_auto_buffers(readfrom,writeto,opt_decompress,opt_compression_level,
+							&opt_in_buf_size,&opt_out_buf_size);
+						if(opt_stats)
+							darc_stats_begin();
+						struct darc_dict dictbuf,*dict=NULL;
+						const char *unsupported;
+						if(opt_stats && (opt_async_io || opt_io_uring || opt_train_dictionary || opt_serve_path ||
+						opt_client_path || opt_batch_file || opt_archive || opt_list || opt_extract_name || opt_bench ||
+						opt_build_index || (opt_decompress && (opt_range || opt_index_file)))){
+							/* The rings and the other modes do their I/O on threads or unmeasured. */
+							elog("--stats measures compression, decompression and --test without aio or uring.");
+							opt_stats=darc_stats_none;
+							exit_code=1;
+						}else if(opt_train_dictionary){
+							exit_code=darc_train_dictionary(readfrom,writeto,
+								opt_in_buf_size)!=darc_train_dictionary_ok;
+						}else if(opt_dict_file && !(dict=darc_load_dictionary(opt_dict_file->data,
+							opt_in_buf_size,&dictbuf))){
+							exit_code=1;
+						}else if((opt_serve_path || opt_client_path) && (unsupported=darc_serve_unsupported(!opt_serve_path))){
+							elog("'%s' can't be used with --%s.",unsupported,opt_serve_path?"serve":"client");
+							exit_code=1;
+						}else if(opt_serve_path){
+							exit_code=darc_serve(opt_serve_path->data,opt_threads,opt_compression_level,
+								opt_in_buf_size,opt_out_buf_size,dict)!=darc_serve_ok;
+						}else if(opt_client_path){
+							exit_code=darc_client(opt_client_path->data,readfrom,writeto,opt_decompress,
+								opt_compression_level,opt_in_buf_size,opt_out_buf_size)!=darc_serve_ok;
+						}else if(opt_batch_file && !opt_test && !opt_decompress &&
+						(opt_adaptive || opt_strategy==STRATEGY_AUTO)){
+							/* The workers make plain streams, without the per-block tuning. */
+							elog("'%s' can't be used with --batch.",opt_adaptive?"ad":"st=auto");
+							exit_code=1;
+						}else if(opt_batch_file){
+							exit_code=darc_batch(opt_batch_file->data,opt_decompress,opt_compression_level,
+								opt_in_buf_size,opt_out_buf_size,opt_threads,dict,opt_test?writeto:NULL)!=darc_batch_ok;
+						}else if(opt_test){
+							exit_code=!darc_test_file(readfrom,opt_in_file?opt_in_file->data:NULL,
+								opt_in_file?opt_in_file->data:"stdin",writeto,opt_in_buf_size,dict);
+						}else if(opt_archive && opt_append){
+							elog("An archive can't be appended to a file.");
+						}else if(opt_archive){
+							exit_code=darc_archive_create(readfrom,writeto,opt_compression_level,opt_in_buf_size,
+								opt_threads,opt_base_file?opt_base_file->data:NULL)!=darc_archive_ok;
+						}else if(opt_list || opt_extract_name){
+							if(!opt_in_file){
+								elog("The archive is read from a file(i=).");
+							}else if(opt_list){
+								exit_code=darc_archive_list(opt_in_file->data,writeto)!=darc_archive_ok;
+							}else{
+								exit_code=darc_archive_get(opt_in_file->data,opt_extract_name->data,
+									writeto)!=darc_archive_ok;
+							}
+						}else if(opt_bench){
+							exit_code=darc_bench(opt_in_file?readfrom:NULL,writeto,opt_bench,
+								opt_in_buf_size,opt_threads,opt_blocked)!=darc_bench_ok;
+						}else if(opt_build_index){
+							exit_code=darc_build_index(readfrom,writeto,
+								opt_in_buf_size,opt_index_span<<20,dict)!=darc_build_index_ok;
+						}else if(opt_decompress && (opt_range || opt_index_file)){
+							FILE *idxf=NULL;
+							if(opt_index_file && !(idxf=fopen64(opt_index_file->data,"rb"))){
+								errnolog("Can't open file '%s'",opt_index_file->data);
+							}else{
+								exit_code=darc_extract_range(readfrom,idxf,writeto,opt_offset,
+									opt_length,opt_in_buf_size,opt_out_buf_size,dict)!=darc_extract_range_ok;
+								if(idxf)
+									fclose(idxf);
+							}
+						}else if(opt_decompress){
+							if(opt_async_io || opt_io_uring){
+								exit_code=darc_decompress_async(readfrom,writeto,
+									opt_in_buf_size,opt_out_buf_size,opt_threads,dict)!=darc_decompress_ok;
+							}else{
+								exit_code=darc_decompress(readfrom,writeto,NULL,0,
+									opt_in_buf_size,opt_out_buf_size,opt_threads,dict)!=darc_decompress_ok;
+							}
 						}else{
-							exit_code=darc_compress(readfrom,writeto,
-								opt_compression_level,opt_in_buf_size,opt_out_buf_size)!=darc_compress_ok;
+							const Bytef *map=NULL;
+							size_t mapsz=0;
+							struct darc_tune tunebuf,*tune=NULL;
+							SET_INI_BOOLEAN live=opt_flush_interval || opt_flush_bytes || opt_follow;
+							if(opt_in_file && !live)
+								darc_map_file(readfrom,&map,&mapsz);
+							if(opt_checkpoint_file && (live || opt_dedup || opt_blocked || opt_append)){
+								elog("--checkpoint makes a plain zlib stream of its own(no fi, fb, follow, dd, b or ap).");
+								exit_code=1;
+							}else if(live){
+								exit_code=darc_compress_live(readfrom,writeto,opt_compression_level,opt_in_buf_size,
+									opt_out_buf_size,dict,!opt_flush_interval && !opt_flush_bytes?FOLLOW_FLUSH_INTERVAL:
+									opt_flush_interval,opt_flush_bytes,opt_follow)!=darc_compress_ok;
+							}else if(opt_dedup){
+								exit_code=darc_compress_dedup(readfrom,map,mapsz,writeto,opt_compression_level,
+									opt_in_buf_size,opt_out_buf_size,dict)!=darc_compress_ok;
+							}else if(opt_compression_level==Z_NO_COMPRESSION && !opt_blocked && !dict && !opt_checkpoint_file){
+								exit_code=darc_compress_stored(readfrom,map,mapsz,writeto,
+									opt_in_buf_size)!=darc_compress_ok;
+							}else if((opt_adaptive || opt_strategy==STRATEGY_AUTO) &&
+								!(tune=darc_tune_start(&tunebuf,opt_compression_level,opt_adaptive))){
+								exit_code=1;
+							}else if(opt_checkpoint_file){
+								struct darc_checkpoint ck={.path=opt_checkpoint_file->data,.fd=-1,
+									.span=opt_checkpoint_span<<20,.resume=opt_resume};
+								exit_code=darc_compress(readfrom,map,mapsz,writeto,opt_compression_level,
+									opt_in_buf_size,opt_out_buf_size,tune,dict,&ck)!=darc_compress_ok;
+								darc_checkpoint_end(&ck,!exit_code);
+							}else if(opt_threads>1 || opt_blocked){
+								exit_code=darc_compress_parallel(readfrom,map,mapsz,writeto,opt_compression_level,
+									opt_in_buf_size,opt_threads,opt_blocked,tune,dict)!=darc_compress_parallel_ok;
+							}else if(opt_async_io || opt_io_uring){
+								exit_code=darc_compress_async(readfrom,map,mapsz,writeto,
+									opt_compression_level,opt_in_buf_size,opt_out_buf_size,tune,dict)!=darc_compress_ok;
+							}else{
+								exit_code=darc_compress(readfrom,map,mapsz,writeto,
+									opt_compression_level,opt_in_buf_size,opt_out_buf_size,tune,dict,NULL)!=darc_compress_ok;
+							}
+							darc_tune_stop(tune);
+							if(map)
+								munmap((void*)map,mapsz);
 						}
+						if(dict)
+							free((void*)dict->data);
 						if(opt_out_file){
 							fflush(writeto);
 							fclose(writeto);
 						}
+						if(opt_stats)
+							darc_stats_report(opt_decompress);
 						if(opt_in_file)
 							fclose(readfrom);
 					}
@@ -786,17 +5522,33 @@ int main(int i,char**v){
 				break;
 			}
 		}
+		if(opt_checkpoint_file)
+			tcstr_free(opt_checkpoint_file);
+		if(opt_client_path)
+			tcstr_free(opt_client_path);
+		if(opt_serve_path)
+			tcstr_free(opt_serve_path);
+		if(opt_base_file)
+			tcstr_free(opt_base_file);
+		if(opt_extract_name)
+			tcstr_free(opt_extract_name);
+		if(opt_batch_file)
+			tcstr_free(opt_batch_file);
+		if(opt_dict_file)
+			tcstr_free(opt_dict_file);
+		if(opt_index_file)
+			tcstr_free(opt_index_file);
 		if(opt_out_file)
 			tcstr_free(opt_out_file);
 		if(opt_in_file)
 			tcstr_free(opt_in_file);
 	}else{
 		if(opt_decompress){
-			exit_code=darc_decompress(readfrom,writeto,
-				opt_in_buf_size,opt_out_buf_size)!=darc_decompress_ok;
+			exit_code=darc_decompress(readfrom,writeto,NULL,0,
+				opt_in_buf_size,opt_out_buf_size,opt_threads,NULL)!=darc_decompress_ok;
 		}else{
-			exit_code=darc_compress(readfrom,writeto,
-				opt_compression_level,opt_in_buf_size,opt_out_buf_size)!=darc_compress_ok;
+			exit_code=darc_compress(readfrom,NULL,0,writeto,
+				opt_compression_level,opt_in_buf_size,opt_out_buf_size,NULL,NULL,NULL)!=darc_compress_ok;
 		}
 		fflush(writeto);
 	}